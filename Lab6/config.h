@@ -58,9 +58,25 @@
 #define ALIGNMENT 8  
 
 /* 
- * Maximum heap size in bytes 
+ * Maximum heap size in bytes. Large generated traces (see gentrace)
+ * may need more; override with e.g. make CFLAGS+=-DMAX_HEAP=...
  */
+#ifndef MAX_HEAP
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#endif
+
+/*
+ * Page size used by the huge page heap backend (mdriver -H)
+ */
+#define HUGE_PAGE_SIZE (2*(1<<20))  /* 2 MB */
+
+/*
+ * Binary traces (gentrace -b) start with this magic string, followed by
+ * the four header ints of a .rep file and three ints (type character,
+ * index, size) per request, all in host byte order
+ */
+#define BINTRACE_MAGIC     "MMTRACE1"
+#define BINTRACE_MAGIC_LEN 8
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
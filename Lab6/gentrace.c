@@ -0,0 +1,473 @@
+/*
+ * gentrace.c - Synthetic trace generator for the malloc lab driver
+ *
+ * Writes a trace in the format read by mdriver: either the text .rep
+ * format or the binary format (-b) described in config.h. The shape of
+ * the workload is controlled by a block size distribution, a block
+ * lifetime distribution, a realloc growth pattern, a cap on the number
+ * of live blocks and the total number of requests. Every block is freed
+ * by the end of the trace, and the same seed always produces the same
+ * trace.
+ *
+ * Example:
+ *   gentrace -n 1000000 -L 50000 -s power:1.5,16,65536 -l exp:20000 \
+ *            -r 0.05:geom:1.5 -S 7 -o traces/big-power.rep
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <limits.h>
+
+#include "config.h"
+
+/* Size distributions */
+enum {SIZE_FIXED, SIZE_BIMODAL, SIZE_POWER};
+
+/* Lifetime distributions (in requests) */
+enum {LIFE_FIXED, LIFE_EXP, LIFE_UNIFORM};
+
+/* Realloc growth patterns */
+enum {GROW_LINEAR, GROW_GEOM};
+
+/* Largest block size that will be written to a trace */
+#define MAX_BLOCK (INT_MAX / 2)
+
+/* Characterizes a single trace operation, as in mdriver.c */
+typedef struct {
+    char type;  /* 'a', 'r' or 'f' */
+    int index;  /* block id */
+    int size;   /* byte size of alloc/realloc request */
+} genop_t;
+
+/* A live block, kept in a min-heap ordered by time of death */
+typedef struct {
+    long death; /* request number at which the block is freed */
+    int index;  /* block id */
+    int size;   /* current byte size */
+} live_t;
+
+/* The generator parameters */
+static struct {
+    int size_dist;         /* SIZE_xxx */
+    double size_arg[3];    /* parameters of the size distribution */
+    int life_dist;         /* LIFE_xxx */
+    double life_arg[2];    /* parameters of the lifetime distribution */
+    double realloc_prob;   /* chance that a request reallocs a live block */
+    int grow;              /* GROW_xxx */
+    double grow_arg;       /* step (linear) or factor (geometric) */
+    int max_live;          /* cap on the number of live blocks */
+    long num_ops;          /* number of requests to generate */
+    unsigned long long seed;
+} params = {
+    SIZE_POWER, {1.5, 8, 4096},
+    LIFE_EXP, {1000, 0},
+    0.0, GROW_GEOM, 1.5,
+    1000, 10000, 1
+};
+
+static unsigned long long rng_state; /* state of the random generator */
+
+/* Function prototypes */
+static double rand_unit(void);
+static int sample_size(void);
+static long sample_life(void);
+static int grow_size(int size);
+static void heap_push(live_t *heap, int *n, live_t v);
+static live_t heap_pop(live_t *heap, int *n);
+static void parse_size(char *spec);
+static void parse_life(char *spec);
+static void parse_realloc(char *spec);
+static void write_text(FILE *fp, genop_t *ops, long n, int ids, int hwm);
+static void write_binary(FILE *fp, genop_t *ops, long n, int ids, int hwm);
+static void usage(void);
+static void app_error(char *msg);
+
+int main(int argc, char **argv)
+{
+    char c;
+    char *outfile = NULL;
+    int binary = 0;
+    FILE *fp;
+    genop_t *ops;      /* the generated requests */
+    live_t *live;      /* min-heap of live blocks */
+    int num_live = 0;
+    int num_ids = 0;
+    long op = 0;
+    long live_bytes = 0, max_live_bytes = 0;
+    live_t v;
+    int i;
+
+    while ((c = getopt(argc, argv, "n:L:s:l:r:S:o:bh")) != EOF) {
+	switch (c) {
+	case 'n': /* Number of requests */
+	    params.num_ops = atol(optarg);
+	    break;
+	case 'L': /* Max number of live blocks */
+	    params.max_live = atoi(optarg);
+	    break;
+	case 's': /* Size distribution */
+	    parse_size(optarg);
+	    break;
+	case 'l': /* Lifetime distribution */
+	    parse_life(optarg);
+	    break;
+	case 'r': /* Realloc probability and growth pattern */
+	    parse_realloc(optarg);
+	    break;
+	case 'S': /* Random seed */
+	    params.seed = strtoull(optarg, NULL, 0);
+	    break;
+	case 'o': /* Output file */
+	    outfile = optarg;
+	    break;
+	case 'b': /* Binary output */
+	    binary = 1;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (params.num_ops < 2 || params.max_live < 1)
+	app_error("gentrace: need -n >= 2 and -L >= 1");
+
+    if ((ops = (genop_t *)malloc(params.num_ops * sizeof(genop_t))) == NULL)
+	app_error("gentrace: malloc of request array failed");
+    if ((live = (live_t *)malloc(params.max_live * sizeof(live_t))) == NULL)
+	app_error("gentrace: malloc of live array failed");
+    rng_state = params.seed;
+
+    /*
+     * Generate requests, leaving room to free every live block at the
+     * end. A block dies when its lifetime is up or when it is the
+     * oldest-dying block and the live set is full.
+     */
+    while (op + num_live < params.num_ops) {
+	if (num_live > 0 &&
+	    (live[0].death <= op || num_live >= params.max_live)) {
+	    v = heap_pop(live, &num_live);
+	    ops[op].type = 'f';
+	    ops[op].index = v.index;
+	    ops[op].size = 0;
+	    live_bytes -= v.size;
+	}
+	else if (num_live > 0 && rand_unit() < params.realloc_prob) {
+	    /* The heap array doubles as a pool for picking a random block */
+	    i = (int)(rand_unit() * num_live);
+	    live_bytes -= live[i].size;
+	    live[i].size = grow_size(live[i].size);
+	    live_bytes += live[i].size;
+	    ops[op].type = 'r';
+	    ops[op].index = live[i].index;
+	    ops[op].size = live[i].size;
+	}
+	else if (op + num_live + 2 <= params.num_ops) {
+	    v.index = num_ids++;
+	    v.size = sample_size();
+	    v.death = op + sample_life();
+	    heap_push(live, &num_live, v);
+	    ops[op].type = 'a';
+	    ops[op].index = v.index;
+	    ops[op].size = v.size;
+	    live_bytes += v.size;
+	}
+	else
+	    break; /* no room left for an alloc and its free */
+	if (live_bytes > max_live_bytes)
+	    max_live_bytes = live_bytes;
+	op++;
+    }
+
+    /* Free whatever is still live, in order of death */
+    while (num_live > 0) {
+	v = heap_pop(live, &num_live);
+	ops[op].type = 'f';
+	ops[op].index = v.index;
+	ops[op].size = 0;
+	op++;
+    }
+
+    if (outfile == NULL)
+	fp = stdout;
+    else if ((fp = fopen(outfile, binary ? "wb" : "w")) == NULL) {
+	fprintf(stderr, "gentrace: could not open %s: %s\n",
+		outfile, strerror(errno));
+	exit(1);
+    }
+    if (max_live_bytes > INT_MAX)
+	max_live_bytes = INT_MAX;
+    if (binary)
+	write_binary(fp, ops, op, num_ids, (int)max_live_bytes);
+    else
+	write_text(fp, ops, op, num_ids, (int)max_live_bytes);
+    if (fp != stdout)
+	fclose(fp);
+
+    fprintf(stderr, "gentrace: %ld requests, %d ids, peak %ld live bytes\n",
+	    op, num_ids, max_live_bytes);
+    free(ops);
+    free(live);
+    exit(0);
+}
+
+/*
+ * rand_unit - return a uniform double in [0, 1). Uses splitmix64 so the
+ *     output only depends on the seed, not on the platform's libc.
+ */
+static double rand_unit(void)
+{
+    unsigned long long z = (rng_state += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z = z ^ (z >> 31);
+    return (z >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * sample_size - draw a block size from the size distribution
+ */
+static int sample_size(void)
+{
+    double u = rand_unit();
+    double a, lo, hi, x;
+
+    switch (params.size_dist) {
+    case SIZE_FIXED:
+	x = params.size_arg[0];
+	break;
+    case SIZE_BIMODAL:
+	x = (u < params.size_arg[2]) ? params.size_arg[0] : params.size_arg[1];
+	break;
+    case SIZE_POWER:
+    default:
+	/* Inverse CDF of a power law truncated to [lo, hi] */
+	a = params.size_arg[0];
+	lo = params.size_arg[1];
+	hi = params.size_arg[2];
+	if (fabs(a - 1.0) < 1e-9)
+	    x = lo * pow(hi / lo, u);
+	else
+	    x = pow(pow(lo, 1 - a) + u * (pow(hi, 1 - a) - pow(lo, 1 - a)),
+		    1 / (1 - a));
+	break;
+    }
+    if (x < 1)
+	x = 1;
+    if (x > MAX_BLOCK)
+	x = MAX_BLOCK;
+    return (int)x;
+}
+
+/*
+ * sample_life - draw a block lifetime, in requests
+ */
+static long sample_life(void)
+{
+    double u = rand_unit();
+    double x;
+
+    switch (params.life_dist) {
+    case LIFE_FIXED:
+	x = params.life_arg[0];
+	break;
+    case LIFE_UNIFORM:
+	x = params.life_arg[0] + u * (params.life_arg[1] - params.life_arg[0]);
+	break;
+    case LIFE_EXP:
+    default:
+	x = -params.life_arg[0] * log(1.0 - u);
+	break;
+    }
+    return (x < 1) ? 1 : (long)x;
+}
+
+/*
+ * grow_size - return the new size of a block of size bytes that is
+ *     being realloc'd
+ */
+static int grow_size(int size)
+{
+    double x;
+
+    if (params.grow == GROW_LINEAR)
+	x = size + params.grow_arg;
+    else
+	x = size * params.grow_arg;
+    if (x < 1)
+	x = 1;
+    if (x > MAX_BLOCK)
+	x = MAX_BLOCK;
+    return (int)x;
+}
+
+/*
+ * heap_push - insert v into the min-heap of n live blocks
+ */
+static void heap_push(live_t *heap, int *n, live_t v)
+{
+    int i = (*n)++;
+    int parent;
+
+    while (i > 0) {
+	parent = (i - 1) / 2;
+	if (heap[parent].death <= v.death)
+	    break;
+	heap[i] = heap[parent];
+	i = parent;
+    }
+    heap[i] = v;
+}
+
+/*
+ * heap_pop - remove and return the live block that dies first
+ */
+static live_t heap_pop(live_t *heap, int *n)
+{
+    live_t top = heap[0];
+    live_t last = heap[--(*n)];
+    int i = 0, child;
+
+    while ((child = 2 * i + 1) < *n) {
+	if (child + 1 < *n && heap[child + 1].death < heap[child].death)
+	    child++;
+	if (last.death <= heap[child].death)
+	    break;
+	heap[i] = heap[child];
+	i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+/*
+ * parse_size - parse fixed:N, bimodal:SMALL,LARGE,P or power:ALPHA,MIN,MAX
+ */
+static void parse_size(char *spec)
+{
+    double *a = params.size_arg;
+
+    if (sscanf(spec, "fixed:%lf", &a[0]) == 1)
+	params.size_dist = SIZE_FIXED;
+    else if (sscanf(spec, "bimodal:%lf,%lf,%lf", &a[0], &a[1], &a[2]) == 3)
+	params.size_dist = SIZE_BIMODAL;
+    else if (sscanf(spec, "power:%lf,%lf,%lf", &a[0], &a[1], &a[2]) == 3 &&
+	     a[1] >= 1 && a[2] >= a[1])
+	params.size_dist = SIZE_POWER;
+    else
+	app_error("gentrace: bad size distribution (see -h)");
+}
+
+/*
+ * parse_life - parse fixed:N, exp:MEAN or uniform:MIN,MAX
+ */
+static void parse_life(char *spec)
+{
+    double *a = params.life_arg;
+
+    if (sscanf(spec, "fixed:%lf", &a[0]) == 1)
+	params.life_dist = LIFE_FIXED;
+    else if (sscanf(spec, "exp:%lf", &a[0]) == 1)
+	params.life_dist = LIFE_EXP;
+    else if (sscanf(spec, "uniform:%lf,%lf", &a[0], &a[1]) == 2 &&
+	     a[1] >= a[0])
+	params.life_dist = LIFE_UNIFORM;
+    else
+	app_error("gentrace: bad lifetime distribution (see -h)");
+}
+
+/*
+ * parse_realloc - parse P:linear:STEP or P:geom:FACTOR
+ */
+static void parse_realloc(char *spec)
+{
+    char pattern[16];
+
+    if (sscanf(spec, "%lf:%15[a-z]:%lf", &params.realloc_prob,
+	       pattern, &params.grow_arg) != 3)
+	app_error("gentrace: bad realloc pattern (see -h)");
+    if (!strcmp(pattern, "linear"))
+	params.grow = GROW_LINEAR;
+    else if (!strcmp(pattern, "geom"))
+	params.grow = GROW_GEOM;
+    else
+	app_error("gentrace: realloc growth must be linear or geom");
+}
+
+/*
+ * write_text - write the requests in the .rep format
+ */
+static void write_text(FILE *fp, genop_t *ops, long n, int ids, int hwm)
+{
+    long i;
+
+    fprintf(fp, "%d\n%d\n%ld\n%d\n", hwm, ids, n, 1);
+    for (i = 0; i < n; i++) {
+	if (ops[i].type == 'f')
+	    fprintf(fp, "f %d\n", ops[i].index);
+	else
+	    fprintf(fp, "%c %d %d\n", ops[i].type, ops[i].index, ops[i].size);
+    }
+}
+
+/*
+ * write_binary - write the requests in the binary trace format:
+ *     BINTRACE_MAGIC, four ints of header (as in the .rep format),
+ *     then three ints (type, index, size) per request
+ */
+static void write_binary(FILE *fp, genop_t *ops, long n, int ids, int hwm)
+{
+    int hdr[4];
+    int rec[3];
+    long i;
+
+    hdr[0] = hwm;
+    hdr[1] = ids;
+    hdr[2] = (int)n;
+    hdr[3] = 1;
+    fwrite(BINTRACE_MAGIC, 1, BINTRACE_MAGIC_LEN, fp);
+    fwrite(hdr, sizeof(int), 4, fp);
+    for (i = 0; i < n; i++) {
+	rec[0] = ops[i].type;
+	rec[1] = ops[i].index;
+	rec[2] = ops[i].size;
+	fwrite(rec, sizeof(int), 3, fp);
+    }
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: gentrace [-hb] [-n <ops>] [-L <live>] [-s <size>] "
+	    "[-l <life>] [-r <realloc>] [-S <seed>] [-o <file>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b            Write a binary trace.\n");
+    fprintf(stderr, "\t-h            Print this message.\n");
+    fprintf(stderr, "\t-l <life>     Lifetime in requests: fixed:N, exp:MEAN "
+	    "or uniform:MIN,MAX (default exp:1000).\n");
+    fprintf(stderr, "\t-L <live>     Max number of live blocks (default 1000).\n");
+    fprintf(stderr, "\t-n <ops>      Number of requests (default 10000).\n");
+    fprintf(stderr, "\t-o <file>     Output file (default stdout).\n");
+    fprintf(stderr, "\t-r <realloc>  P:linear:STEP or P:geom:FACTOR; realloc a "
+	    "live block with probability P.\n");
+    fprintf(stderr, "\t-s <size>     Block size: fixed:N, bimodal:SMALL,LARGE,P "
+	    "or power:ALPHA,MIN,MAX (default power:1.5,8,4096).\n");
+    fprintf(stderr, "\t-S <seed>     Random seed (default 1).\n");
+}
+
+/*
+ * app_error - Report an arbitrary application error
+ */
+static void app_error(char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
@@ -7,9 +7,13 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE      /* for sched_setaffinity */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
@@ -30,6 +34,12 @@
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
 
+/* Arena check (-A) */
+#define NARENAS        4 /* arenas in use at once */
+#define ARENA_BLOCKS 200 /* blocks allocated from each arena */
+#define ARENA_MAXSIZE 3000 /* largest block requested */
+#define ARENA_HEAPSIZE (4*(1<<20)) /* heap size of each arena */
+
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
 
@@ -85,6 +95,12 @@ typedef struct {
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* What a parallel worker (-p) sends back to the driver for its trace */
+typedef struct {
+    stats_t stats;   /* results for the trace */
+    int errors;      /* number of errors found by the worker */
+} result_t;
+
 /********************
  * Global variables
  *******************/
@@ -92,6 +108,10 @@ int verbose = 0;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 char msg[MAXLINE];      /* for whenever we need to compose an error message */
 
+/* Heap layout timeline (-T), snapshotted every timeline_interval ops */
+static FILE *timeline = NULL;
+static int timeline_interval = 100;
+
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
@@ -113,6 +133,8 @@ static void clear_ranges(range_t **ranges);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
+static int read_binop(FILE *tracefile, char *type, 
+		      unsigned *index, unsigned *size);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
@@ -123,10 +145,18 @@ static void eval_libc_speed(void *ptr);
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
+static void snapshot_block(void *block, size_t size, int alloc, void *arg);
+static void snapshot_heap(int opnum);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_trace(char *tracedir, char *filename, int tracenum,
+			  stats_t *stats, range_t **ranges);
+static void eval_mm_parallel(char *tracedir, char **tracefiles, int n,
+			     int ncores, stats_t *stats);
+static int eval_arenas(void);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printhugepages(int n, stats_t *base, stats_t *huge);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
@@ -145,10 +175,14 @@ int main(int argc, char **argv)
     range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
+    stats_t *hp_stats = NULL;  /* mm stats on a huge page backed heap */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int huge_pages = 0;  /* If set, also time mm on huge pages (set by -H) */
+    int parallel = -1;   /* If >= 0, evaluate traces in parallel (set by -p) */
+    int arena_check = 0; /* If set, check the arena API (set by -A) */
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -157,7 +191,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgl")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVglHAp:T:N:")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -180,6 +214,24 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'H': /* Compare mm throughput with and without huge pages */
+            huge_pages = 1;
+            break;
+        case 'A': /* Check that arenas are independent heaps */
+            arena_check = 1;
+            break;
+        case 'p': /* Evaluate traces in parallel on this many cores */
+            parallel = atoi(optarg);
+            break;
+        case 'T': /* Write a heap layout timeline to this file */
+            if ((timeline = fopen(optarg, "w")) == NULL)
+		unix_error("ERROR: could not open timeline file");
+            fprintf(timeline, "# mm heap timeline v2\n");
+            break;
+        case 'N': /* Ops between two timeline snapshots */
+            if ((timeline_interval = atoi(optarg)) <= 0)
+		app_error("ERROR: -N needs a positive number of ops");
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -257,25 +309,22 @@ int main(int argc, char **argv)
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
 
+    /* Workers cannot share the timeline file, so it forces a serial run */
+    if (timeline != NULL && parallel >= 0) {
+	printf("Timeline requested; evaluating traces serially\n");
+	parallel = -1;
+    }
+
     /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
+    if (parallel >= 0) 
+	eval_mm_parallel(tracedir, tracefiles, num_tracefiles, 
+			 parallel, mm_stats);
+    else {
+	for (i=0; i < num_tracefiles; i++)
+	    eval_mm_trace(tracedir, tracefiles[i], i, &mm_stats[i], &ranges);
     }
+    if (timeline != NULL)
+	fclose(timeline);
 
     /* Display the mm results in a compact table */
     if (verbose) {
@@ -284,6 +333,54 @@ int main(int argc, char **argv)
 	printf("\n");
     }
 
+    /*
+     * Optionally time the valid traces again with the simulated heap
+     * backed by huge pages, and compare against the default heap
+     */
+    if (huge_pages) {
+	if (verbose > 1)
+	    printf("Testing mm malloc on a huge page heap\n");
+
+	hp_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
+	if (hp_stats == NULL)
+	    unix_error("hp_stats calloc in main failed");
+
+	mem_deinit();
+	mem_set_backend(MEM_BACKEND_HUGEPAGE);
+	mem_init();
+	if (mem_get_backend() != MEM_BACKEND_HUGEPAGE)
+	    printf("Huge pages are not available; both columns use malloc\n");
+	for (i=0; i < num_tracefiles; i++) {
+	    hp_stats[i] = mm_stats[i];
+	    if (!mm_stats[i].valid)
+		continue;
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    speed_params.trace = trace;
+	    speed_params.ranges = ranges;
+	    eval_mm_speed(&speed_params); /* fault in the heap, untimed */
+	    hp_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
+	    free_trace(trace);
+	}
+	mem_deinit();
+	mem_set_backend(MEM_BACKEND_MALLOC);
+	mem_init();
+
+	printf("Huge page comparison for mm malloc:\n");
+	printhugepages(num_tracefiles, mm_stats, hp_stats);
+	printf("\n");
+    }
+
+    /*
+     * Optionally check the arena API, on the same backend as mm_malloc
+     */
+    if (arena_check) {
+	if (verbose > 1)
+	    printf("Testing mm arenas\n");
+	i = eval_arenas();
+	errors += i;
+	printf("Arena check: %d arenas, %d errors\n\n", NARENAS, i);
+    }
+
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
      */
@@ -450,6 +547,9 @@ static trace_t *read_trace(char *tracedir, char *filename)
     unsigned index, size;
     unsigned max_index = 0;
     unsigned op_index;
+    char magic[BINTRACE_MAGIC_LEN];
+    int hdr[4];
+    int binary = 0;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
@@ -465,10 +565,27 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	sprintf(msg, "Could not open %s in read_trace", path);
 	unix_error(msg);
     }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));     
-    fscanf(tracefile, "%d", &(trace->num_ops));     
-    fscanf(tracefile, "%d", &(trace->weight));        /* not used */
+
+    /* Binary traces (gentrace -b) are recognized by their magic string */
+    if (fread(magic, 1, BINTRACE_MAGIC_LEN, tracefile) == BINTRACE_MAGIC_LEN &&
+	memcmp(magic, BINTRACE_MAGIC, BINTRACE_MAGIC_LEN) == 0) {
+	binary = 1;
+	if (fread(hdr, sizeof(int), 4, tracefile) != 4) {
+	    printf("Truncated header in tracefile %s\n", path);
+	    exit(1);
+	}
+	trace->sugg_heapsize = hdr[0]; /* not used */
+	trace->num_ids = hdr[1];
+	trace->num_ops = hdr[2];
+	trace->weight = hdr[3];        /* not used */
+    }
+    else {
+	rewind(tracefile);
+	fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
+	fscanf(tracefile, "%d", &(trace->num_ids));     
+	fscanf(tracefile, "%d", &(trace->num_ops));     
+	fscanf(tracefile, "%d", &(trace->weight));        /* not used */
+    }
     
     /* We'll store each request line in the trace in this array */
     if ((trace->ops = 
@@ -488,24 +605,28 @@ static trace_t *read_trace(char *tracedir, char *filename)
     /* read every request line in the trace file */
     index = 0;
     op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
+    while (binary ? read_binop(tracefile, type, &index, &size) :
+	   fscanf(tracefile, "%s", type) != EOF) {
 	switch(type[0]) {
 	case 'a':
-	    fscanf(tracefile, "%u %u", &index, &size);
+	    if (!binary)
+		fscanf(tracefile, "%u %u", &index, &size);
 	    trace->ops[op_index].type = ALLOC;
 	    trace->ops[op_index].index = index;
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'r':
-	    fscanf(tracefile, "%u %u", &index, &size);
+	    if (!binary)
+		fscanf(tracefile, "%u %u", &index, &size);
 	    trace->ops[op_index].type = REALLOC;
 	    trace->ops[op_index].index = index;
 	    trace->ops[op_index].size = size;
 	    max_index = (index > max_index) ? index : max_index;
 	    break;
 	case 'f':
-	    fscanf(tracefile, "%ud", &index);
+	    if (!binary)
+		fscanf(tracefile, "%ud", &index);
 	    trace->ops[op_index].type = FREE;
 	    trace->ops[op_index].index = index;
 	    break;
@@ -524,6 +645,23 @@ static trace_t *read_trace(char *tracedir, char *filename)
     return trace;
 }
 
+/*
+ * read_binop - read the next request of a binary trace. Returns 1 if
+ *     a request was read and 0 at the end of the file.
+ */
+static int read_binop(FILE *tracefile, char *type, 
+		      unsigned *index, unsigned *size)
+{
+    int rec[3];
+
+    if (fread(rec, sizeof(int), 3, tracefile) != 3)
+	return 0;
+    type[0] = (char)rec[0];
+    *index = rec[1];
+    *size = rec[2];
+    return 1;
+}
+
 /*
  * free_trace - Free the trace record and the three arrays it points
  *              to, all of which were allocated in read_trace().
@@ -623,7 +761,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if (newp[j] != (char)(index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -680,7 +818,14 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
     if (mm_init() < 0)
 	app_error("mm_init failed in eval_mm_util");
 
+    if (timeline != NULL)
+	fprintf(timeline, "T %d %d %d\n", 
+		tracenum, trace->num_ops, timeline_interval);
+
     for (i = 0;  i < trace->num_ops;  i++) {
+	if (timeline != NULL && i % timeline_interval == 0)
+	    snapshot_heap(i);
+
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_alloc */
@@ -744,9 +889,43 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
         }
     }
 
+    if (timeline != NULL)
+	snapshot_heap(trace->num_ops);
+
     return ((double)max_total_size / (double)mem_heapsize());
 }
 
+/*
+ * The heap layout timeline has one "T tracenum num_ops interval" line
+ * per trace, followed by one line per snapshot:
+ *
+ *     S opnum heapsize block block ...
+ *
+ * Each block is "+n" (an allocated block of n bytes) or "-n" (a free
+ * block of n bytes), in address order from mem_heap_lo(). Adjacent
+ * blocks are kept apart, so the sizes and boundaries of free blocks,
+ * and with them the fragmentation, can be read off every snapshot.
+ * timeline2svg renders it.
+ */
+
+/*
+ * snapshot_block - mm_heapwalk callback that emits one block
+ */
+static void snapshot_block(void *block, size_t size, int alloc, void *arg)
+{
+    fprintf(timeline, " %c%lu", alloc ? '+' : '-', (unsigned long)size);
+}
+
+/*
+ * snapshot_heap - append the current heap layout to the timeline
+ */
+static void snapshot_heap(int opnum)
+{
+    fprintf(timeline, "S %d %lu", opnum, (unsigned long)mem_heapsize());
+    mm_heapwalk(snapshot_block, NULL);
+    fprintf(timeline, "\n");
+}
+
 
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
@@ -795,6 +974,298 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/*
+ * eval_mm_trace - Check one trace for correctness, then measure its
+ *    space utilization and throughput on the mm malloc package
+ */
+static void eval_mm_trace(char *tracedir, char *filename, int tracenum,
+			  stats_t *stats, range_t **ranges)
+{
+    trace_t *trace;
+    speed_t speed_params;
+
+    trace = read_trace(tracedir, filename);
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    stats->valid = eval_mm_valid(trace, tracenum, ranges);
+    if (stats->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	stats->util = eval_mm_util(trace, tracenum, ranges);
+	speed_params.trace = trace;
+	speed_params.ranges = *ranges;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	stats->secs = fsecs(eval_mm_speed, &speed_params);
+    }
+    free_trace(trace);
+}
+
+/*
+ * eval_mm_parallel - Evaluate the traces in parallel, one forked worker
+ *    per trace. At most ncores workers run at once (all the CPUs the
+ *    process may run on if ncores is 0, and never more), and each one is
+ *    pinned to a CPU of its own so that the timing of a trace is not
+ *    disturbed by its neighbors. Each worker runs on a fresh heap from
+ *    mem_init() and sends its stats_t back through a pipe.
+ */
+static void eval_mm_parallel(char *tracedir, char **tracefiles, int n,
+			     int ncores, stats_t *stats)
+{
+    pid_t *pids;       /* worker running on each core, or 0 */
+    int *fds;          /* read end of the pipe of each core's worker */
+    int *tracenums;    /* trace evaluated by each core's worker */
+    int next = 0;      /* next trace to hand out */
+    int running = 0;
+    int core, status, fd[2];
+    int *cpus = NULL;  /* CPU each core's worker is pinned to */
+    long online;
+    range_t *ranges = NULL;
+    result_t result;
+    pid_t pid;
+#ifdef CPU_SET
+    cpu_set_t set;
+    int cpu;
+#endif
+
+    /* 
+     * Never run more workers than CPUs the process may use (taskset,
+     * cgroups), or their timings would overlap
+     */
+    if ((online = sysconf(_SC_NPROCESSORS_ONLN)) <= 0)
+	online = 1;
+#ifdef CPU_SET
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+	if ((cpus = (int *)calloc(CPU_SETSIZE, sizeof(int))) == NULL)
+	    unix_error("calloc failed in eval_mm_parallel");
+	online = 0;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	    if (CPU_ISSET(cpu, &set))
+		cpus[online++] = cpu;
+    }
+    else
+	fprintf(stderr, "Could not read the CPU affinity (%s); "
+		"workers are not pinned\n", strerror(errno));
+#endif
+    if (ncores > online)
+	printf("Only %ld CPUs are available; evaluating %ld traces at a time\n",
+	       online, online);
+    if (ncores <= 0 || ncores > online)
+	ncores = online;
+    if (ncores > n)
+	ncores = n;
+    if (verbose > 1)
+	printf("Evaluating %d traces on %d cores\n", n, ncores);
+
+    pids = (pid_t *)calloc(ncores, sizeof(pid_t));
+    fds = (int *)calloc(ncores, sizeof(int));
+    tracenums = (int *)calloc(ncores, sizeof(int));
+    if (pids == NULL || fds == NULL || tracenums == NULL)
+	unix_error("calloc failed in eval_mm_parallel");
+
+    while (next < n || running > 0) {
+	/* Start a worker on every idle core */
+	for (core = 0; core < ncores && next < n; core++) {
+	    if (pids[core] != 0)
+		continue;
+	    if (pipe(fd) < 0)
+		unix_error("pipe failed in eval_mm_parallel");
+	    fflush(stdout);
+	    if ((pid = fork()) < 0)
+		unix_error("fork failed in eval_mm_parallel");
+	    if (pid == 0) {
+		close(fd[0]);
+#ifdef CPU_SET
+		if (cpus != NULL) {
+		    CPU_ZERO(&set);
+		    CPU_SET(cpus[core], &set);
+		    if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			fprintf(stderr, "Could not pin trace %d to CPU %d: %s\n", 
+				next, cpus[core], strerror(errno));
+		}
+#endif
+		/* A private heap rather than a copy of the driver's */
+		mem_deinit();
+		mem_init();
+		errors = 0;
+		memset(&result, 0, sizeof(result));
+		eval_mm_trace(tracedir, tracefiles[next], next, 
+			      &result.stats, &ranges);
+		result.errors = errors;
+		fflush(stdout);
+		if (write(fd[1], &result, sizeof(result)) != sizeof(result))
+		    _exit(1);
+		_exit(0);
+	    }
+	    close(fd[1]);
+	    pids[core] = pid;
+	    fds[core] = fd[0];
+	    tracenums[core] = next++;
+	    running++;
+	}
+
+	/* Collect the results of the next worker to finish */
+	if ((pid = wait(&status)) < 0)
+	    unix_error("wait failed in eval_mm_parallel");
+	for (core = 0; core < ncores && pids[core] != pid; core++)
+	    ;
+	if (core == ncores)
+	    continue;
+	if (read(fds[core], &result, sizeof(result)) == sizeof(result)) {
+	    stats[tracenums[core]] = result.stats;
+	    errors += result.errors;
+	}
+	else {
+	    malloc_error(tracenums[core], 0, "worker terminated abnormally");
+	    stats[tracenums[core]].valid = 0;
+	}
+	close(fds[core]);
+	pids[core] = 0;
+	running--;
+    }
+
+    free(cpus);
+    free(pids);
+    free(fds);
+    free(tracenums);
+}
+
+/*
+ * arena_pattern - The byte that fills block i of arena k in eval_arenas
+ */
+static char arena_pattern(int k, int i)
+{
+    return (char)(k * 61 + i * 7 + 1);
+}
+
+/*
+ * arena_verify - Check that every live block of the arenas in eval_arenas
+ *    still holds its pattern. Returns the number of bad blocks.
+ */
+static int arena_verify(mm_arena_t **arenas, char *blocks[][ARENA_BLOCKS],
+			int sizes[][ARENA_BLOCKS], char *when)
+{
+    int k, i, j, bad = 0;
+
+    for (k = 0; k < NARENAS; k++) {
+	if (arenas[k] == NULL)
+	    continue;
+	for (i = 0; i < ARENA_BLOCKS; i++) {
+	    if (blocks[k][i] == NULL)
+		continue;
+	    for (j = 0; j < sizes[k][i]; j++) {
+		if (blocks[k][i][j] != arena_pattern(k, i)) {
+		    printf("ERROR [arena %d, block %d]: payload changed %s\n",
+			   k, i, when);
+		    bad++;
+		    break;
+		}
+	    }
+	}
+    }
+    return bad;
+}
+
+/*
+ * arena_alloc - Allocate block i of arena k in eval_arenas with a random 
+ *    size and fill it with its pattern. Returns 1 on error, 0 otherwise.
+ */
+static int arena_alloc(mm_arena_t **arenas, char *blocks[][ARENA_BLOCKS],
+		       int sizes[][ARENA_BLOCKS], int k, int i)
+{
+    sizes[k][i] = 1 + rand() % ARENA_MAXSIZE;
+    blocks[k][i] = mm_arena_malloc(arenas[k], sizes[k][i]);
+    if (blocks[k][i] == NULL || !IS_ALIGNED(blocks[k][i])) {
+	printf("ERROR [arena %d, block %d]: mm_arena_malloc returned %p\n",
+	       k, i, blocks[k][i]);
+	blocks[k][i] = NULL;
+	return 1;
+    }
+    memset(blocks[k][i], arena_pattern(k, i), sizes[k][i]);
+    return 0;
+}
+
+/*
+ * eval_arenas - Check that arenas are independent heaps. NARENAS arenas
+ *    are created and used at once, with mallocs, frees and reallocs
+ *    interleaved between them. Then one arena is reset and refilled, one
+ *    is destroyed, and finally all are; after every step the blocks of
+ *    the others must still hold what was written to them.
+ *    Returns the number of errors found.
+ */
+static int eval_arenas(void)
+{
+    static char *blocks[NARENAS][ARENA_BLOCKS];
+    static int sizes[NARENAS][ARENA_BLOCKS];
+    mm_arena_t *arenas[NARENAS];
+    int k, i, j, newsize, bad = 0;
+    char *newp;
+
+    srand(1);
+    for (k = 0; k < NARENAS; k++) {
+	if ((arenas[k] = mm_arena_create(ARENA_HEAPSIZE)) == NULL)
+	    app_error("ERROR: mm_arena_create failed");
+    }
+
+    /* Fill the arenas in turn, a block from each at a time */
+    for (i = 0; i < ARENA_BLOCKS; i++)
+	for (k = 0; k < NARENAS; k++)
+	    bad += arena_alloc(arenas, blocks, sizes, k, i);
+    bad += arena_verify(arenas, blocks, sizes, "after mallocs");
+
+    /* Free every other block and resize every fourth */
+    for (i = 0; i < ARENA_BLOCKS; i++) {
+	for (k = 0; k < NARENAS; k++) {
+	    if (blocks[k][i] == NULL)
+		continue;
+	    if (i % 2) {
+		mm_arena_free(arenas[k], blocks[k][i]);
+		blocks[k][i] = NULL;
+	    }
+	    else if (i % 4 == 0) {
+		newsize = 1 + rand() % ARENA_MAXSIZE;
+		newp = mm_arena_realloc(arenas[k], blocks[k][i], newsize);
+		if (newp == NULL) {
+		    printf("ERROR [arena %d, block %d]: mm_arena_realloc failed\n",
+			   k, i);
+		    blocks[k][i] = NULL;
+		    bad++;
+		    continue;
+		}
+		for (j = 0; j < newsize && j < sizes[k][i]; j++) {
+		    if (newp[j] != arena_pattern(k, i)) {
+			printf("ERROR [arena %d, block %d]: mm_arena_realloc "
+			       "did not keep the payload\n", k, i);
+			bad++;
+			break;
+		    }
+		}
+		memset(newp, arena_pattern(k, i), newsize);
+		blocks[k][i] = newp;
+		sizes[k][i] = newsize;
+	    }
+	}
+    }
+    bad += arena_verify(arenas, blocks, sizes, "after frees and reallocs");
+
+    /* Reset the first arena and fill it again */
+    mm_arena_reset(arenas[0]);
+    for (i = 0; i < ARENA_BLOCKS; i++)
+	bad += arena_alloc(arenas, blocks, sizes, 0, i);
+    bad += arena_verify(arenas, blocks, sizes, "after a reset");
+
+    /* Destroy the second arena, then the rest */
+    mm_arena_destroy(arenas[1]);
+    arenas[1] = NULL;
+    bad += arena_verify(arenas, blocks, sizes, "after a destroy");
+    for (k = 0; k < NARENAS; k++) {
+	if (arenas[k] != NULL)
+	    mm_arena_destroy(arenas[k]);
+    }
+    return bad;
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -942,6 +1413,45 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printhugepages - prints the per-trace throughput of the mm package
+ *     on the default heap next to its throughput on a huge page heap
+ */
+static void printhugepages(int n, stats_t *base, stats_t *huge)
+{
+    int i;
+    double base_secs = 0;
+    double huge_secs = 0;
+    double ops = 0;
+
+    printf("%5s%8s%10s%10s%9s\n", 
+	   "trace", "ops", "Kops", "Kops(2M)", "speedup");
+    for (i=0; i < n; i++) {
+	if (base[i].valid) {
+	    printf("%2d%11.0f%10.0f%10.0f%8.2fx\n",
+		   i,
+		   base[i].ops,
+		   (base[i].ops/1e3)/base[i].secs,
+		   (huge[i].ops/1e3)/huge[i].secs,
+		   base[i].secs/huge[i].secs);
+	    base_secs += base[i].secs;
+	    huge_secs += huge[i].secs;
+	    ops += base[i].ops;
+	}
+	else {
+	    printf("%2d%11s%10s%10s%9s\n", i, "-", "-", "-", "-");
+	}
+    }
+
+    if (ops > 0) {
+	printf("%-13s%10.0f%10.0f%8.2fx\n",
+	       "Total",
+	       (ops/1e3)/base_secs,
+	       (ops/1e3)/huge_secs,
+	       base_secs/huge_secs);
+    }
+}
+
 /* 
  * app_error - Report an arbitrary application error
  */
@@ -974,13 +1484,19 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVl] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvVlHA] [-f <file>] [-t <dir>] [-p <cores>]\n"
+	    "               [-T <file> [-N <ops>]]\n");
     fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-A         Check that arenas are independent heaps.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-H         Compare throughput with huge pages on and off.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-N <ops>   Ops between timeline snapshots (default 100).\n");
+    fprintf(stderr, "\t-p <cores> Evaluate traces in parallel (0 = all allowed CPUs).\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
+    fprintf(stderr, "\t-T <file>  Write a heap layout timeline to <file>.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
 }
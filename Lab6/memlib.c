@@ -14,10 +14,120 @@
 #include "memlib.h"
 #include "config.h"
 
+/*
+ * A simulated heap. The default heap used by mem_sbrk() and friends is
+ * one of these; mem_heap_create() hands out more of them as independent
+ * handles, each with its own brk and storage.
+ */
+struct mem_heap {
+    char *start_brk;  /* points to first byte of heap */
+    char *brk;        /* points to last byte of heap */
+    char *max_addr;   /* largest legal heap address */ 
+    int backend;      /* MEM_BACKEND_xxx used for the storage */
+    size_t map_size;  /* bytes mapped by the huge page backend */
+};
+
 /* private variables */
-static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address */ 
+static mem_heap_t mem_heap;                  /* the default heap */
+static int mem_backend = MEM_BACKEND_MALLOC; /* backend used by mem_init */
+
+/*
+ * mem_set_backend - select the storage used by the next mem_init().
+ *    MEM_BACKEND_MALLOC is the original malloc'd arena.
+ *    MEM_BACKEND_HUGEPAGE maps the arena with 2 MB pages.
+ */
+void mem_set_backend(int backend)
+{
+    mem_backend = backend;
+}
+
+/*
+ * mem_get_backend - return the backend the default heap actually got,
+ *    which is MEM_BACKEND_MALLOC if huge pages could not be mapped
+ */
+int mem_get_backend(void)
+{
+    return mem_heap.backend;
+}
+
+/*
+ * hugepage_alloc - map size bytes backed by huge pages. Tries an
+ *    explicit MAP_HUGETLB mapping first, which needs reserved huge pages
+ *    (vm.nr_hugepages). If that fails, falls back to an ordinary
+ *    anonymous mapping aligned to HUGE_PAGE_SIZE and asks for
+ *    transparent huge pages with madvise(MADV_HUGEPAGE).
+ */
+static char *hugepage_alloc(size_t size, size_t *map_size)
+{
+    char *p, *aligned;
+    size_t slop;
+
+    *map_size = (size + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, *map_size, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+	return p;
+#endif
+
+    /* Over-map so the arena can start on a huge page boundary */
+    p = mmap(NULL, *map_size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+	return NULL;
+    aligned = (char *)(((size_t)p + HUGE_PAGE_SIZE - 1) & 
+		       ~((size_t)HUGE_PAGE_SIZE - 1));
+    if ((slop = aligned - p) > 0)
+	munmap(p, slop);
+    if ((slop = HUGE_PAGE_SIZE - slop) > 0)
+	munmap(aligned + *map_size, slop);
+
+#ifdef MADV_HUGEPAGE
+    if (madvise(aligned, *map_size, MADV_HUGEPAGE) < 0)
+	fprintf(stderr, "mem_init_vm: madvise(MADV_HUGEPAGE) failed: %s\n",
+		strerror(errno));
+#endif
+    return aligned;
+}
+
+/*
+ * heap_init - allocate size bytes of storage for heap from backend.
+ *    If huge pages cannot be mapped, falls back to malloc, and
+ *    heap->backend records the backend the storage came from.
+ *    Returns 0 on success, -1 if the storage could not be allocated.
+ */
+static int heap_init(mem_heap_t *heap, size_t size, int backend)
+{
+    heap->backend = backend;
+    heap->map_size = 0;
+    heap->start_brk = NULL;
+    if (backend == MEM_BACKEND_HUGEPAGE) {
+	if ((heap->start_brk = hugepage_alloc(size, &heap->map_size)) == NULL) {
+	    fprintf(stderr, "mem_init_vm: no huge page mapping, using malloc\n");
+	    heap->backend = MEM_BACKEND_MALLOC;
+	}
+    }
+    if (heap->backend == MEM_BACKEND_MALLOC)
+	heap->start_brk = (char *)malloc(size);
+    if (heap->start_brk == NULL)
+	return -1;
+
+    heap->max_addr = heap->start_brk + size;  /* max legal heap address */
+    heap->brk = heap->start_brk;              /* heap is empty initially */
+    return 0;
+}
+
+/*
+ * heap_deinit - release the storage of heap
+ */
+static void heap_deinit(mem_heap_t *heap)
+{
+    if (heap->backend == MEM_BACKEND_HUGEPAGE)
+	munmap(heap->start_brk, heap->map_size);
+    else
+	free(heap->start_brk);
+}
 
 /* 
  * mem_init - initialize the memory system model
@@ -25,13 +135,11 @@ static char *mem_max_addr;   /* largest legal heap address */
 void mem_init(void)
 {
     /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    if (heap_init(&mem_heap, MAX_HEAP, mem_backend) < 0) {
+	fprintf(stderr, "mem_init_vm: %s error\n", 
+		mem_heap.backend == MEM_BACKEND_HUGEPAGE ? "mmap" : "malloc");
 	exit(1);
     }
-
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
 }
 
 /* 
@@ -39,41 +147,116 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    heap_deinit(&mem_heap);
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_default_heap - return the handle of the heap set up by mem_init()
  */
-void mem_reset_brk()
+mem_heap_t *mem_default_heap(void)
 {
-    mem_brk = mem_start_brk;
+    return &mem_heap;
+}
+
+/*
+ * mem_heap_create - create an independent heap of at most size bytes
+ *    on the given backend. Returns NULL if the storage is unavailable.
+ */
+mem_heap_t *mem_heap_create(size_t size, int backend)
+{
+    mem_heap_t *heap;
+
+    if ((heap = (mem_heap_t *)malloc(sizeof(mem_heap_t))) == NULL)
+	return NULL;
+    if (heap_init(heap, size, backend) < 0) {
+	free(heap);
+	return NULL;
+    }
+    return heap;
+}
+
+/*
+ * mem_heap_destroy - free a heap returned by mem_heap_create()
+ */
+void mem_heap_destroy(mem_heap_t *heap)
+{
+    heap_deinit(heap);
+    free(heap);
+}
+
+/*
+ * mem_reset_brk_h - reset the simulated brk pointer of heap 
+ *    to make it empty
+ */
+void mem_reset_brk_h(mem_heap_t *heap)
+{
+    heap->brk = heap->start_brk;
 }
 
 /* 
- * mem_sbrk - simple model of the sbrk function. Extends the heap 
+ * mem_sbrk_h - simple model of the sbrk function. Extends heap
  *    by incr bytes and returns the start address of the new area. In
  *    this model, the heap cannot be shrunk.
  */
-void *mem_sbrk(int incr) 
+void *mem_sbrk_h(mem_heap_t *heap, int incr) 
 {
-    char *old_brk = mem_brk;
+    char *old_brk = heap->brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ( (incr < 0) || ((heap->brk + incr) > heap->max_addr)) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
-    mem_brk += incr;
+    heap->brk += incr;
     return (void *)old_brk;
 }
 
+/*
+ * mem_heap_lo_h - return address of the first byte of heap
+ */
+void *mem_heap_lo_h(mem_heap_t *heap)
+{
+    return (void *)heap->start_brk;
+}
+
+/* 
+ * mem_heap_hi_h - return address of the last byte of heap
+ */
+void *mem_heap_hi_h(mem_heap_t *heap)
+{
+    return (void *)(heap->brk - 1);
+}
+
+/*
+ * mem_heapsize_h - returns the size of heap in bytes
+ */
+size_t mem_heapsize_h(mem_heap_t *heap)
+{
+    return (size_t)(heap->brk - heap->start_brk);
+}
+
+/*
+ * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ */
+void mem_reset_brk()
+{
+    mem_reset_brk_h(&mem_heap);
+}
+
+/* 
+ * mem_sbrk - simple model of the sbrk function on the default heap
+ */
+void *mem_sbrk(int incr) 
+{
+    return mem_sbrk_h(&mem_heap, incr);
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
 void *mem_heap_lo()
 {
-    return (void *)mem_start_brk;
+    return mem_heap_lo_h(&mem_heap);
 }
 
 /* 
@@ -81,7 +264,7 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return mem_heap_hi_h(&mem_heap);
 }
 
 /*
@@ -89,7 +272,7 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return mem_heapsize_h(&mem_heap);
 }
 
 /*
@@ -1,5 +1,15 @@
 #include <unistd.h>
 
+/* Storage backends for the simulated heap (see mem_set_backend) */
+#define MEM_BACKEND_MALLOC   0  /* plain malloc(MAX_HEAP) */
+#define MEM_BACKEND_HUGEPAGE 1  /* MAP_HUGETLB, else madvise(MADV_HUGEPAGE) */
+
+/* Handle for one simulated heap */
+typedef struct mem_heap mem_heap_t;
+
+void mem_set_backend(int backend);
+int mem_get_backend(void);
+
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
@@ -9,3 +19,12 @@ void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
 
+/* Independent heaps; the _h functions mirror the ones above */
+mem_heap_t *mem_default_heap(void);
+mem_heap_t *mem_heap_create(size_t size, int backend);
+void mem_heap_destroy(mem_heap_t *heap);
+void *mem_sbrk_h(mem_heap_t *heap, int incr);
+void mem_reset_brk_h(mem_heap_t *heap);
+void *mem_heap_lo_h(mem_heap_t *heap);
+void *mem_heap_hi_h(mem_heap_t *heap);
+size_t mem_heapsize_h(mem_heap_t *heap);
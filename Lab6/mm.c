@@ -27,23 +27,35 @@
 
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
+/*
+ * An arena is a heap from memlib together with the heads of the
+ * segregated list that manages it. mm_malloc, mm_free and mm_realloc
+ * work on the default arena, which lives on the heap of mem_init().
+ */
+struct mm_arena {
+	mem_heap_t *heap;
+	long **block1;
+	long **block2;
+	long **block3;
+	long **block4;
+	long **block5;
+	int *block_buf;
+};
+
 /* Global variables for the segregated list */
-static long **block1;
-static long **block2;
-static long **block3;
-static long **block4;
-static long **block5;
-static int *block_buf;
+static mm_arena_t mm_default;
+
+static void arena_free(mm_arena_t *a, void *ptr);
 
 /*
  * trav_list - Traverse the given seg-list and return the proper free block.
  *             If found, return pointer to the block and if not, return NULL.
  */
-static long *trav_list(long **block, size_t size)
+static long *trav_list(mm_arena_t *a, long **block, size_t size)
 {
         long *ptr = *block;
 	
-	while((ptr >= (long *)mem_heap_lo()) && (ptr < (long *)mem_heap_hi())){ 
+	while((ptr >= (long *)mem_heap_lo_h(a->heap)) && (ptr < (long *)mem_heap_hi_h(a->heap))){ 
 //        while ((ptr != NULL) && (ptr > (long *)(block_buf + 1))){
                 // Found the proper free block.
                 if ((*ptr == size) || (*ptr >= size + 24)){
@@ -53,13 +65,13 @@ static long *trav_list(long **block, size_t size)
                 }else{
 			// Check if next is valid free block.
 			long *next = *(long **)(ptr + 3);
-			if ((next < (long *)mem_heap_lo()) || (next > (long *)mem_heap_hi())){
+			if ((next < (long *)mem_heap_lo_h(a->heap)) || (next > (long *)mem_heap_hi_h(a->heap))){
 				next = NULL;
 			}else if (((size_t)next % 8) != 0){
 				next = NULL;
 			}else{
 				long *next_footer = (long *)((char *)next + *(next) - ALIGNMENT);
-				if ((next_footer < (long *)mem_heap_lo()) || (next_footer > (long *)mem_heap_hi())){
+				if ((next_footer < (long *)mem_heap_lo_h(a->heap)) || (next_footer > (long *)mem_heap_hi_h(a->heap))){
 					next = NULL;
 				}else if ((size_t)next_footer % 8 != 0){
 					next = NULL;
@@ -81,7 +93,7 @@ static long *trav_list(long **block, size_t size)
  *            the last seg-list block.
  *            (If next seg-list block is buffer, return NULL).
  */
-static long *trav_all(long **block, size_t size)
+static long *trav_all(mm_arena_t *a, long **block, size_t size)
 {
 	long **ptr_seglist;
 	long **ptr_nextlist;
@@ -91,7 +103,7 @@ static long *trav_all(long **block, size_t size)
 	// Not an end of the whole seg-list.
 	while((int)(*ptr_seglist) != -1){
 		// Cannot find proper free block in this class.
-		if ((ptr = trav_list(ptr_seglist, size)) == NULL){
+		if ((ptr = trav_list(a, ptr_seglist, size)) == NULL){
 			// next seg-list class.
 			ptr_nextlist = ptr_seglist + 2;
 			ptr_seglist = ptr_nextlist;
@@ -108,7 +120,7 @@ static long *trav_all(long **block, size_t size)
  * find_block - Simply find the seg-list block
  *              with the given size.
  */
-static long **find_block(size_t size)
+static long **find_block(mm_arena_t *a, size_t size)
 {
 	// Required size is less than 1B.
 	// malloc should return NULL.
@@ -117,68 +129,70 @@ static long **find_block(size_t size)
 	// Required size is aligned to 8 and header is considered.
 	// Required size is 24 ~ 509B.
 	}else if (size < 510){
-		return block1;
+		return a->block1;
 	// Required size is 510 ~ 1019B.
 	}else if (size < 1020){
-		return block2;
+		return a->block2;
 	// Required size is 1020 ~ 2039B.
 	}else if (size < 2040){
-		return block3;
+		return a->block3;
 	// Required size is 2040 ~ 4079B.
 	}else if (size < 4080){
-		return block4;
+		return a->block4;
 	// Required size is more than 4080B.
 	}else{
-		return block5;
+		return a->block5;
 	}
 }
 
 /* 
- * mm_init - Initialize the malloc package.
- *           Make seg-list.
+ * arena_init - Initialize an arena on its (empty) heap.
+ *              Make seg-list.
  */
-int mm_init(void)
+static int arena_init(mm_arena_t *a)
 {
-	// start pointing the first byte of the heap.
-	void *start = mem_sbrk(48);
-	if (start == NULL){
+	// The heap begins with a pad word, so that the word below block1 is
+	// still inside the heap; start points past it.
+	void *start = mem_sbrk_h(a->heap, 56);
+	if (start == (void *)-1){
 		return -1;
 	}
+	start += 8;
 	// Head of blocks class with size 1 ~ 2 bytes.
-	block1 = (long **)start;
-	*(block1 - 1) = NULL;
-	*(block1) = NULL;
+	a->block1 = (long **)start;
+	*(a->block1 - 1) = NULL;
+	*(a->block1) = NULL;
 	// Head of blocks class with size 3 ~ 4 bytes.
-	block2 = (long **)(start + 8);
-	*(block2 - 1) = NULL;
-	*(block2) = NULL;
+	a->block2 = (long **)(start + 8);
+	*(a->block2 - 1) = NULL;
+	*(a->block2) = NULL;
 	// Head of blocks class with size 5 ~ 8 bytes.
-	block3 = (long **)(start + 16);
-	*(block3 - 1) = NULL;
-	*(block3) = NULL;
+	a->block3 = (long **)(start + 16);
+	*(a->block3 - 1) = NULL;
+	*(a->block3) = NULL;
 	// Head of blocks class with size 9 ~ 16 bytes.
-	block4 = (long **)(start + 24);
-	*(block4 - 1) = NULL;
-	*(block4) = NULL;
+	a->block4 = (long **)(start + 24);
+	*(a->block4 - 1) = NULL;
+	*(a->block4) = NULL;
 	// Head of blocks class with size 17 ~ bytes.
-	block5 = (long **)(start + 32);
-	*(block5 - 1) = NULL;
-	*(block5) = NULL;
+	a->block5 = (long **)(start + 32);
+	*(a->block5 - 1) = NULL;
+	*(a->block5) = NULL;
 	// Buffer block for the trav_all to call the trav_list with next seglist class.
-	block_buf = (int *)(start + 40);
-	*(block_buf - 1) = -1;
-	*(block_buf) = -1;
+	a->block_buf = (int *)(start + 40);
+	*(a->block_buf - 1) = -1;
+	*(a->block_buf) = -1;
 	return 0;
 }
 
 /* 
- * mm_malloc - Allocate a block by traverse seg-list.
- *             If there's no proper block in seg-list, incrementing the brk pointer.
- *             Always allocate a block whose size is a multiple of the alignment.
- *             If block allocated in seg-list is larger than needed size,
- *             split the block and free the last block.
+ * arena_malloc - Allocate a block by traverse seg-list.
+ *                If there's no proper block in seg-list, incrementing the brk pointer.
+ *                Always allocate a block whose size is a multiple of the alignment.
+ *                If block allocated in seg-list is larger than needed size,
+ *                split the block and free the last block.
  */
-void *mm_malloc(size_t size)
+static void *arena_malloc(mm_arena_t *a, size_t size)
 {
 	//mm_check();
 	int newsize;
@@ -193,15 +207,15 @@ void *mm_malloc(size_t size)
 		newsize += ALIGNMENT;
 	}
 	// If required size is 0, malloc returns NULL.
-	if ((block_target = find_block(newsize)) == NULL){
+	if ((block_target = find_block(a, newsize)) == NULL){
 		return NULL;
 	}else{
 		// Traverse the seg-list and get the pointer to the proper free block.
 		// If there's no proper free block in that seg-list class,
 		// trav_all calls trav_list with next seg-list class until the end of the seg-list.
 		// If there's no proper free block in the whole seg-list, call sbrk.
-		if ((block_allocated = trav_all(block_target, newsize)) == NULL){
-			if ((block_allocated = (long *)mem_sbrk(newsize)) == NULL){
+		if ((block_allocated = trav_all(a, block_target, newsize)) == NULL){
+			if ((block_allocated = (long *)mem_sbrk_h(a->heap, newsize)) == (long *)-1){
 				return NULL;
 			}
 			// If block_allocated is made by sbrk, set the header.
@@ -220,10 +234,10 @@ void *mm_malloc(size_t size)
 		long *next = (long *)(*(block_allocated + 3));
 		// In this case, prev is pointer to a seg-list class.
 		// seg-list classes have pointer to next block in different position.
-		if (prev < (long *)block_buf){
+		if (prev < (long *)a->block_buf){
 			long **next_prev = (long **)(next + 2);
 			long **prev_next = (long **)(prev);
-			if ((next > (long *)mem_heap_lo()) && (next < (long *)mem_heap_hi())){
+			if ((next > (long *)mem_heap_lo_h(a->heap)) && (next < (long *)mem_heap_hi_h(a->heap))){
 				*(next_prev) = prev;
 			}
 			*(prev_next) = next;
@@ -231,7 +245,7 @@ void *mm_malloc(size_t size)
 		}else{
 			long **next_prev = (long **)(next + 2);
 			long **prev_next = (long **)(prev + 3);
-			if ((next > (long *)mem_heap_lo()) && (next < (long *)mem_heap_hi())){
+			if ((next > (long *)mem_heap_lo_h(a->heap)) && (next < (long *)mem_heap_hi_h(a->heap))){
 				*(next_prev) = prev;
 			}
 			*(prev_next) = next;
@@ -253,7 +267,7 @@ void *mm_malloc(size_t size)
 			// And then pass it to the 'mm_free'.
 			long *block_splited = (long *)((char *)block_allocated + newsize);
 			*(block_splited) = oldsize - newsize;
-			mm_free((void *)block_splited + ALIGNMENT);
+			arena_free(a, (void *)block_splited + ALIGNMENT);
 		}
 		// Return the starting address of payload.
 		// Size and alloc bits are saved in 8 bytes.
@@ -262,11 +276,11 @@ void *mm_malloc(size_t size)
 }
 
 /*
- * mm_free - Freeing a block.
- *           Check if the prev and next of given block is also free blocks.
- *           If free, coalesce and append it to seg-list.
+ * arena_free - Freeing a block.
+ *              Check if the prev and next of given block is also free blocks.
+ *              If free, coalesce and append it to seg-list.
  */
-void mm_free(void *ptr)
+static void arena_free(mm_arena_t *a, void *ptr)
 {
 	long newsize;
 	long *prev;
@@ -285,7 +299,7 @@ void mm_free(void *ptr)
 		prev = (long *)((char *)prev_footer - *(prev_footer) + ALIGNMENT);
 		// Check if prev block is out of heap range.
 		// Thus, check if content of prev block's footer is valid.
-		if ((prev < (long *)mem_heap_lo()) || (prev > (long *)mem_heap_hi())){
+		if ((prev < (long *)mem_heap_lo_h(a->heap)) || (prev > (long *)mem_heap_hi_h(a->heap))){
 			prev = NULL;
 		// Check if prev block is aligned to 8.
 		// Thus, check if content of prev block's footer is valid.
@@ -302,7 +316,7 @@ void mm_free(void *ptr)
 	// Check if next is valid block.
 	// Check if next block is out of heap range.
 	// Thus, check if next block is unallocated heap region.
-	if ((next < (long *)mem_heap_lo()) || (next > (long *)mem_heap_hi())){
+	if ((next < (long *)mem_heap_lo_h(a->heap)) || (next > (long *)mem_heap_hi_h(a->heap))){
 		next = NULL;
 	}else{
 		next_footer = (long *)((char *)next + *(next) - ALIGNMENT);
@@ -312,7 +326,7 @@ void mm_free(void *ptr)
 			next = NULL;
 		// Check if next block's footer is out of heap range.
 		// Thus check if content of next block's header is valid.
-		}else if ((next_footer < (long *)mem_heap_lo()) || (next_footer > (long *)mem_heap_hi())){
+		}else if ((next_footer < (long *)mem_heap_lo_h(a->heap)) || (next_footer > (long *)mem_heap_hi_h(a->heap))){
 			next = NULL;
 		// Check if next block's header and footer have same contents.
 		// Thus, check if content of next block's header is valid.
@@ -343,9 +357,9 @@ void mm_free(void *ptr)
 		long *prev_prev = (long *)(*(prev + 2));
 		long *prev_next = (long *)(*(prev + 3));
 		// prev is next of seg-list.
-		if (prev_prev < (long *)block_buf){
+		if (prev_prev < (long *)a->block_buf){
 			// prev's next is not NULL.
-			if ((prev_next > (long *)mem_heap_lo()) && (prev_next < (long *)mem_heap_hi())){
+			if ((prev_next > (long *)mem_heap_lo_h(a->heap)) && (prev_next < (long *)mem_heap_hi_h(a->heap))){
 				if (*(prev_next) % 8 == 0){
 					point_prev = (long **)(prev + 3);
 					*(*(point_prev) + 2) = *(prev + 2);
@@ -356,7 +370,7 @@ void mm_free(void *ptr)
 		// prev is not a next of seg-list.
 		}else{
 			// prev's next is not NULL.
-			if ((prev_next > (long *)mem_heap_lo()) && (prev_next < (long *)mem_heap_hi())){
+			if ((prev_next > (long *)mem_heap_lo_h(a->heap)) && (prev_next < (long *)mem_heap_hi_h(a->heap))){
 				if (*(prev_next) % 8 == 0){
 					point_prev = (long **)(prev + 3);
 					*(*(point_prev) + 2) = *(prev + 2);
@@ -390,9 +404,9 @@ void mm_free(void *ptr)
 		long *next_prev = (long *)(*(next + 2));
 		long *next_next = (long *)(*(next + 3));
 		// next is next of seg-list.
-		if (next_prev < (long *)block_buf){
+		if (next_prev < (long *)a->block_buf){
 			// next's next is not NULL.
-			if ((next_next > (long *)mem_heap_lo()) && (next_next < (long *)mem_heap_hi())){
+			if ((next_next > (long *)mem_heap_lo_h(a->heap)) && (next_next < (long *)mem_heap_hi_h(a->heap))){
 				if (*(next_next) % 8 == 0){
 					point_next = (long **)(next + 3);
 					*(*(point_next) + 2) = *(next + 2);
@@ -403,7 +417,7 @@ void mm_free(void *ptr)
 		// next is not a next of seg-list.
 		}else{
 			// next's next is not NULL.
-			if ((next_next > (long *)mem_heap_lo()) && (next_next < (long *)mem_heap_hi())){
+			if ((next_next > (long *)mem_heap_lo_h(a->heap)) && (next_next < (long *)mem_heap_hi_h(a->heap))){
 				if (*(next_next) % 8 == 0){
 					point_next = (long **)(next + 3);
 					*(*(point_next) + 2) = *(next + 2);
@@ -433,14 +447,14 @@ void mm_free(void *ptr)
 	*(header) = newsize;
 	*(footer) = newsize;
 	
-	target_list = find_block(newsize);
+	target_list = find_block(a, newsize);
 	
 	// Check if target_list is NULL.
 	// If newsize is less than 24 bytes, find_block returns NULL.
 	// That is for checking mm_malloc(0), not for free.
 	// If find_block returns NULL, make target_list block1.
 	if (target_list == NULL){
-		target_list = block1;
+		target_list = a->block1;
 	}
 	
 	long **curr_next = (long **)(curr + 3);
@@ -448,26 +462,26 @@ void mm_free(void *ptr)
 	*(curr_next) = *(target_list);// curr's next.
 	*(curr_prev) = (long *)target_list;// curr's prev.
 	*(target_list) = curr;// seg-list's next
-	if ((*(curr_next) > (long *)mem_heap_lo()) && (*(curr_next) < (long *)mem_heap_hi())){
+	if ((*(curr_next) > (long *)mem_heap_lo_h(a->heap)) && (*(curr_next) < (long *)mem_heap_hi_h(a->heap))){
 		*(long **)(*(curr_next) + 2) = curr;// next seg-list element's prev is curr.
 	}
 }
 
 /*
- * mm_realloc - Implemented simply in terms of mm_malloc and mm_free
+ * arena_realloc - Implemented simply in terms of arena_malloc and arena_free
  */
-void *mm_realloc(void *ptr, size_t size)
+static void *arena_realloc(mm_arena_t *a, void *ptr, size_t size)
 {
 	void *old_ptr = ptr;
 	void *new_ptr;
 	
 	// If ptr is NULL, it is equivalent to mm_malloc(size).
 	if (old_ptr == NULL){
-		new_ptr = mm_malloc(size);
+		new_ptr = arena_malloc(a, size);
 		return new_ptr;
 	// If size is 0, it is equivalent to mm_free(ptr).
 	}else if (size == 0){
-		mm_free(old_ptr);
+		arena_free(a, old_ptr);
 		return NULL;
 	// ptr is not a NULL, and size is not equal to 0.
 	}else{
@@ -489,29 +503,148 @@ void *mm_realloc(void *ptr, size_t size)
 			new_ptr = old_ptr;
 			long *block_splited = (long *)(old_ptr + new_size - ALIGNMENT);
 			*block_splited = old_size - new_size;
-			mm_free((void *)block_splited + ALIGNMENT);
+			arena_free(a, (void *)block_splited + ALIGNMENT);
 			long *block_allocated = (long *)(new_ptr - ALIGNMENT);
 			*block_allocated = (new_size | 1);
 			return new_ptr;
 		// realloc with larger size.
 		}else{
-			new_ptr = mm_malloc(size);
+			new_ptr = arena_malloc(a, size);
 			size_t copy_size = old_size - ALIGNMENT;
 			memcpy(new_ptr, old_ptr, copy_size);
-			mm_free(old_ptr);
+			arena_free(a, old_ptr);
 			return new_ptr;
 		}
 	}
 }
 
+/* 
+ * mm_init - Initialize the malloc package on the heap of mem_init().
+ */
+int mm_init(void)
+{
+	mm_default.heap = mem_default_heap();
+	return arena_init(&mm_default);
+}
 
+/*
+ * mm_malloc - Allocate a block from the default arena.
+ */
+void *mm_malloc(size_t size)
+{
+	return arena_malloc(&mm_default, size);
+}
+
+/*
+ * mm_free - Free a block of the default arena.
+ */
+void mm_free(void *ptr)
+{
+	arena_free(&mm_default, ptr);
+}
 
+/*
+ * mm_realloc - Reallocate a block of the default arena.
+ */
+void *mm_realloc(void *ptr, size_t size)
+{
+	return arena_realloc(&mm_default, ptr, size);
+}
 
+/*
+ * mm_heapwalk - Visit every block of the default arena in address order.
+ *               The seg-list heads at the start of the heap are reported
+ *               as one allocated block. Each block starts with its header
+ *               holding (size | alloc bit), so the walk just hops from
+ *               header to header until the brk.
+ */
+void mm_heapwalk(mm_visit_t visit, void *arg)
+{
+	char *lo = (char *)mem_heap_lo_h(mm_default.heap);
+	char *hi = (char *)mem_heap_hi_h(mm_default.heap);
+	char *p = (char *)mm_default.block_buf + ALIGNMENT;
+	long size;
 
+	if (hi < p){
+		return;
+	}
+	// The seg-list heads made by arena_init.
+	visit(lo, p - lo, 1, arg);
+	while (p <= hi){
+		size = (*(long *)p & -2);
+		// A zero or overlong header means the heap is inconsistent.
+		if (size <= 0 || p + size - 1 > hi){
+			visit(p, hi - p + 1, 1, arg);
+			return;
+		}
+		visit(p, size, (int)(*(long *)p & 1), arg);
+		p += size;
+	}
+}
 
+/*
+ * mm_arena_create - Create an arena on its own heap of at most size bytes.
+ *                   Returns NULL if the heap cannot be created.
+ */
+mm_arena_t *mm_arena_create(size_t size)
+{
+	mm_arena_t *a;
 
+	if ((a = (mm_arena_t *)malloc(sizeof(mm_arena_t))) == NULL){
+		return NULL;
+	}
+	if ((a->heap = mem_heap_create(size, mem_get_backend())) == NULL){
+		free(a);
+		return NULL;
+	}
+	if (arena_init(a) < 0){
+		mem_heap_destroy(a->heap);
+		free(a);
+		return NULL;
+	}
+	return a;
+}
 
+/*
+ * mm_arena_destroy - Release an arena and its heap.
+ */
+void mm_arena_destroy(mm_arena_t *arena)
+{
+	mem_heap_destroy(arena->heap);
+	free(arena);
+}
 
+/*
+ * mm_arena_reset - Free every block of the arena at once.
+ *                  Only the brk and the seg-list heads are reset,
+ *                  so this is O(1) regardless of the number of live blocks.
+ */
+void mm_arena_reset(mm_arena_t *arena)
+{
+	mem_reset_brk_h(arena->heap);
+	arena_init(arena);
+}
 
+/*
+ * mm_arena_malloc - Allocate a block from the given arena.
+ */
+void *mm_arena_malloc(mm_arena_t *arena, size_t size)
+{
+	return arena_malloc(arena, size);
+}
 
+/*
+ * mm_arena_free - Free a block that was allocated from the given arena.
+ */
+void mm_arena_free(mm_arena_t *arena, void *ptr)
+{
+	arena_free(arena, ptr);
+}
 
+/*
+ * mm_arena_realloc - Reallocate a block within the given arena.
+ */
+void *mm_arena_realloc(mm_arena_t *arena, void *ptr, size_t size)
+{
+	return arena_realloc(arena, ptr, size);
+}
@@ -5,6 +5,26 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 
+/* 
+ * mm_heapwalk calls visit for every block of the default heap, in 
+ * address order, with the block's address, size and allocated bit.
+ */
+typedef void (*mm_visit_t)(void *block, size_t size, int alloc, void *arg);
+extern void mm_heapwalk(mm_visit_t visit, void *arg);
+
+/* 
+ * Arenas are independent heaps, each with its own free lists. 
+ * mm_arena_reset frees every block of an arena in O(1).
+ */
+typedef struct mm_arena mm_arena_t;
+
+extern mm_arena_t *mm_arena_create(size_t size);
+extern void mm_arena_destroy(mm_arena_t *arena);
+extern void mm_arena_reset(mm_arena_t *arena);
+extern void *mm_arena_malloc(mm_arena_t *arena, size_t size);
+extern void mm_arena_free(mm_arena_t *arena, void *ptr);
+extern void *mm_arena_realloc(mm_arena_t *arena, void *ptr, size_t size);
+
 
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
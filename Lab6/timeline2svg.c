@@ -0,0 +1,266 @@
+/*
+ * timeline2svg.c - Render a heap layout timeline as an SVG heat map
+ *
+ * Reads the timeline written by "mdriver -T <file>" and draws one trace
+ * of it. Time (snapshots) runs left to right and heap addresses run
+ * from the bottom (mem_heap_lo) to the top. Each cell is colored by the
+ * fraction of its address range that is free: blue is fully allocated,
+ * red is fully free, and white is beyond the brk. Wide red bands that
+ * persist over time are external fragmentation.
+ *
+ * Example:
+ *   mdriver -f traces/binary2-bal.rep -T binary2.tl -N 50
+ *   timeline2svg -o binary2.svg binary2.tl
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#define MAXLINE   1024   /* max size of a line token */
+#define CELL_W    4      /* width of a snapshot column in pixels */
+#define CELL_H    4      /* height of an address row in pixels */
+#define MARGIN    40     /* space for the axis labels */
+
+/* One heap snapshot: the blocks of the "S" line */
+typedef struct {
+    int opnum;          /* trace op at which it was taken */
+    long heapsize;      /* brk - mem_heap_lo() */
+    int nblocks;        /* number of blocks */
+    long *blocks;       /* block sizes, negative for free blocks */
+} snap_t;
+
+/* Function prototypes */
+static int read_timeline(FILE *fp, int tracenum, snap_t **snaps);
+static void render(FILE *out, snap_t *snaps, int n, int rows, int tracenum);
+static void color(double free_frac, char *buf);
+static void usage(void);
+static void unix_error(char *msg);
+
+int main(int argc, char **argv)
+{
+    char c;
+    int tracenum = 0;
+    int rows = 128;
+    char *outfile = NULL;
+    FILE *in = stdin, *out = stdout;
+    snap_t *snaps;
+    int n, i;
+
+    while ((c = getopt(argc, argv, "n:r:o:h")) != EOF) {
+	switch (c) {
+	case 'n': /* Trace to render */
+	    tracenum = atoi(optarg);
+	    break;
+	case 'r': /* Number of address rows */
+	    rows = atoi(optarg);
+	    break;
+	case 'o': /* Output file */
+	    outfile = optarg;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (rows <= 0) {
+	usage();
+	exit(1);
+    }
+    if (optind < argc && (in = fopen(argv[optind], "r")) == NULL)
+	unix_error("timeline2svg: could not open timeline");
+
+    if ((n = read_timeline(in, tracenum, &snaps)) == 0) {
+	fprintf(stderr, "timeline2svg: no snapshots for trace %d\n", tracenum);
+	exit(1);
+    }
+    if (outfile != NULL && (out = fopen(outfile, "w")) == NULL)
+	unix_error("timeline2svg: could not open output");
+
+    render(out, snaps, n, rows, tracenum);
+
+    if (out != stdout)
+	fclose(out);
+    for (i = 0; i < n; i++)
+	free(snaps[i].blocks);
+    free(snaps);
+    exit(0);
+}
+
+/*
+ * read_timeline - read the snapshots of trace tracenum into a newly
+ *     allocated array and return how many there are
+ */
+static int read_timeline(FILE *fp, int tracenum, snap_t **snaps)
+{
+    char tok[MAXLINE];
+    int cur = -1;       /* trace of the lines being read */
+    int n = 0, max = 64;
+    int maxblocks = 0;
+    snap_t *s = NULL;
+    long v;
+    int ch;
+
+    if ((*snaps = (snap_t *)malloc(max * sizeof(snap_t))) == NULL)
+	unix_error("timeline2svg: malloc failed");
+
+    while (fscanf(fp, "%1023s", tok) == 1) {
+	if (!strcmp(tok, "#")) {
+	    while ((ch = fgetc(fp)) != EOF && ch != '\n')
+		;
+	}
+	else if (!strcmp(tok, "T")) {
+	    if (fscanf(fp, "%d %*d %*d", &cur) != 1)
+		break;
+	    s = NULL;
+	}
+	else if (!strcmp(tok, "S")) {
+	    if (cur != tracenum) {
+		s = NULL;
+		continue;
+	    }
+	    if (n == max) {
+		max *= 2;
+		*snaps = (snap_t *)realloc(*snaps, max * sizeof(snap_t));
+		if (*snaps == NULL)
+		    unix_error("timeline2svg: realloc failed");
+	    }
+	    /* A truncated snapshot line ends the input before it is counted */
+	    s = &(*snaps)[n];
+	    if (fscanf(fp, "%d %ld", &s->opnum, &s->heapsize) != 2)
+		break;
+	    n++;
+	    s->nblocks = 0;
+	    maxblocks = 16;
+	    if ((s->blocks = (long *)malloc(maxblocks * sizeof(long))) == NULL)
+		unix_error("timeline2svg: malloc failed");
+	}
+	else if (s != NULL && (tok[0] == '+' || tok[0] == '-')) {
+	    v = atol(tok + 1);
+	    if (s->nblocks == maxblocks) {
+		maxblocks *= 2;
+		s->blocks = (long *)realloc(s->blocks, maxblocks * sizeof(long));
+		if (s->blocks == NULL)
+		    unix_error("timeline2svg: realloc failed");
+	    }
+	    s->blocks[s->nblocks++] = (tok[0] == '+') ? v : -v;
+	}
+    }
+    if (fp != stdin)
+	fclose(fp);
+    return n;
+}
+
+/*
+ * render - draw the snapshots as a rows-high heat map
+ */
+static void render(FILE *out, snap_t *snaps, int n, int rows, int tracenum)
+{
+    long maxheap = 1;
+    double bucket;      /* heap bytes per row */
+    double *free_b;     /* free bytes in each row of a snapshot */
+    double *used_b;     /* heap bytes in each row of a snapshot */
+    double lo, hi, r0, r1, part;
+    char fill[16];
+    int width, height;
+    int i, j, k;
+
+    for (i = 0; i < n; i++)
+	if (snaps[i].heapsize > maxheap)
+	    maxheap = snaps[i].heapsize;
+    bucket = (double)maxheap / rows;
+    free_b = (double *)malloc(rows * sizeof(double));
+    used_b = (double *)malloc(rows * sizeof(double));
+    if (free_b == NULL || used_b == NULL)
+	unix_error("timeline2svg: malloc failed");
+
+    width = n * CELL_W + 2 * MARGIN;
+    height = rows * CELL_H + 2 * MARGIN;
+    fprintf(out, "<svg xmlns=\"http://www.w3.org/2000/svg\" "
+	    "width=\"%d\" height=\"%d\" font-family=\"monospace\" "
+	    "font-size=\"10\" shape-rendering=\"crispEdges\">\n",
+	    width, height);
+    fprintf(out, "<text x=\"%d\" y=\"%d\">trace %d: %d snapshots, "
+	    "peak heap %ld bytes (blue = allocated, red = free)</text>\n",
+	    MARGIN, MARGIN / 2, tracenum, n, maxheap);
+
+    for (i = 0; i < n; i++) {
+	/* Spread every block over the rows it overlaps */
+	memset(free_b, 0, rows * sizeof(double));
+	memset(used_b, 0, rows * sizeof(double));
+	lo = 0;
+	for (j = 0; j < snaps[i].nblocks; j++) {
+	    hi = lo + labs(snaps[i].blocks[j]);
+	    for (k = (int)(lo / bucket); k < rows && k * bucket < hi; k++) {
+		r0 = (k * bucket > lo) ? k * bucket : lo;
+		r1 = ((k + 1) * bucket < hi) ? (k + 1) * bucket : hi;
+		part = r1 - r0;
+		used_b[k] += part;
+		if (snaps[i].blocks[j] < 0)
+		    free_b[k] += part;
+	    }
+	    lo = hi;
+	}
+	for (k = 0; k < rows; k++) {
+	    if (used_b[k] <= 0)
+		continue;
+	    color(free_b[k] / used_b[k], fill);
+	    fprintf(out, "<rect x=\"%d\" y=\"%d\" width=\"%d\" height=\"%d\" "
+		    "fill=\"%s\"/>\n", MARGIN + i * CELL_W,
+		    MARGIN + (rows - 1 - k) * CELL_H, CELL_W, CELL_H, fill);
+	}
+    }
+
+    /* Axes: op numbers along the bottom, heap offsets up the side */
+    fprintf(out, "<text x=\"%d\" y=\"%d\">op %d</text>\n", MARGIN,
+	    height - MARGIN / 2, snaps[0].opnum);
+    fprintf(out, "<text x=\"%d\" y=\"%d\" text-anchor=\"end\">op %d</text>\n",
+	    width - MARGIN, height - MARGIN / 2, snaps[n - 1].opnum);
+    fprintf(out, "<text x=\"2\" y=\"%d\">0</text>\n", height - MARGIN);
+    fprintf(out, "<text x=\"2\" y=\"%d\">%ldK</text>\n",
+	    MARGIN + 10, maxheap / 1024);
+    fprintf(out, "</svg>\n");
+
+    free(free_b);
+    free(used_b);
+}
+
+/*
+ * color - map a free fraction in [0, 1] to a blue (allocated) to red
+ *     (free) color
+ */
+static void color(double free_frac, char *buf)
+{
+    int r = (int)(40 + 215 * free_frac);
+    int g = (int)(60 + 40 * (1 - free_frac));
+    int b = (int)(40 + 170 * (1 - free_frac));
+
+    sprintf(buf, "#%02x%02x%02x", r, g, b);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: timeline2svg [-h] [-n <trace>] [-r <rows>] "
+	    "[-o <file>] [timeline]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h          Print this message.\n");
+    fprintf(stderr, "\t-n <trace>  Trace number to render (default 0).\n");
+    fprintf(stderr, "\t-o <file>   Output SVG file (default stdout).\n");
+    fprintf(stderr, "\t-r <rows>   Address rows in the heat map (default 128).\n");
+}
+
+/*
+ * unix_error - Report a Unix-style error
+ */
+static void unix_error(char *msg)
+{
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
@@ -0,0 +1,334 @@
+/*
+ * balancer.c - Pools of backends that serve virtual hosts, for running
+ *              the proxy as a reverse proxy in front of several origin
+ *              servers. A configuration file has one pool per line:
+ *
+ *                  <virtual host> <rr|lc|hash> <host:port> [<host:port>...]
+ *
+ *              Blank lines and lines starting with '#' are skipped.
+ *              Requests for a virtual host go to one backend of its pool,
+ *              picked by the pool's policy:
+ *              rr   Round robin.
+ *              lc   Least connections: the backend with the fewest requests
+ *                   in progress, the faster one on a tie.
+ *              hash Consistent hashing of the request key onto a ring of
+ *                   VNODES points per backend, so each object is fetched
+ *                   from (and cached by) one backend, and a backend going
+ *                   down only moves its own share of the keys.
+ *
+ *              A health thread sends "GET /" to every backend every
+ *              HEALTH_INTERVAL seconds and takes the ones that do not
+ *              answer, or answer with a 5xx status, out of their pools until
+ *              a check passes again. Besides that, a backend that fails
+ *              EJECT_FAILURES requests in a row is ejected for EJECT_MS.
+ *              If no backend of a pool is usable, all of them are tried
+ *              anyway rather than failing every request.
+ *              Each backend keeps a moving average of its response time.
+ */
+#include "csapp.h"
+#include "log.h"
+#include "dnscache.h"
+#include "balancer.h"
+
+#define MAX_POOLS 64
+#define MAX_VHOST 256              /* longest virtual host name */
+#define VNODES 64                  /* ring points per backend */
+#define HEALTH_INTERVAL 2          /* seconds between health checks */
+#define HEALTH_TIMEOUT 1           /* seconds a check may take */
+#define EJECT_FAILURES 3
+#define EJECT_MS 10000.0
+#define EWMA_WEIGHT 0.2            /* weight of a new response time */
+
+typedef struct {
+	unsigned int hash;
+	int backend;
+} point_t;
+
+struct pool {
+	char vhost[MAX_VHOST];
+	int policy;
+	backend_t backends[MAX_BACKENDS];
+	int n;
+	unsigned int next;         /* round robin position */
+	point_t ring[MAX_BACKENDS * VNODES];   /* sorted by hash */
+	sem_t mutex;               /* protects the backends' state */
+};
+
+static pool_t *pools[MAX_POOLS];
+static int npools;
+
+static void *health(void *vargp);
+
+/*
+ * fnv - FNV-1a hash of a string, which spreads similar keys well over
+ *       the ring.
+ */
+static unsigned int fnv(const char *s)
+{
+	unsigned int h = 2166136261u;
+
+	while (*s){
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	}
+	return h;
+}
+
+/*
+ * point_cmp - Order ring points by hash, for qsort.
+ */
+static int point_cmp(const void *a, const void *b)
+{
+	unsigned int x = ((point_t *)a)->hash, y = ((point_t *)b)->hash;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * build_ring - Put VNODES points of every backend of pool on its ring.
+ */
+static void build_ring(pool_t *pool)
+{
+	char name[3 * BACKEND_NAME];
+	int i, j;
+
+	for (i = 0; i < pool->n; i++){
+		for (j = 0; j < VNODES; j++){
+			sprintf(name, "%s:%s#%d", pool->backends[i].host, pool->backends[i].port, j);
+			pool->ring[i * VNODES + j].hash = fnv(name);
+			pool->ring[i * VNODES + j].backend = i;
+		}
+	}
+	qsort(pool->ring, pool->n * VNODES, sizeof(point_t), point_cmp);
+}
+
+/*
+ * balancer_load - Read the pools from the configuration file at path,
+ *                 and start the health checks. Exits on a bad file.
+ *                 Call once before any thread uses the pools.
+ */
+void balancer_load(char *path)
+{
+	FILE *fp;
+	char line[MAXLINE], msg[MAXLINE + 64];
+	char *vhost, *policy, *addr, *colon, *save;
+	pool_t *pool;
+	backend_t *b;
+	pthread_t tid;
+	int lineno = 0;
+
+	if ((fp = fopen(path, "r")) == NULL){
+		unix_error("cannot open backend configuration");
+	}
+	while (fgets(line, MAXLINE, fp) != NULL){
+		lineno++;
+		if ((vhost = strtok_r(line, " \t\r\n", &save)) == NULL || vhost[0] == '#'){
+			continue;
+		}
+		sprintf(msg, "%s:%d: ", path, lineno);
+		if ((policy = strtok_r(NULL, " \t\r\n", &save)) == NULL || npools == MAX_POOLS ||
+		    strlen(vhost) >= MAX_VHOST){
+			app_error(strcat(msg, "expected <virtual host> <rr|lc|hash> <host:port>..."));
+		}
+		pool = Calloc(1, sizeof(pool_t));
+		strcpy(pool->vhost, vhost);
+		if (!strcasecmp(policy, "rr")){
+			pool->policy = BALANCE_RR;
+		}else if (!strcasecmp(policy, "lc")){
+			pool->policy = BALANCE_LC;
+		}else if (!strcasecmp(policy, "hash")){
+			pool->policy = BALANCE_HASH;
+		}else{
+			app_error(strcat(msg, "policy must be rr, lc or hash"));
+		}
+		while ((addr = strtok_r(NULL, " \t\r\n", &save)) != NULL){
+			if ((colon = strrchr(addr, ':')) == NULL || colon == addr || colon[1] == '\0' ||
+			    colon - addr >= BACKEND_NAME || strlen(colon + 1) >= BACKEND_NAME ||
+			    pool->n == MAX_BACKENDS){
+				app_error(strcat(msg, "bad backend address"));
+			}
+			b = &pool->backends[pool->n++];
+			memcpy(b->host, addr, colon - addr);
+			strcpy(b->port, colon + 1);
+			b->healthy = 1;
+		}
+		if (pool->n == 0){
+			app_error(strcat(msg, "pool has no backends"));
+		}
+		build_ring(pool);
+		Sem_init(&pool->mutex, 0, 1);
+		pools[npools++] = pool;
+		log_msg(LOG_INFO, "pool %s: %d backends, policy %s", pool->vhost, pool->n, policy);
+	}
+	fclose(fp);
+	Pthread_create(&tid, NULL, health, NULL);
+}
+
+/*
+ * balancer_find - The pool that serves vhost (a Host header, maybe with
+ *                 a port), or NULL if no pool does.
+ */
+pool_t *balancer_find(char *vhost)
+{
+	size_t n = strcspn(vhost, ":");
+	int i;
+
+	for (i = 0; i < npools; i++){
+		if (strlen(pools[i]->vhost) == n && !strncasecmp(pools[i]->vhost, vhost, n)){
+			return pools[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * usable - Check if b may get requests now. Called with the pool's
+ *          mutex held.
+ */
+static int usable(backend_t *b, double now, int panic)
+{
+	return panic || (b->healthy && now >= b->ejected_until);
+}
+
+/*
+ * balancer_pick - Pick the backend of pool that serves the request for
+ *                 key, and count the request as in progress on it. Every
+ *                 pick must be matched by balancer_done.
+ */
+backend_t *balancer_pick(pool_t *pool, char *key)
+{
+	backend_t *b = NULL, *c;
+	double now = log_ms();
+	unsigned int h;
+	int panic, i, lo, hi, mid;
+
+	P(&pool->mutex);
+	for (panic = 0; b == NULL && panic < 2; panic++){
+		switch (pool->policy){
+		case BALANCE_RR:
+			for (i = 0; i < pool->n && b == NULL; i++){
+				c = &pool->backends[pool->next++ % pool->n];
+				if (usable(c, now, panic)){
+					b = c;
+				}
+			}
+			break;
+		case BALANCE_LC:
+			for (i = 0; i < pool->n; i++){
+				c = &pool->backends[(pool->next + i) % pool->n];
+				if (usable(c, now, panic) &&
+				    (b == NULL || c->active < b->active ||
+				     (c->active == b->active && c->ewma_ms < b->ewma_ms))){
+					b = c;
+				}
+			}
+			// Spread ties over the backends.
+			pool->next++;
+			break;
+		case BALANCE_HASH:
+			// The first point at or after the key's hash, going round.
+			h = fnv(key);
+			for (lo = 0, hi = pool->n * VNODES; lo < hi; ){
+				mid = (lo + hi) / 2;
+				if (pool->ring[mid].hash < h){
+					lo = mid + 1;
+				}else{
+					hi = mid;
+				}
+			}
+			for (i = 0; i < pool->n * VNODES && b == NULL; i++){
+				c = &pool->backends[pool->ring[(lo + i) % (pool->n * VNODES)].backend];
+				if (usable(c, now, panic)){
+					b = c;
+				}
+			}
+			break;
+		}
+	}
+	b->active++;
+	V(&pool->mutex);
+	return b;
+}
+
+/*
+ * balancer_done - The request picked b is over, and took ms milliseconds.
+ *                 ok tells whether b answered it properly; a backend that
+ *                 fails EJECT_FAILURES requests in a row is ejected.
+ */
+void balancer_done(pool_t *pool, backend_t *b, int ok, double ms)
+{
+	P(&pool->mutex);
+	b->active--;
+	b->requests++;
+	if (ok){
+		b->failures = 0;
+		b->ewma_ms = b->ewma_ms == 0 ? ms : (1 - EWMA_WEIGHT) * b->ewma_ms + EWMA_WEIGHT * ms;
+	}else{
+		b->errors++;
+		if (++b->failures >= EJECT_FAILURES){
+			b->failures = 0;
+			b->ejected_until = log_ms() + EJECT_MS;
+			log_msg(LOG_ERROR, "backend %s:%s of %s ejected after %d failures",
+				b->host, b->port, pool->vhost, EJECT_FAILURES);
+		}
+	}
+	V(&pool->mutex);
+}
+
+/*
+ * check - Ask b for "/" and tell whether it answered with a status below
+ *         500 in time.
+ */
+static int check(pool_t *pool, backend_t *b)
+{
+	struct timeval timeout = {HEALTH_TIMEOUT, 0};
+	char buf[MAXLINE];
+	rio_t rio;
+	int fd, status = 0;
+
+	if ((fd = dnscache_open_clientfd(b->host, b->port)) < 0){
+		return 0;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	snprintf(buf, MAXLINE, "GET / HTTP/1.0\r\nHost: %s\r\nConnection: close\r\n\r\n", pool->vhost);
+	Rio_readinitb(&rio, fd);
+	if (rio_writen(fd, buf, strlen(buf)) < 0 || rio_readlineb(&rio, buf, MAXLINE) <= 0 ||
+	    sscanf(buf, "HTTP/%*s %d", &status) != 1){
+		status = 0;
+	}
+	Close(fd);
+	return status > 0 && status < 500;
+}
+
+/*
+ * health - Thread routine: check every backend every HEALTH_INTERVAL
+ *          seconds and log the ones that go down or come back up.
+ */
+static void *health(void *vargp)
+{
+	backend_t *b;
+	int i, j, up;
+
+	Pthread_detach(pthread_self());
+	while (1){
+		for (i = 0; i < npools; i++){
+			for (j = 0; j < pools[i]->n; j++){
+				b = &pools[i]->backends[j];
+				// Checked outside the lock; only this thread sets healthy.
+				up = check(pools[i], b);
+				if (up != b->healthy){
+					log_msg(up ? LOG_INFO : LOG_ERROR, "backend %s:%s of %s is %s",
+						b->host, b->port, pools[i]->vhost, up ? "up" : "down");
+				}
+				P(&pools[i]->mutex);
+				b->healthy = up;
+				V(&pools[i]->mutex);
+				log_msg(LOG_DEBUG, "backend %s:%s: %s, %d active, %lu requests, %lu errors, %.2f ms",
+					b->host, b->port, up ? "up" : "down", b->active, b->requests, b->errors,
+					b->ewma_ms);
+			}
+		}
+		sleep(HEALTH_INTERVAL);
+	}
+	return NULL;
+}
@@ -0,0 +1,35 @@
+/*
+ * balancer.h - Pools of backends that serve virtual hosts
+ */
+#ifndef __BALANCER_H__
+#define __BALANCER_H__
+
+#define MAX_BACKENDS 16            /* per pool */
+#define BACKEND_NAME 64            /* longest host or port of a backend */
+
+/* Policies that pick a backend */
+#define BALANCE_RR 0               /* round robin */
+#define BALANCE_LC 1               /* least connections */
+#define BALANCE_HASH 2             /* consistent hash of the request key */
+
+/* A backend server. Counters are protected by its pool's mutex. */
+typedef struct {
+	char host[BACKEND_NAME];
+	char port[BACKEND_NAME];
+	int healthy;               /* the last health check passed */
+	int failures;              /* requests failed in a row */
+	double ejected_until;      /* not used before this time */
+	int active;                /* requests in progress */
+	double ewma_ms;            /* moving average of response time */
+	unsigned long requests;
+	unsigned long errors;
+} backend_t;
+
+typedef struct pool pool_t;
+
+void balancer_load(char *path);
+pool_t *balancer_find(char *vhost);
+backend_t *balancer_pick(pool_t *pool, char *key);
+void balancer_done(pool_t *pool, backend_t *b, int ok, double ms);
+
+#endif /* __BALANCER_H__ */
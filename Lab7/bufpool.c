@@ -0,0 +1,87 @@
+/*
+ * bufpool.c - Per-thread free lists of fixed-size buffers.
+ *             A worker asks for the same few buffer sizes on every request,
+ *             so after its first requests all of them come from its own
+ *             free lists, without malloc, free or a lock.
+ *             A free buffer keeps the list link in its first bytes.
+ *             Buffers must be freed by the thread that allocated them,
+ *             with the size they were allocated with.
+ */
+#include "csapp.h"
+#include "bufpool.h"
+
+#define NSIZES 8                   /* distinct sizes kept per thread */
+
+typedef struct free_buf {
+	struct free_buf *next;
+} free_buf_t;
+
+typedef struct {
+	size_t size;
+	free_buf_t *head;
+} free_list_t;
+
+static __thread free_list_t lists[NSIZES];
+static __thread int nlists;
+static unsigned long mallocs;      /* buffers that came from malloc */
+
+/*
+ * find_list - Return the free list of this thread for size, making one
+ *             if there is room. Returns NULL if there is not.
+ */
+static free_list_t *find_list(size_t size)
+{
+	int i;
+
+	for (i = 0; i < nlists; i++){
+		if (lists[i].size == size){
+			return &lists[i];
+		}
+	}
+	if (nlists == NSIZES){
+		return NULL;
+	}
+	lists[nlists].size = size;
+	lists[nlists].head = NULL;
+	return &lists[nlists++];
+}
+
+/*
+ * buf_alloc - Return a buffer of size bytes, from the free list if it
+ *             has one.
+ */
+void *buf_alloc(size_t size)
+{
+	free_list_t *l = find_list(size);
+	free_buf_t *b;
+
+	if (l != NULL && (b = l->head) != NULL){
+		l->head = b->next;
+		return b;
+	}
+	__sync_fetch_and_add(&mallocs, 1);
+	return Malloc(size < sizeof(free_buf_t) ? sizeof(free_buf_t) : size);
+}
+
+/*
+ * buf_free - Put a buffer from buf_alloc(size) back on the free list.
+ */
+void buf_free(void *buf, size_t size)
+{
+	free_list_t *l = find_list(size);
+
+	if (l == NULL){
+		Free(buf);
+		return;
+	}
+	((free_buf_t *)buf)->next = l->head;
+	l->head = buf;
+}
+
+/*
+ * bufpool_mallocs - Number of buffers all threads had to malloc.
+ */
+unsigned long bufpool_mallocs(void)
+{
+	return mallocs;
+}
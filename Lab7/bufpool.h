@@ -0,0 +1,13 @@
+/*
+ * bufpool.h - Per-thread pools of reusable I/O buffers
+ */
+#ifndef __BUFPOOL_H__
+#define __BUFPOOL_H__
+
+#include <stddef.h>
+
+void *buf_alloc(size_t size);
+void buf_free(void *buf, size_t size);
+unsigned long bufpool_mallocs(void);
+
+#endif /* __BUFPOOL_H__ */
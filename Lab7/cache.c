@@ -0,0 +1,511 @@
+/*
+ * cache.c - In-memory web object cache.
+ *           Keys are hashed to one of up to MAX_SHARDS shards, and each
+ *           shard has its own hash table, CLOCK rings and readers-writer
+ *           lock. A shard holds at most its share of max_cache_size, and
+ *           there are never so many shards that a shard could not hold
+ *           an object of max_object_size.
+ *           A hit only takes the read lock of its shard: it sets the
+ *           object's CLOCK bit and takes a reference with atomic
+ *           operations, so hits never wait for each other. Everything
+ *           that moves objects around happens when an object is inserted,
+ *           under the write lock.
+ *
+ *           Two policies decide what is kept:
+ *           CACHE_CLOCK   All objects are on one ring. The clock hand
+ *                         sweeps it, clearing set bits, until it reaches
+ *                         an object nobody used since the last sweep, and
+ *                         evicts that.
+ *           CACHE_TINYLFU W-TinyLFU. New objects enter a small window
+ *                         ring (WINDOW_PERCENT of the shard). Objects
+ *                         pushed out of the window are only admitted to
+ *                         the main region if a count-min sketch of recent
+ *                         lookups says they are asked for more often than
+ *                         the objects they would evict. The main region is
+ *                         a segmented LRU approximated with CLOCK: objects
+ *                         enter probation, and the hand moves an object
+ *                         hit while on probation to the protected segment
+ *                         instead of evicting it. A scan of objects asked
+ *                         for once therefore only churns the window.
+ *           Every lookup counts its key in the sketch, with compare-and-swap
+ *           outside the lock; the counters are halved every SKETCH_SAMPLE
+ *           lookups so that old popularity fades.
+ */
+#include "csapp.h"
+#include "cache.h"
+
+#define MAX_SHARDS 16
+#define NBUCKETS 256               /* per shard */
+#define WINDOW_PERCENT 1           /* window share of a shard */
+#define PROTECTED_PERCENT 80       /* protected share of the main region */
+#define SKETCH_ROWS 4
+#define SKETCH_WIDTH 1024          /* counters per row, per shard */
+#define SKETCH_MAX 15              /* counters saturate here */
+#define SKETCH_SAMPLE (8 * SKETCH_WIDTH)
+
+/* Segments; CACHE_CLOCK only uses PROBATION */
+enum { PROBATION, PROTECTED, WINDOW, NSEGS, NOSEG = -1 };
+
+typedef struct {
+	cache_obj_t *hand;         /* next eviction candidate, NULL if empty */
+	size_t size;               /* bytes of objects on the ring */
+	size_t max;
+	int count;
+} ring_t;
+
+typedef struct {
+	pthread_rwlock_t lock;     /* protects everything below but the sketch */
+	cache_obj_t *buckets[NBUCKETS];
+	ring_t seg[NSEGS];
+	size_t size;               /* bytes of cached objects */
+	unsigned char sketch[SKETCH_ROWS][SKETCH_WIDTH];
+	unsigned int additions;    /* lookups counted since the last halving */
+} shard_t;
+
+static shard_t shards[MAX_SHARDS];
+static int nshards;
+static int policy;
+static size_t max_shard;
+static size_t max_object;
+static void (*evict_hook)(cache_obj_t *obj);
+static unsigned long evictions;
+
+/* Odd multipliers that spread a hash over the sketch rows */
+static const unsigned int row_mult[SKETCH_ROWS] = {0x9e3779b1, 0x85ebca6b, 0xc2b2ae35, 0x27d4eb2f};
+
+/*
+ * hash - djb2 hash of a key.
+ */
+static unsigned int hash(const char *key)
+{
+	unsigned int h = 5381;
+
+	while (*key){
+		h = h * 33 + (unsigned char)*key++;
+	}
+	return h;
+}
+
+/*
+ * shard_of, bucket_of - Where the object with hash h lives.
+ */
+static shard_t *shard_of(unsigned int h)
+{
+	return &shards[h % nshards];
+}
+
+static unsigned int bucket_of(unsigned int h)
+{
+	return (h / nshards) % NBUCKETS;
+}
+
+/*
+ * sketch_add - Count one lookup of the key with hash h. It takes no
+ *              lock, so each counter is raised with a compare-and-swap
+ *              that stops at SKETCH_MAX.
+ */
+static void sketch_add(shard_t *s, unsigned int h)
+{
+	unsigned char *c, old;
+	int i;
+
+	for (i = 0; i < SKETCH_ROWS; i++){
+		c = &s->sketch[i][((h * row_mult[i]) >> 16) % SKETCH_WIDTH];
+		old = __atomic_load_n(c, __ATOMIC_RELAXED);
+		while (old < SKETCH_MAX &&
+		       !__atomic_compare_exchange_n(c, &old, old + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+	}
+	__atomic_add_fetch(&s->additions, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * sketch_freq - Estimated lookups of the key with hash h: the smallest
+ *               of its counters.
+ */
+static int sketch_freq(shard_t *s, unsigned int h)
+{
+	int i, c, min = SKETCH_MAX;
+
+	for (i = 0; i < SKETCH_ROWS; i++){
+		c = __atomic_load_n(&s->sketch[i][((h * row_mult[i]) >> 16) % SKETCH_WIDTH], __ATOMIC_RELAXED);
+		if (c < min){
+			min = c;
+		}
+	}
+	return min;
+}
+
+/*
+ * sketch_age - Halve every counter once SKETCH_SAMPLE lookups were
+ *              counted. Called with the write lock of s held, but
+ *              sketch_add runs outside the lock, so each counter is
+ *              halved with a compare-and-swap and no count is lost.
+ */
+static void sketch_age(shard_t *s)
+{
+	unsigned char *c, old;
+	int i, j;
+
+	if (__atomic_load_n(&s->additions, __ATOMIC_RELAXED) < SKETCH_SAMPLE){
+		return;
+	}
+	for (i = 0; i < SKETCH_ROWS; i++){
+		for (j = 0; j < SKETCH_WIDTH; j++){
+			c = &s->sketch[i][j];
+			old = __atomic_load_n(c, __ATOMIC_RELAXED);
+			while (!__atomic_compare_exchange_n(c, &old, old >> 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				;
+		}
+	}
+	__atomic_store_n(&s->additions, SKETCH_SAMPLE / 2, __ATOMIC_RELAXED);
+}
+
+/*
+ * ring_unlink - Take obj off the ring it is on.
+ */
+static void ring_unlink(shard_t *s, cache_obj_t *obj)
+{
+	ring_t *r = &s->seg[obj->seg];
+
+	if (obj->next == obj){
+		r->hand = NULL;
+	}else{
+		obj->prev->next = obj->next;
+		obj->next->prev = obj->prev;
+		if (r->hand == obj){
+			r->hand = obj->next;
+		}
+	}
+	r->size -= obj->size;
+	r->count--;
+	obj->prev = obj->next = NULL;
+	obj->seg = NOSEG;
+}
+
+/*
+ * ring_insert - Put obj on ring seg just behind the hand, so that it is
+ *               the last object the hand reaches.
+ */
+static void ring_insert(shard_t *s, cache_obj_t *obj, int seg)
+{
+	ring_t *r = &s->seg[seg];
+
+	if (r->hand == NULL){
+		obj->prev = obj->next = obj;
+		r->hand = obj;
+	}else{
+		obj->next = r->hand;
+		obj->prev = r->hand->prev;
+		r->hand->prev->next = obj;
+		r->hand->prev = obj;
+	}
+	r->size += obj->size;
+	r->count++;
+	obj->seg = seg;
+}
+
+/*
+ * ring_victim - Sweep the hand of ring seg, clearing CLOCK bits, to the
+ *               first object whose bit is clear. Returns it, still on
+ *               the ring, or NULL if the ring is empty.
+ */
+static cache_obj_t *ring_victim(shard_t *s, int seg)
+{
+	ring_t *r = &s->seg[seg];
+
+	if (r->hand == NULL){
+		return NULL;
+	}
+	while (__atomic_exchange_n(&r->hand->referenced, 0, __ATOMIC_RELAXED)){
+		r->hand = r->hand->next;
+	}
+	return r->hand;
+}
+
+/*
+ * obj_free - Free an object nobody refers to any more.
+ */
+static void obj_free(cache_obj_t *obj)
+{
+	Free(obj->key);
+	Free(obj->data);
+	Free(obj);
+}
+
+/*
+ * put_ref - Drop a reference to obj, freeing it with the last one.
+ */
+static void put_ref(cache_obj_t *obj)
+{
+	if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+		obj_free(obj);
+	}
+}
+
+/*
+ * remove_obj - Remove obj from the hash table and its ring,
+ *              and drop the cache's reference to it.
+ *              Called with the write lock of s held.
+ */
+static void remove_obj(shard_t *s, cache_obj_t *obj)
+{
+	cache_obj_t **pp = &s->buckets[bucket_of(obj->hash)];
+
+	while (*pp != obj){
+		pp = &(*pp)->hnext;
+	}
+	*pp = obj->hnext;
+	if (obj->seg != NOSEG){
+		ring_unlink(s, obj);
+	}
+	s->size -= obj->size;
+	put_ref(obj);
+}
+
+/*
+ * evict_obj - Remove obj because the policy wants its room, offering it
+ *             to the eviction hook first.
+ *             Called with the write lock of s held.
+ */
+static void evict_obj(shard_t *s, cache_obj_t *obj)
+{
+	__atomic_add_fetch(&evictions, 1, __ATOMIC_RELAXED);
+	if (evict_hook != NULL){
+		__atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+		evict_hook(obj);
+	}
+	remove_obj(s, obj);
+}
+
+/*
+ * main_victim - The object the main region of a W-TinyLFU shard would
+ *               evict next, or NULL if it is empty. Objects the hand finds
+ *               hit on probation move to protected, and protected objects
+ *               beyond its share go back to probation.
+ *               Called with the write lock of s held.
+ */
+static cache_obj_t *main_victim(shard_t *s)
+{
+	cache_obj_t *obj, *demoted;
+
+	while ((obj = s->seg[PROBATION].hand) != NULL){
+		if (!__atomic_exchange_n(&obj->referenced, 0, __ATOMIC_RELAXED)){
+			return obj;
+		}
+		ring_unlink(s, obj);
+		ring_insert(s, obj, PROTECTED);
+		while (s->seg[PROTECTED].size > s->seg[PROTECTED].max){
+			demoted = ring_victim(s, PROTECTED);
+			ring_unlink(s, demoted);
+			ring_insert(s, demoted, PROBATION);
+		}
+	}
+	return ring_victim(s, PROTECTED);
+}
+
+/*
+ * admit - Offer cand, just pushed out of the window, to the main region.
+ *         It goes on probation if it is asked for more often than every
+ *         victim that has to make room for it, and is dropped otherwise.
+ *         Called with the write lock of s held.
+ */
+static void admit(shard_t *s, cache_obj_t *cand)
+{
+	size_t room = max_shard - s->seg[WINDOW].size;
+	cache_obj_t *victim;
+	int freq = sketch_freq(s, cand->hash);
+
+	while (s->seg[PROBATION].size + s->seg[PROTECTED].size + cand->size > room){
+		victim = main_victim(s);
+		if (victim == NULL || sketch_freq(s, victim->hash) >= freq){
+			evict_obj(s, cand);
+			return;
+		}
+		evict_obj(s, victim);
+	}
+	ring_insert(s, cand, PROBATION);
+}
+
+/*
+ * cache_init - Set the limits and the policy of the cache.
+ *              Call once before any thread uses the cache.
+ */
+void cache_init(size_t max_cache_size, size_t max_object_size, int cache_policy)
+{
+	shard_t *s;
+	int i;
+
+	// As many shards as possible that can each hold the largest object.
+	for (nshards = MAX_SHARDS; nshards > 1; nshards /= 2){
+		if (max_cache_size / nshards >= max_object_size){
+			break;
+		}
+	}
+	policy = cache_policy;
+	max_shard = max_cache_size / nshards;
+	max_object = max_object_size;
+	for (i = 0; i < nshards; i++){
+		s = &shards[i];
+		if (pthread_rwlock_init(&s->lock, NULL) != 0){
+			app_error("pthread_rwlock_init error");
+		}
+		if (policy == CACHE_TINYLFU){
+			s->seg[WINDOW].max = max_shard * WINDOW_PERCENT / 100;
+			s->seg[PROTECTED].max = (max_shard - s->seg[WINDOW].max) * PROTECTED_PERCENT / 100;
+		}
+	}
+}
+
+/*
+ * cache_policy_parse - Map "clock" or "tinylfu" to its policy.
+ *                      Returns -1 for anything else.
+ */
+int cache_policy_parse(char *name)
+{
+	if (!strcasecmp(name, "clock")){
+		return CACHE_CLOCK;
+	}
+	if (!strcasecmp(name, "tinylfu")){
+		return CACHE_TINYLFU;
+	}
+	return -1;
+}
+
+/*
+ * cache_set_evict_hook - Have hook called with every object that is
+ *                        evicted or refused admission, as it leaves the
+ *                        cache. The hook gets a reference of its own and
+ *                        must drop it with cache_release. It runs under a
+ *                        shard's write lock, so it must not block.
+ *                        Objects replaced by a newer copy are not offered.
+ */
+void cache_set_evict_hook(void (*hook)(cache_obj_t *obj))
+{
+	evict_hook = hook;
+}
+
+/*
+ * cache_evictions - Number of objects evicted or refused admission.
+ */
+unsigned long cache_evictions(void)
+{
+	return __atomic_load_n(&evictions, __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_lookup - Find the object cached under key and mark it as used.
+ *                Returns NULL on a miss. On a hit the caller holds a
+ *                reference and must call cache_release.
+ */
+cache_obj_t *cache_lookup(const char *key)
+{
+	unsigned int h = hash(key);
+	shard_t *s = shard_of(h);
+	cache_obj_t *obj;
+
+	if (policy == CACHE_TINYLFU){
+		sketch_add(s, h);
+	}
+	pthread_rwlock_rdlock(&s->lock);
+	for (obj = s->buckets[bucket_of(h)]; obj; obj = obj->hnext){
+		if (!strcmp(obj->key, key)){
+			break;
+		}
+	}
+	if (obj){
+		// The read lock keeps the cache's reference, so obj stays alive.
+		__atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+		if (!__atomic_load_n(&obj->referenced, __ATOMIC_RELAXED)){
+			__atomic_store_n(&obj->referenced, 1, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_rwlock_unlock(&s->lock);
+	return obj;
+}
+
+/*
+ * cache_release - Drop a reference returned by cache_lookup.
+ */
+void cache_release(cache_obj_t *obj)
+{
+	put_ref(obj);
+}
+
+/*
+ * cache_fresh - Check if obj may still be sent without asking the server.
+ */
+int cache_fresh(cache_obj_t *obj)
+{
+	return time(NULL) < __atomic_load_n(&obj->expires, __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_refresh - The server says obj has not changed; it is fresh
+ *                 again until expires.
+ */
+void cache_refresh(cache_obj_t *obj, time_t expires)
+{
+	__atomic_store_n(&obj->expires, expires, __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_insert - Cache a copy of size bytes of data under key, fresh
+ *                until expires, replacing any object already cached under
+ *                key, and make room in its shard as the policy says. Under CACHE_TINYLFU the new
+ *                object may later be refused by the admission filter.
+ *                Returns 1 if the object was cached, 0 if it is too big.
+ */
+int cache_insert(const char *key, const char *data, size_t size, time_t expires)
+{
+	unsigned int h = hash(key);
+	shard_t *s = shard_of(h);
+	cache_obj_t *obj, *old, *cand;
+
+	if (size > max_object || size > max_shard){
+		return 0;
+	}
+	// Build the object before taking the lock.
+	obj = Malloc(sizeof(cache_obj_t));
+	obj->key = Malloc(strlen(key) + 1);
+	strcpy(obj->key, key);
+	obj->data = Malloc(size);
+	memcpy(obj->data, data, size);
+	obj->size = size;
+	obj->expires = expires;
+	obj->hash = h;
+	obj->refcnt = 1;
+	obj->referenced = 0;
+	obj->seg = NOSEG;
+
+	pthread_rwlock_wrlock(&s->lock);
+	for (old = s->buckets[bucket_of(h)]; old; old = old->hnext){
+		if (!strcmp(old->key, key)){
+			remove_obj(s, old);
+			break;
+		}
+	}
+	obj->hnext = s->buckets[bucket_of(h)];
+	s->buckets[bucket_of(h)] = obj;
+	s->size += size;
+	if (policy == CACHE_CLOCK){
+		while (s->size > max_shard){
+			evict_obj(s, ring_victim(s, PROBATION));
+		}
+		ring_insert(s, obj, PROBATION);
+	}else{
+		sketch_age(s);
+		ring_insert(s, obj, WINDOW);
+		while (s->seg[WINDOW].size > s->seg[WINDOW].max && s->seg[WINDOW].count > 1){
+			cand = ring_victim(s, WINDOW);
+			ring_unlink(s, cand);
+			admit(s, cand);
+		}
+		// A window of one large object can still leave too little room.
+		while (s->size > max_shard){
+			evict_obj(s, main_victim(s));
+		}
+	}
+	pthread_rwlock_unlock(&s->lock);
+	return 1;
+}
@@ -0,0 +1,44 @@
+/*
+ * cache.h - In-memory web object cache shared by all proxy threads
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * A cached web object. The data is the complete response (status line,
+ * headers and body) as it was sent to the client. Threads that read an
+ * object hold a reference to it, so an object that is evicted while it
+ * is being sent stays valid until the last reader releases it.
+ */
+typedef struct cache_obj {
+	char *key;                 /* normalized URI */
+	char *data;                /* response bytes */
+	size_t size;               /* number of response bytes */
+	time_t expires;            /* when it stops being fresh; atomic */
+	unsigned int hash;         /* hash of key */
+	int refcnt;                /* readers + 1 while in the cache; atomic */
+	int referenced;            /* CLOCK bit, set by every hit */
+	int seg;                   /* segment of the shard it is in */
+	struct cache_obj *prev;    /* CLOCK ring of the segment */
+	struct cache_obj *next;
+	struct cache_obj *hnext;   /* hash chain */
+} cache_obj_t;
+
+/* Eviction and admission policies */
+#define CACHE_CLOCK 0              /* one CLOCK ring, every object admitted */
+#define CACHE_TINYLFU 1            /* W-TinyLFU: window, then admission filter */
+
+void cache_init(size_t max_cache_size, size_t max_object_size, int policy);
+int cache_policy_parse(char *name);
+cache_obj_t *cache_lookup(const char *key);
+void cache_release(cache_obj_t *obj);
+int cache_insert(const char *key, const char *data, size_t size, time_t expires);
+int cache_fresh(cache_obj_t *obj);
+void cache_refresh(cache_obj_t *obj, time_t expires);
+void cache_set_evict_hook(void (*hook)(cache_obj_t *obj));
+unsigned long cache_evictions(void);
+
+#endif /* __CACHE_H__ */
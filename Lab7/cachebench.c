@@ -0,0 +1,220 @@
+/*
+ * cachebench.c - Measure the hit rate and throughput of the proxy cache.
+ *
+ * Each of nthreads client threads keeps a persistent HTTP/1.1 connection
+ * to the proxy and sends nrequests GETs, each for a url picked at random
+ * from the command line, uniformly or with a Zipf distribution (-z).
+ * A response counts as a hit if the proxy marked it "X-Cache: HIT".
+ * Prints requests per second, the hit rate and the mean latency.
+ *
+ * The origin is meant to be Lab7's tiny serving its own directory:
+ *   (cd tiny && ./tiny 15213) &
+ *   ./proxy 15214 &
+ *   ./cachebench -t 8 localhost 15214 http://localhost:15213/home.html \
+ *       http://localhost:15213/godzilla.jpg http://localhost:15213/csapp.c
+ *
+ * usage: cachebench [-t threads] [-n requests] [-z] <proxy host> <proxy port> <url>...
+ */
+#include "csapp.h"
+
+static char *proxy_host, *proxy_port;
+static char **urls;
+static int nurls;
+static int nrequests = 1000;
+static double *zipf_cdf;           /* NULL for uniform picks */
+
+typedef struct {
+	unsigned int seed;
+	long requests;
+	long hits;
+	long errors;
+	double latency;            /* seconds, summed over requests */
+} result_t;
+
+/*
+ * now - Seconds on the monotonic clock.
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * pick - Index of the next url to ask for.
+ */
+static int pick(unsigned int *seed)
+{
+	double x;
+	int lo = 0, hi = nurls - 1, mid;
+
+	if (zipf_cdf == NULL){
+		return rand_r(seed) % nurls;
+	}
+	x = (double)rand_r(seed) / RAND_MAX;
+	while (lo < hi){
+		mid = (lo + hi) / 2;
+		if (zipf_cdf[mid] < x){
+			lo = mid + 1;
+		}else{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * fetch - Send one GET for url on *fd and read the whole response,
+ *         reconnecting first if *fd is closed. Sets *hit.
+ *         Returns 0 on success, -1 on error.
+ */
+static int fetch(int *fd, rio_t *rp, char *url, int *hit)
+{
+	char buf[MAXLINE];
+	long long length = -1;
+	int keep_alive = 1;
+	ssize_t n;
+
+	if (*fd < 0){
+		if ((*fd = open_clientfd(proxy_host, proxy_port)) < 0){
+			return -1;
+		}
+		Rio_readinitb(rp, *fd);
+	}
+	sprintf(buf, "GET %s HTTP/1.1\r\nHost: bench\r\n\r\n", url);
+	if (rio_writen(*fd, buf, strlen(buf)) < 0 || rio_readlineb(rp, buf, MAXLINE) <= 0){
+		goto fail;
+	}
+	*hit = 0;
+	while ((n = rio_readlineb(rp, buf, MAXLINE)) > 0 && strcmp(buf, "\r\n")){
+		if (!strncasecmp(buf, "Content-Length:", 15)){
+			length = strtoll(buf + 15, NULL, 10);
+		}else if (!strncasecmp(buf, "X-Cache: HIT", 12)){
+			*hit = 1;
+		}else if (!strncasecmp(buf, "Connection: close", 17)){
+			keep_alive = 0;
+		}
+	}
+	if (n <= 0){
+		goto fail;
+	}
+	// Read the body: length bytes, or up to EOF.
+	while (length != 0){
+		n = rio_readnb(rp, buf, (length < 0 || length > MAXLINE) ? MAXLINE : length);
+		if (n <= 0){
+			if (n == 0 && length < 0){
+				break;
+			}
+			goto fail;
+		}
+		if (length > 0){
+			length -= n;
+		}
+	}
+	if (!keep_alive || length < 0){
+		Close(*fd);
+		*fd = -1;
+	}
+	return 0;
+
+fail:
+	Close(*fd);
+	*fd = -1;
+	return -1;
+}
+
+/*
+ * client - Thread routine: send nrequests requests and add them up.
+ */
+static void *client(void *vargp)
+{
+	result_t *res = (result_t *)vargp;
+	rio_t rio;
+	double t;
+	int fd = -1, hit, i;
+
+	for (i = 0; i < nrequests; i++){
+		t = now();
+		if (fetch(&fd, &rio, urls[pick(&res->seed)], &hit) < 0){
+			res->errors++;
+			continue;
+		}
+		res->latency += now() - t;
+		res->requests++;
+		res->hits += hit;
+	}
+	if (fd >= 0){
+		Close(fd);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int nthreads = 4, zipf = 0;
+	pthread_t *tids;
+	result_t *res, total = {0, 0, 0, 0, 0};
+	double start, secs, sum;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "t:n:z")) != -1){
+		switch (c){
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'n':
+			nrequests = atoi(optarg);
+			break;
+		case 'z':
+			zipf = 1;
+			break;
+		default:
+			nthreads = 0;
+			break;
+		}
+	}
+	if (argc - optind < 3 || nthreads <= 0 || nrequests <= 0){
+		fprintf(stderr, "usage: %s [-t threads] [-n requests] [-z] <proxy host> <proxy port> <url>...\n",
+			argv[0]);
+		exit(1);
+	}
+	proxy_host = argv[optind];
+	proxy_port = argv[optind + 1];
+	urls = argv + optind + 2;
+	nurls = argc - optind - 2;
+	if (zipf){
+		// P(url i) is proportional to 1 / (i + 1).
+		zipf_cdf = Malloc(nurls * sizeof(double));
+		for (sum = 0, i = 0; i < nurls; i++){
+			sum += 1.0 / (i + 1);
+			zipf_cdf[i] = sum;
+		}
+		for (i = 0; i < nurls; i++){
+			zipf_cdf[i] /= sum;
+		}
+	}
+	Signal(SIGPIPE, SIG_IGN);
+
+	tids = Malloc(nthreads * sizeof(pthread_t));
+	res = Calloc(nthreads, sizeof(result_t));
+	start = now();
+	for (i = 0; i < nthreads; i++){
+		res[i].seed = i + 1;
+		Pthread_create(&tids[i], NULL, client, &res[i]);
+	}
+	for (i = 0; i < nthreads; i++){
+		Pthread_join(tids[i], NULL);
+		total.requests += res[i].requests;
+		total.hits += res[i].hits;
+		total.errors += res[i].errors;
+		total.latency += res[i].latency;
+	}
+	secs = now() - start;
+	printf("%d threads, %ld requests, %ld errors, %.2f s\n", nthreads, total.requests, total.errors, secs);
+	printf("throughput %.0f requests/s\n", total.requests / secs);
+	printf("hit rate   %.1f%%\n", total.requests ? 100.0 * total.hits / total.requests : 0.0);
+	printf("latency    %.3f ms mean\n", total.requests ? 1e3 * total.latency / total.requests : 0.0);
+	return 0;
+}
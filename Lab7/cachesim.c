@@ -0,0 +1,148 @@
+/*
+ * cachesim.c - Replay a request trace against the proxy cache under each
+ *              policy and report hit ratio and byte hit ratio.
+ *
+ * A trace has one request per line: "<key> <size>", where size is the
+ * size of the response in bytes. A miss inserts the object, as the proxy
+ * does after fetching it. Each policy runs in its own child process so
+ * that it starts from an empty cache.
+ *
+ * -g prints a synthetic trace instead: requests for a Zipf-popular set
+ * of hot objects, interleaved with a crawler that asks for every object
+ * of a large set exactly once.
+ *
+ * usage: cachesim [-c cache bytes] [-o max object bytes] <trace>
+ *        cachesim -g [-n requests] [-s seed] > trace
+ */
+#include "csapp.h"
+#include "cache.h"
+#include "proxy.h"
+
+#define HOT_OBJECTS 400
+#define HOT_MAX_SIZE 8192
+#define SCAN_MAX_SIZE 16384
+#define SCAN_EVERY 2               /* every SCAN_EVERYth request is a scan */
+
+static char *policies[] = {"clock", "tinylfu"};
+
+/*
+ * generate - Print a trace of n requests.
+ */
+static void generate(long n, unsigned int seed)
+{
+	double cdf[HOT_OBJECTS], sum = 0, x;
+	int sizes[HOT_OBJECTS];
+	long i, scanned = 0;
+	int lo, hi, mid;
+
+	srand(seed);
+	for (i = 0; i < HOT_OBJECTS; i++){
+		sum += 1.0 / (i + 1);
+		cdf[i] = sum;
+		sizes[i] = 512 + rand() % HOT_MAX_SIZE;
+	}
+	for (i = 0; i < n; i++){
+		if (i % SCAN_EVERY == 0){
+			printf("/scan/%ld %d\n", scanned++, 512 + rand() % SCAN_MAX_SIZE);
+			continue;
+		}
+		x = sum * rand() / RAND_MAX;
+		for (lo = 0, hi = HOT_OBJECTS - 1; lo < hi; ){
+			mid = (lo + hi) / 2;
+			if (cdf[mid] < x){
+				lo = mid + 1;
+			}else{
+				hi = mid;
+			}
+		}
+		printf("/hot/%d %d\n", lo, sizes[lo]);
+	}
+}
+
+/*
+ * replay - Run the trace through a cache with the given policy and
+ *          print the results.
+ */
+static void replay(char *trace, size_t max_cache, size_t max_object, int policy, char *name)
+{
+	FILE *fp;
+	char line[MAXLINE], key[MAXLINE];
+	char *data = Calloc(1, max_object);
+	long requests = 0, hits = 0;
+	long long bytes = 0, hit_bytes = 0;
+	cache_obj_t *obj;
+	size_t size;
+
+	if ((fp = fopen(trace, "r")) == NULL){
+		unix_error("cannot open trace");
+	}
+	cache_init(max_cache, max_object, policy);
+	while (fgets(line, MAXLINE, fp) != NULL){
+		if (sscanf(line, "%s %zu", key, &size) != 2){
+			continue;
+		}
+		requests++;
+		bytes += size;
+		if ((obj = cache_lookup(key)) != NULL){
+			hits++;
+			hit_bytes += size;
+			cache_release(obj);
+		}else if (size <= max_object){
+			cache_insert(key, data, size, 0);
+		}
+	}
+	fclose(fp);
+	printf("%-8s %10ld %9.2f%% %9.2f%%\n", name, requests,
+	       requests ? 100.0 * hits / requests : 0.0, bytes ? 100.0 * hit_bytes / bytes : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+	size_t max_cache = MAX_CACHE_SIZE, max_object = MAX_OBJECT_SIZE;
+	long n = 200000;
+	unsigned int seed = 1;
+	int gen = 0, c, i;
+
+	while ((c = getopt(argc, argv, "c:o:gn:s:")) != -1){
+		switch (c){
+		case 'c':
+			max_cache = atol(optarg);
+			break;
+		case 'o':
+			max_object = atol(optarg);
+			break;
+		case 'g':
+			gen = 1;
+			break;
+		case 'n':
+			n = atol(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		default:
+			gen = -1;
+			break;
+		}
+	}
+	if (gen == 1){
+		generate(n, seed);
+		return 0;
+	}
+	if (gen < 0 || optind != argc - 1 || max_object == 0 || max_cache < max_object){
+		fprintf(stderr, "usage: %s [-c cache bytes] [-o max object bytes] <trace>\n"
+			"       %s -g [-n requests] [-s seed] > trace\n", argv[0], argv[0]);
+		exit(1);
+	}
+	printf("%-8s %10s %10s %10s   (cache %zu, max object %zu)\n",
+	       "policy", "requests", "hits", "byte hits", max_cache, max_object);
+	fflush(stdout);
+	for (i = 0; i < 2; i++){
+		if (Fork() == 0){
+			replay(argv[optind], max_cache, max_object, cache_policy_parse(policies[i]), policies[i]);
+			exit(0);
+		}
+		Wait(NULL);
+	}
+	return 0;
+}
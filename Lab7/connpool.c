@@ -0,0 +1,231 @@
+/*
+ * connpool.c - Pool of idle keep-alive connections to servers.
+ *              Idle connections are kept per (host, port) in a hash table,
+ *              most recently used first, and are closed once they have been
+ *              idle for idle_timeout seconds. A reaper thread closes expired
+ *              connections to servers nobody asks for any more.
+ *              A connection is checked for a close from the server before
+ *              it is handed out, but the server may still close it while
+ *              the request is on its way, so callers retry such requests
+ *              once on a fresh connection.
+ */
+#include "csapp.h"
+#include "connpool.h"
+#include "dnscache.h"
+
+#define NBUCKETS 256
+#define MAX_KEY 272                /* longest host:port pooled */
+
+typedef struct idle_conn {
+	int fd;
+	char key[MAX_KEY];         /* lower-case host:port */
+	double since;              /* when it became idle */
+	struct idle_conn *next;    /* hash chain, most recently used first */
+} idle_conn_t;
+
+static idle_conn_t *buckets[NBUCKETS];
+static idle_conn_t *spare;         /* unused entries, kept for reuse */
+static int idle_timeout;           /* seconds, 0 disables the pool */
+static int max_idle;               /* idle connections kept per server */
+static sem_t mutex;                /* protects buckets and spare */
+
+static void *reaper(void *vargp);
+
+/*
+ * now - Seconds on the monotonic clock.
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * make_key - Name the server host:port, ignoring the case of host.
+ *            Returns the hash bucket of the key, or -1 if the name is
+ *            too long to pool.
+ */
+static int make_key(char *key, char *host, char *port)
+{
+	unsigned int h = 5381;
+	char *p;
+
+	if (strlen(host) + strlen(port) + 2 > MAX_KEY){
+		return -1;
+	}
+	sprintf(key, "%s:%s", host, port);
+	for (p = key; *p; p++){
+		*p = tolower(*p);
+		h = h * 33 + (unsigned char)*p;
+	}
+	return h % NBUCKETS;
+}
+
+/*
+ * alive - Check that the server has not closed an idle connection.
+ *         An idle connection has nothing to read, so EOF or any
+ *         unexpected data both make it unusable.
+ */
+static int alive(int fd)
+{
+	char c;
+
+	return recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+	       (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*
+ * entry_free - Keep an entry for reuse. Called with mutex held.
+ */
+static void entry_free(idle_conn_t *c)
+{
+	c->next = spare;
+	spare = c;
+}
+
+/*
+ * idle_free - Close an idle connection and keep its entry for reuse.
+ */
+static void idle_free(idle_conn_t *c)
+{
+	close(c->fd);
+	P(&mutex);
+	entry_free(c);
+	V(&mutex);
+}
+
+/*
+ * connpool_init - Keep up to max_idle idle connections per server for
+ *                 idle_timeout seconds. Call once before any thread uses
+ *                 the pool.
+ */
+void connpool_init(int timeout, int max)
+{
+	pthread_t tid;
+
+	idle_timeout = timeout;
+	max_idle = max;
+	Sem_init(&mutex, 0, 1);
+	if (idle_timeout > 0){
+		Pthread_create(&tid, NULL, reaper, NULL);
+	}
+}
+
+/*
+ * connpool_get - Return a connection to host:port. Sets *reused if it
+ *                is an idle connection from the pool, and opens a new one
+ *                otherwise, looking the host up through the DNS cache.
+ *                Returns a negative value like open_clientfd
+ *                if no connection can be made.
+ */
+int connpool_get(char *host, char *port, int *reused)
+{
+	char key[MAX_KEY];
+	int h = make_key(key, host, port);
+	idle_conn_t **pp, *c;
+	int fd;
+
+	while (h >= 0){
+		P(&mutex);
+		for (pp = &buckets[h]; *pp && strcmp((*pp)->key, key); pp = &(*pp)->next)
+			;
+		if ((c = *pp) != NULL){
+			*pp = c->next;
+		}
+		V(&mutex);
+		if (c == NULL){
+			break;
+		}
+		// Check outside the lock; try the next one if it went bad.
+		if (now() - c->since < idle_timeout && alive(c->fd)){
+			fd = c->fd;
+			P(&mutex);
+			entry_free(c);
+			V(&mutex);
+			*reused = 1;
+			return fd;
+		}
+		idle_free(c);
+	}
+	*reused = 0;
+	return dnscache_open_clientfd(host, port);
+}
+
+/*
+ * connpool_put - Give back a connection to host:port whose last response
+ *                was read completely and that the server keeps open.
+ *                Closes it if the server already has max_idle idle
+ *                connections.
+ */
+void connpool_put(char *host, char *port, int fd)
+{
+	char key[MAX_KEY];
+	int h = make_key(key, host, port);
+	idle_conn_t *c, *p;
+	int n = 0;
+
+	if (idle_timeout <= 0 || h < 0){
+		Close(fd);
+		return;
+	}
+	P(&mutex);
+	for (p = buckets[h]; p; p = p->next){
+		if (!strcmp(p->key, key)){
+			n++;
+		}
+	}
+	if (n >= max_idle){
+		V(&mutex);
+		Close(fd);
+		return;
+	}
+	if ((c = spare) != NULL){
+		spare = c->next;
+	}else{
+		c = Malloc(sizeof(idle_conn_t));
+	}
+	c->fd = fd;
+	strcpy(c->key, key);
+	c->since = now();
+	c->next = buckets[h];
+	buckets[h] = c;
+	V(&mutex);
+}
+
+/*
+ * reaper - Close connections that have been idle too long, once a second.
+ */
+static void *reaper(void *vargp)
+{
+	idle_conn_t **pp, *c, *expired;
+	double t;
+	int i;
+
+	Pthread_detach(pthread_self());
+	while (1){
+		sleep(1);
+		expired = NULL;
+		t = now();
+		P(&mutex);
+		for (i = 0; i < NBUCKETS; i++){
+			pp = &buckets[i];
+			while ((c = *pp) != NULL){
+				if (t - c->since >= idle_timeout){
+					*pp = c->next;
+					c->next = expired;
+					expired = c;
+				}else{
+					pp = &c->next;
+				}
+			}
+		}
+		V(&mutex);
+		while ((c = expired) != NULL){
+			expired = c->next;
+			idle_free(c);
+		}
+	}
+	return NULL;
+}
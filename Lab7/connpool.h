@@ -0,0 +1,11 @@
+/*
+ * connpool.h - Pool of idle keep-alive connections to servers
+ */
+#ifndef __CONNPOOL_H__
+#define __CONNPOOL_H__
+
+void connpool_init(int idle_timeout, int max_idle);
+int connpool_get(char *host, char *port, int *reused);
+void connpool_put(char *host, char *port, int fd);
+
+#endif /* __CONNPOOL_H__ */
@@ -20,6 +20,7 @@
  */
 /* $begin csapp.c */
 #include "csapp.h"
+#include <sys/syscall.h>
 
 /************************** 
  * Error-handling functions
@@ -983,7 +984,30 @@ int open_clientfd(char *hostname, char *port) {
  *       -1 with errno set for other errors.
  */
 /* $begin open_listenfd */
+static int listen_on(char *port, int reuseport);
+
 int open_listenfd(char *port) 
+{
+    return listen_on(port, 0);
+}
+/* $end open_listenfd */
+
+/*
+ * open_reuseport_listenfd - Like open_listenfd, but with SO_REUSEPORT, so
+ *     that every worker of a multi-process server can have a listening
+ *     socket of its own on the same port. The kernel spreads new
+ *     connections over them, and no accept lock is shared.
+ */
+int open_reuseport_listenfd(char *port)
+{
+    return listen_on(port, 1);
+}
+
+/*
+ * listen_on - The body of open_listenfd; reuseport also sets
+ *     SO_REUSEPORT before the bind.
+ */
+static int listen_on(char *port, int reuseport)
 {
     struct addrinfo hints, *listp, *p;
     int listenfd, rc, optval=1;
@@ -1007,6 +1031,11 @@ int open_listenfd(char *port)
         /* Eliminates "Address already in use" error from bind */
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,    //line:netp:csapp:setsockopt
                    (const void *)&optval , sizeof(int));
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                                    (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
 
         /* Bind the descriptor to the address */
         if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
@@ -1030,7 +1059,6 @@ int open_listenfd(char *port)
     }
     return listenfd;
 }
-/* $end open_listenfd */
 
 /****************************************************
  * Wrappers for reentrant protocol-independent helpers
@@ -1053,6 +1081,193 @@ int Open_listenfd(char *port)
     return rc;
 }
 
+int Open_reuseport_listenfd(char *port) 
+{
+    int rc;
+
+    if ((rc = open_reuseport_listenfd(port)) < 0)
+	unix_error("Open_reuseport_listenfd error");
+    return rc;
+}
+
+/****************************************
+ * Multi-process servers
+ ****************************************/
+
+#define MAX_CPUS 1024
+#define LONG_BITS (8 * sizeof(unsigned long))
+
+/* Set by the supervisor's signal handler, cleared by its loop */
+static volatile sig_atomic_t worker_exited, reload, stop;
+
+static void supervisor_handler(int sig) 
+{
+    if (sig == SIGCHLD)
+        worker_exited = 1;
+    else if (sig == SIGHUP)
+        reload = 1;
+    else
+        stop = 1;
+}
+
+/*
+ * allowed_cpus - Fill set with the CPUs the calling process may run on,
+ *     and return how many there are (0 if that cannot be found out).
+ *     The glibc wrappers and cpu_set_t need _GNU_SOURCE, whose gai_error
+ *     clashes with ours, so this makes the system call itself.
+ */
+static int allowed_cpus(unsigned long *set) 
+{
+    int cpu, n = 0;
+
+    memset(set, 0, MAX_CPUS / 8);
+    if (syscall(SYS_sched_getaffinity, 0, MAX_CPUS / 8, set) < 0)
+        return 0;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++)
+        n += (set[cpu / LONG_BITS] >> (cpu % LONG_BITS)) & 1;
+    return n;
+}
+
+/*
+ * pin_cpu - Keep the calling process on the i-th of the CPUs it may run
+ *     on, counting round them if there are fewer than i.
+ */
+static void pin_cpu(int i) 
+{
+    unsigned long set[MAX_CPUS / LONG_BITS];
+    int cpu, n;
+
+    if ((n = allowed_cpus(set)) == 0)
+        return;
+    i %= n;
+    for (cpu = 0; cpu < MAX_CPUS; cpu++)
+        if (((set[cpu / LONG_BITS] >> (cpu % LONG_BITS)) & 1) && i-- == 0)
+            break;
+    memset(set, 0, sizeof(set));
+    set[cpu / LONG_BITS] = 1UL << (cpu % LONG_BITS);
+    if (syscall(SYS_sched_setaffinity, 0, sizeof(set), set) < 0)
+        fprintf(stderr, "sched_setaffinity failed: %s\n", strerror(errno));
+}
+
+/*
+ * spawn - Fork worker i. Returns 0 in the worker, with the signals the
+ *     supervisor handles back to their defaults and unblocked, and the
+ *     worker's pid in the supervisor.
+ */
+static pid_t spawn(int i, sigset_t *prev) 
+{
+    pid_t pid;
+
+    if ((pid = Fork()) == 0) {
+        Signal(SIGCHLD, SIG_DFL);
+        Signal(SIGHUP, SIG_DFL);
+        Signal(SIGTERM, SIG_DFL);
+        Signal(SIGINT, SIG_DFL);
+        Sigprocmask(SIG_SETMASK, prev, NULL);
+        pin_cpu(i);
+    }
+    return pid;
+}
+
+/*
+ * supervise - Run nworkers copies of the server, or one per CPU if
+ *     nworkers is 0. The caller forks here: in each worker, supervise
+ *     returns its number, from 0, with the worker pinned to a CPU of its
+ *     own while there are enough, to open its listening socket with
+ *     open_reuseport_listenfd. The calling process stays behind as the
+ *     supervisor and never returns:
+ *       - a worker that exits or dies is started again;
+ *       - SIGHUP starts a new worker in every slot, then sends the old
+ *         one SIGTERM, on which a worker should stop accepting, finish
+ *         the connections it has, and exit;
+ *       - SIGTERM or SIGINT sends every worker SIGTERM, and exits once
+ *         all of them have.
+ */
+int supervise(int nworkers) 
+{
+    sigset_t mask, prev;
+    unsigned long set[MAX_CPUS / LONG_BITS];
+    pid_t *pids, pid;
+    time_t *started;
+    int i, status, live = 0, stopping = 0;
+
+    if (nworkers <= 0 && (nworkers = allowed_cpus(set)) == 0)
+        nworkers = 1;
+    pids = Calloc(nworkers, sizeof(pid_t));
+    started = Calloc(nworkers, sizeof(time_t));
+
+    /* Signals wait until the loop below is ready for them */
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGCHLD);
+    Sigaddset(&mask, SIGHUP);
+    Sigaddset(&mask, SIGTERM);
+    Sigaddset(&mask, SIGINT);
+    Sigprocmask(SIG_BLOCK, &mask, &prev);
+    Signal(SIGCHLD, supervisor_handler);
+    Signal(SIGHUP, supervisor_handler);
+    Signal(SIGTERM, supervisor_handler);
+    Signal(SIGINT, supervisor_handler);
+
+    for (i = 0; i < nworkers; i++) {
+        if ((pids[i] = spawn(i, &prev)) == 0)
+            return i;
+        started[i] = time(NULL);
+        live++;
+    }
+    while (1) {
+        while (!worker_exited && !reload && !stop)
+            sigsuspend(&prev);
+        if (worker_exited) {
+            worker_exited = 0;
+            while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                live--;
+                for (i = 0; i < nworkers && pids[i] != pid; i++)
+                    ;
+                /* Old workers drained after a reload are not replaced */
+                if (i == nworkers)
+                    continue;
+                pids[i] = 0;
+                if (stopping)
+                    continue;
+                if (WIFSIGNALED(status))
+                    fprintf(stderr, "worker %d (pid %d) killed by signal %d, restarting\n",
+                            i, (int)pid, WTERMSIG(status));
+                else
+                    fprintf(stderr, "worker %d (pid %d) exited with status %d, restarting\n",
+                            i, (int)pid, WEXITSTATUS(status));
+                /* Don't spin on a worker that dies as soon as it starts */
+                if (time(NULL) - started[i] < 1)
+                    sleep(1);
+                if ((pids[i] = spawn(i, &prev)) == 0)
+                    return i;
+                started[i] = time(NULL);
+                live++;
+            }
+        }
+        if (reload) {
+            reload = 0;
+            for (i = 0; i < nworkers && !stopping; i++) {
+                pid = pids[i];
+                if ((pids[i] = spawn(i, &prev)) == 0)
+                    return i;
+                started[i] = time(NULL);
+                live++;
+                if (pid > 0)
+                    kill(pid, SIGTERM);
+            }
+        }
+        if (stop) {
+            stop = 0;
+            stopping = 1;
+            for (i = 0; i < nworkers; i++)
+                if (pids[i] > 0)
+                    kill(pids[i], SIGTERM);
+        }
+        if (stopping && live == 0)
+            exit(0);
+    }
+}
+
 /* $end csapp.c */
 
 
@@ -0,0 +1,588 @@
+/*
+ * diskcache.c - Second cache tier on disk.
+ *               Objects the memory cache evicts are appended, as records,
+ *               to segment files of SEGMENT_SIZE bytes in one directory.
+ *               Every segment is mapped into memory; an in-memory index
+ *               maps a key to the segment and offset of its newest record,
+ *               so a hit costs no system call to find the object, and its
+ *               body can go to the client with sendfile.
+ *
+ *               A record is a header (magic, key length, object size, a
+ *               checksum of both and the expiry time), the key and the
+ *               object, padded to 8 bytes. Records are never changed in place: a newer copy
+ *               of a key leaves the old record dead. Once the segments
+ *               hold more than max_bytes, the oldest segment goes, unless
+ *               some segment is mostly dead records; that one is compacted
+ *               instead, by copying its live records to the end of the
+ *               newest segment and deleting it.
+ *
+ *               On start the index is rebuilt by reading the records of
+ *               every segment in order. Scanning a segment stops at the
+ *               first record whose header or checksum is wrong, so a record
+ *               torn by a crash is ignored and later overwritten.
+ *
+ *               A single writer thread does every append, compaction and
+ *               deletion, fed by a queue so that the eviction hook never
+ *               waits on the disk. Readers hold a reference to the segment
+ *               they read, so a segment that is deleted while its object
+ *               is being sent stays mapped until they are done.
+ */
+#include <sys/uio.h>
+#include "csapp.h"
+#include "log.h"
+#include "diskcache.h"
+
+#define NBUCKETS 4096
+#define SEGMENT_SIZE (8 * 1024 * 1024)
+#define QUEUE_MAX 256              /* evicted objects waiting to be written */
+#define COMPACT_PERCENT 50         /* compact segments less live than this */
+#define RECORD_MAGIC 0x324b5344    /* "DSK2" */
+
+typedef struct {
+	unsigned int magic;
+	unsigned int key_len;      /* without the NUL */
+	unsigned int size;         /* object bytes */
+	unsigned int sum;          /* FNV-1a of the key and the object */
+	long long expires;         /* when the object stops being fresh */
+} record_t;
+
+typedef struct segment {
+	unsigned int id;           /* file name is seg-<id in hex> */
+	int fd;
+	char *map;                 /* the whole file */
+	size_t used;               /* bytes of records written */
+	size_t live;               /* bytes of records the index points to */
+	int refcnt;                /* 1 while on the list, plus readers */
+	struct segment *next;      /* list of segments, oldest first */
+} segment_t;
+
+typedef struct entry {
+	char *key;
+	segment_t *seg;
+	size_t off;                /* of the record */
+	size_t size;               /* object bytes */
+	unsigned int sum;
+	time_t expires;
+	struct entry *next;        /* hash chain */
+} entry_t;
+
+typedef struct pending {
+	cache_obj_t *obj;
+	struct pending *next;
+} pending_t;
+
+static char *dir;
+static size_t max_bytes;
+static int enabled;
+
+static entry_t *buckets[NBUCKETS];
+static segment_t *segments;        /* oldest first */
+static segment_t *active;          /* the newest, appended to */
+static size_t disk_used;           /* bytes of records in all segments */
+static unsigned int next_id;
+static unsigned long objects, hits;
+static sem_t mutex;                /* protects the index, the list and refcnts */
+
+static pending_t *queue_head, *queue_tail;
+static int queued;
+static sem_t queue_mutex, queue_items;
+
+/*
+ * hash - djb2 hash of a key.
+ */
+static unsigned int hash(const char *key)
+{
+	unsigned int h = 5381;
+
+	while (*key){
+		h = h * 33 + (unsigned char)*key++;
+	}
+	return h % NBUCKETS;
+}
+
+/*
+ * checksum - FNV-1a hash of a key and an object.
+ */
+static unsigned int checksum(const char *key, size_t key_len, const char *data, size_t size)
+{
+	unsigned int h = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < key_len; i++){
+		h = (h ^ (unsigned char)key[i]) * 16777619u;
+	}
+	for (i = 0; i < size; i++){
+		h = (h ^ (unsigned char)data[i]) * 16777619u;
+	}
+	return h;
+}
+
+/*
+ * record_size - Bytes a record of the key and object takes in a segment.
+ */
+static size_t record_size(size_t key_len, size_t size)
+{
+	return (sizeof(record_t) + key_len + size + 7) & ~(size_t)7;
+}
+
+/*
+ * seg_path - Name of the file of segment id.
+ */
+static void seg_path(char *path, unsigned int id)
+{
+	snprintf(path, MAXLINE, "%s/seg-%08x", dir, id);
+}
+
+/*
+ * seg_open - Open the file of segment id, creating it if needed, and map
+ *            it. Returns NULL on error.
+ */
+static segment_t *seg_open(unsigned int id)
+{
+	char path[MAXLINE];
+	struct stat st;
+	segment_t *seg;
+	char *map;
+	int fd;
+
+	seg_path(path, id);
+	if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0){
+		log_msg(LOG_ERROR, "cannot open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	// The file gets its full size up front, so the mapping never changes.
+	if (fstat(fd, &st) < 0 || (st.st_size < SEGMENT_SIZE && ftruncate(fd, SEGMENT_SIZE) < 0) ||
+	    (map = mmap(NULL, SEGMENT_SIZE, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED){
+		log_msg(LOG_ERROR, "cannot map %s: %s", path, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	seg = Malloc(sizeof(segment_t));
+	seg->id = id;
+	seg->fd = fd;
+	seg->map = map;
+	seg->used = seg->live = 0;
+	seg->refcnt = 1;
+	seg->next = NULL;
+	return seg;
+}
+
+/*
+ * seg_put - Drop a reference to seg, unmapping it with the last one.
+ *           Called with mutex held.
+ */
+static void seg_put(segment_t *seg)
+{
+	if (--seg->refcnt == 0){
+		munmap(seg->map, SEGMENT_SIZE);
+		close(seg->fd);
+		Free(seg);
+	}
+}
+
+/*
+ * seg_link - Put seg at the end of the list and make it the active one.
+ */
+static void seg_link(segment_t *seg)
+{
+	segment_t **pp;
+
+	P(&mutex);
+	for (pp = &segments; *pp; pp = &(*pp)->next)
+		;
+	*pp = seg;
+	active = seg;
+	disk_used += seg->used;
+	V(&mutex);
+}
+
+/*
+ * find - The entry for key, or NULL. Called with mutex held.
+ */
+static entry_t *find(const char *key)
+{
+	entry_t *e;
+
+	for (e = buckets[hash(key)]; e; e = e->next){
+		if (!strcmp(e->key, key)){
+			break;
+		}
+	}
+	return e;
+}
+
+/*
+ * index_set - Point key at the record at off in seg. The record it
+ *             pointed at before, if any, is dead. Called with mutex held.
+ */
+static void index_set(const char *key, segment_t *seg, size_t off, size_t size, unsigned int sum,
+		      time_t expires)
+{
+	entry_t *e;
+	size_t key_len = strlen(key);
+
+	if ((e = find(key)) != NULL){
+		e->seg->live -= record_size(key_len, e->size);
+	}else{
+		e = Malloc(sizeof(entry_t));
+		e->key = Malloc(key_len + 1);
+		strcpy(e->key, key);
+		e->next = buckets[hash(key)];
+		buckets[hash(key)] = e;
+		objects++;
+	}
+	e->seg = seg;
+	e->off = off;
+	e->size = size;
+	e->sum = sum;
+	e->expires = expires;
+	seg->live += record_size(key_len, size);
+}
+
+/*
+ * index_drop - Remove every entry that points into seg.
+ *              Called with mutex held.
+ */
+static void index_drop(segment_t *seg)
+{
+	entry_t **pp, *e;
+	int i;
+
+	for (i = 0; i < NBUCKETS; i++){
+		for (pp = &buckets[i]; (e = *pp) != NULL; ){
+			if (e->seg == seg){
+				*pp = e->next;
+				Free(e->key);
+				Free(e);
+				objects--;
+			}else{
+				pp = &e->next;
+			}
+		}
+	}
+	seg->live = 0;
+}
+
+/*
+ * append - Write a record of key and the object at the end of the active
+ *          segment, starting a new segment if it does not fit, and point
+ *          the index at it. Writer thread only.
+ */
+static void append(const char *key, const char *data, size_t size, unsigned int sum, time_t expires)
+{
+	static char pad[8];
+	size_t key_len = strlen(key), n = record_size(key_len, size);
+	record_t rec = {RECORD_MAGIC, key_len, size, sum, expires};
+	struct iovec iov[4];
+	segment_t *seg;
+
+	if (n > SEGMENT_SIZE){
+		return;
+	}
+	if (active == NULL || active->used + n > SEGMENT_SIZE){
+		if ((seg = seg_open(next_id)) == NULL){
+			return;
+		}
+		next_id++;
+		seg_link(seg);
+	}
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *)key;
+	iov[1].iov_len = key_len;
+	iov[2].iov_base = (void *)data;
+	iov[2].iov_len = size;
+	iov[3].iov_base = pad;
+	iov[3].iov_len = n - sizeof(rec) - key_len - size;
+	if (pwritev(active->fd, iov, 4, active->used) != (ssize_t)n){
+		log_msg(LOG_ERROR, "cannot write segment %x: %s", active->id, strerror(errno));
+		return;
+	}
+	// Readers only find the record once it is all there.
+	P(&mutex);
+	index_set(key, active, active->used, size, sum, expires);
+	active->used += n;
+	disk_used += n;
+	V(&mutex);
+}
+
+/*
+ * compact - Copy the live records of seg to the active segment.
+ *           Writer thread only.
+ */
+static void compact(segment_t *seg)
+{
+	char *key = Malloc(MAXLINE);
+	record_t *rec;
+	entry_t *e;
+	size_t off;
+	int live;
+
+	for (off = 0; off < seg->used; off += record_size(rec->key_len, rec->size)){
+		rec = (record_t *)(seg->map + off);
+		memcpy(key, seg->map + off + sizeof(record_t), rec->key_len);
+		key[rec->key_len] = '\0';
+		P(&mutex);
+		live = (e = find(key)) != NULL && e->seg == seg && e->off == off;
+		V(&mutex);
+		if (live){
+			append(key, seg->map + off + sizeof(record_t) + rec->key_len, rec->size, rec->sum,
+			       rec->expires);
+		}
+	}
+	Free(key);
+}
+
+/*
+ * retire - Delete seg: drop its entries, take it off the list and
+ *          remove its file. Writer thread only.
+ */
+static void retire(segment_t *seg)
+{
+	char path[MAXLINE];
+	segment_t **pp;
+
+	P(&mutex);
+	index_drop(seg);
+	for (pp = &segments; *pp != seg; pp = &(*pp)->next)
+		;
+	*pp = seg->next;
+	disk_used -= seg->used;
+	seg_path(path, seg->id);
+	unlink(path);
+	seg_put(seg);
+	V(&mutex);
+}
+
+/*
+ * make_room - Delete or compact segments other than the active one until
+ *             the records fit in max_bytes. Writer thread only.
+ */
+static void make_room(void)
+{
+	segment_t *seg, *victim;
+
+	while (disk_used > max_bytes && segments != active){
+		// The sealed segment with the least live data.
+		victim = segments;
+		for (seg = segments; seg != active; seg = seg->next){
+			if (seg->live * victim->used < victim->live * seg->used){
+				victim = seg;
+			}
+		}
+		if (victim->live * 100 < victim->used * COMPACT_PERCENT){
+			log_msg(LOG_DEBUG, "compacting segment %x (%zu of %zu bytes live)",
+				victim->id, victim->live, victim->used);
+			compact(victim);
+		}else{
+			victim = segments;
+			log_msg(LOG_DEBUG, "dropping segment %x", victim->id);
+		}
+		retire(victim);
+	}
+}
+
+/*
+ * rebuild - Open the segments left in dir by an earlier run and index
+ *           their records, oldest first so that newer copies win.
+ */
+static void rebuild(void)
+{
+	DIR *dp;
+	struct dirent *de;
+	unsigned int *ids = NULL, id, tmp;
+	int n = 0, i, j;
+	char *key = Malloc(MAXLINE);
+	segment_t *seg;
+	record_t *rec;
+	size_t off, size;
+
+	if ((dp = opendir(dir)) == NULL){
+		unix_error("cannot open disk cache directory");
+	}
+	while ((de = readdir(dp)) != NULL){
+		if (sscanf(de->d_name, "seg-%8x", &id) == 1 && strlen(de->d_name) == 12){
+			ids = Realloc(ids, (n + 1) * sizeof(unsigned int));
+			ids[n++] = id;
+		}
+	}
+	closedir(dp);
+	for (i = 1; i < n; i++){
+		for (j = i; j > 0 && ids[j - 1] > ids[j]; j--){
+			tmp = ids[j];
+			ids[j] = ids[j - 1];
+			ids[j - 1] = tmp;
+		}
+	}
+	for (i = 0; i < n; i++){
+		if ((seg = seg_open(ids[i])) == NULL){
+			continue;
+		}
+		for (off = 0; off + sizeof(record_t) <= SEGMENT_SIZE; off += size){
+			rec = (record_t *)(seg->map + off);
+			if (rec->magic != RECORD_MAGIC || rec->key_len == 0 || rec->key_len >= MAXLINE ||
+			    (size = record_size(rec->key_len, rec->size)) > SEGMENT_SIZE - off ||
+			    checksum(seg->map + off + sizeof(record_t), rec->key_len,
+				     seg->map + off + sizeof(record_t) + rec->key_len, rec->size) != rec->sum){
+				break;
+			}
+			memcpy(key, seg->map + off + sizeof(record_t), rec->key_len);
+			key[rec->key_len] = '\0';
+			P(&mutex);
+			index_set(key, seg, off, rec->size, rec->sum, rec->expires);
+			V(&mutex);
+		}
+		seg->used = off;
+		seg_link(seg);
+		next_id = ids[i] + 1;
+	}
+	log_msg(LOG_INFO, "disk cache %s: %lu objects in %d segments", dir, objects, n);
+	if (ids != NULL){
+		Free(ids);
+	}
+	Free(key);
+}
+
+/*
+ * writer - Thread routine: write the objects the memory cache evicts.
+ */
+static void *writer(void *vargp)
+{
+	pending_t *p;
+	cache_obj_t *obj;
+	entry_t *e;
+	unsigned int sum;
+	time_t expires;
+	int changed;
+
+	Pthread_detach(pthread_self());
+	while (1){
+		P(&queue_items);
+		P(&queue_mutex);
+		p = queue_head;
+		if ((queue_head = p->next) == NULL){
+			queue_tail = NULL;
+		}
+		queued--;
+		V(&queue_mutex);
+		obj = p->obj;
+		Free(p);
+		// An object brought back from disk is usually still there,
+		// unless it changed or was revalidated in the meantime.
+		sum = checksum(obj->key, strlen(obj->key), obj->data, obj->size);
+		expires = __atomic_load_n(&obj->expires, __ATOMIC_RELAXED);
+		P(&mutex);
+		changed = (e = find(obj->key)) == NULL || e->size != obj->size || e->sum != sum ||
+			  e->expires != expires;
+		V(&mutex);
+		if (changed){
+			append(obj->key, obj->data, obj->size, sum, expires);
+			make_room();
+		}
+		cache_release(obj);
+	}
+	return NULL;
+}
+
+/*
+ * diskcache_init - Keep evicted objects in the directory path, creating
+ *                  it if needed, using at most max bytes. Objects left
+ *                  there by an earlier run are found again.
+ *                  Call once before any thread uses the disk cache.
+ */
+void diskcache_init(char *path, size_t max)
+{
+	pthread_t tid;
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST){
+		unix_error("cannot create disk cache directory");
+	}
+	dir = Malloc(strlen(path) + 1);
+	strcpy(dir, path);
+	max_bytes = max;
+	Sem_init(&mutex, 0, 1);
+	Sem_init(&queue_mutex, 0, 1);
+	Sem_init(&queue_items, 0, 0);
+	rebuild();
+	make_room();
+	enabled = 1;
+	Pthread_create(&tid, NULL, writer, NULL);
+}
+
+/*
+ * diskcache_put - Queue an object evicted from the memory cache to be
+ *                 written. Takes over the caller's reference to it.
+ *                 The object is dropped if the writer is too far behind.
+ *                 Meant to be the memory cache's eviction hook.
+ */
+void diskcache_put(cache_obj_t *obj)
+{
+	pending_t *p;
+
+	P(&queue_mutex);
+	if (!enabled || queued >= QUEUE_MAX){
+		V(&queue_mutex);
+		cache_release(obj);
+		return;
+	}
+	p = Malloc(sizeof(pending_t));
+	p->obj = obj;
+	p->next = NULL;
+	if (queue_tail != NULL){
+		queue_tail->next = p;
+	}else{
+		queue_head = p;
+	}
+	queue_tail = p;
+	queued++;
+	V(&queue_mutex);
+	V(&queue_items);
+}
+
+/*
+ * diskcache_lookup - Find the object stored under key. Returns 1 and
+ *                    fills in *dobj on a hit, and the caller must then
+ *                    call diskcache_release. Returns 0 on a miss.
+ */
+int diskcache_lookup(const char *key, disk_obj_t *dobj)
+{
+	entry_t *e;
+	size_t start;
+
+	if (!enabled){
+		return 0;
+	}
+	P(&mutex);
+	if ((e = find(key)) != NULL){
+		e->seg->refcnt++;
+		start = e->off + sizeof(record_t) + strlen(key);
+		dobj->seg = e->seg;
+		dobj->fd = e->seg->fd;
+		dobj->data = e->seg->map + start;
+		dobj->offset = start;
+		dobj->size = e->size;
+		dobj->expires = e->expires;
+		hits++;
+	}
+	V(&mutex);
+	return e != NULL;
+}
+
+/*
+ * diskcache_release - Done with an object diskcache_lookup found.
+ */
+void diskcache_release(disk_obj_t *dobj)
+{
+	P(&mutex);
+	seg_put(dobj->seg);
+	V(&mutex);
+}
+
+/*
+ * diskcache_stats - Hits so far and objects on disk now.
+ */
+void diskcache_stats(unsigned long *h, unsigned long *n)
+{
+	*h = hits;
+	*n = objects;
+}
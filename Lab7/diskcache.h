@@ -0,0 +1,27 @@
+/*
+ * diskcache.h - Second cache tier of objects evicted from memory
+ */
+#ifndef __DISKCACHE_H__
+#define __DISKCACHE_H__
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "cache.h"
+
+/* An object found on disk. Valid until diskcache_release. */
+typedef struct {
+	void *seg;                 /* segment it is in; private */
+	int fd;                    /* segment file, for sendfile */
+	char *data;                /* the object, mapped from the file */
+	off_t offset;              /* where data starts in the file */
+	size_t size;
+	time_t expires;            /* when it stops being fresh */
+} disk_obj_t;
+
+void diskcache_init(char *dir, size_t max_bytes);
+void diskcache_put(cache_obj_t *obj);
+int diskcache_lookup(const char *key, disk_obj_t *dobj);
+void diskcache_release(disk_obj_t *dobj);
+void diskcache_stats(unsigned long *hits, unsigned long *objects);
+
+#endif /* __DISKCACHE_H__ */
@@ -0,0 +1,342 @@
+/*
+ * dnscache.c - Cache of host name lookups.
+ *              A resolved host keeps its addresses for ttl seconds and a
+ *              name that did not resolve is remembered for negative_ttl
+ *              seconds, so a dead host does not cost a lookup per request.
+ *              getaddrinfo does not tell the TTL of the DNS records, so
+ *              every entry gets the same one.
+ *              Threads that ask for a host while it is being looked up
+ *              wait for that lookup instead of starting their own.
+ *              Addresses are kept without a port; each caller gets them
+ *              with its own port filled in.
+ *              Any csapp client can use dnscache_open_clientfd in place of
+ *              open_clientfd; dnscache_init is only needed to change the
+ *              TTLs.
+ */
+#include "csapp.h"
+#include <poll.h>
+#include "dnscache.h"
+#include "stats.h"
+
+#define NBUCKETS 256
+#define MAX_HOST 256               /* longest host name cached */
+#define MAX_ENTRIES 1024           /* hosts cached at once */
+#define DNS_TTL 30                 /* default seconds to keep addresses */
+#define DNS_NEGATIVE_TTL 5         /* default seconds to keep a failure */
+
+typedef struct dns_entry {
+	char host[MAX_HOST];       /* lower case */
+	dns_addr_t addrs[DNS_MAX_ADDRS];
+	int naddrs;                /* 0 for a host that did not resolve */
+	double expires;
+	int resolving;             /* a lookup is in progress */
+	int waiters;               /* threads waiting for it to finish */
+	sem_t ready;               /* posted once per waiter when it does */
+	struct dns_entry *next;    /* hash chain */
+} dns_entry_t;
+
+static dns_entry_t *buckets[NBUCKETS];
+static int nentries;
+static int ttl = DNS_TTL;
+static int negative_ttl = DNS_NEGATIVE_TTL;
+static unsigned long hits, misses;
+static sem_t mutex;                /* protects everything above */
+static int connect_ms;             /* 0 waits as long as connect does */
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+/*
+ * init_mutex - Initialize the mutex; run once.
+ */
+static void init_mutex(void)
+{
+	Sem_init(&mutex, 0, 1);
+}
+
+/*
+ * now - Seconds on the monotonic clock.
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * lookup - Resolve host with getaddrinfo into at most DNS_MAX_ADDRS
+ *          addresses. Returns how many, 0 if host does not resolve.
+ */
+static int lookup(char *host, dns_addr_t *addrs)
+{
+	struct addrinfo hints, *listp, *p;
+	int n = 0;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	if (getaddrinfo(host, NULL, &hints, &listp) != 0){
+		return 0;
+	}
+	for (p = listp; p && n < DNS_MAX_ADDRS; p = p->ai_next){
+		if (p->ai_addrlen > sizeof(struct sockaddr_storage)){
+			continue;
+		}
+		addrs[n].family = p->ai_family;
+		addrs[n].socktype = p->ai_socktype;
+		addrs[n].protocol = p->ai_protocol;
+		addrs[n].addrlen = p->ai_addrlen;
+		memcpy(&addrs[n].addr, p->ai_addr, p->ai_addrlen);
+		n++;
+	}
+	freeaddrinfo(listp);
+	return n;
+}
+
+/*
+ * sweep - Drop expired entries nobody is using.
+ *         Called with mutex held.
+ */
+static void sweep(void)
+{
+	dns_entry_t **pp, *e;
+	double t = now();
+	int i;
+
+	for (i = 0; i < NBUCKETS; i++){
+		for (pp = &buckets[i]; (e = *pp) != NULL; ){
+			if (!e->resolving && e->waiters == 0 && e->expires <= t){
+				*pp = e->next;
+				sem_destroy(&e->ready);
+				Free(e);
+				nentries--;
+			}else{
+				pp = &e->next;
+			}
+		}
+	}
+}
+
+/*
+ * entry_new - Add an entry for host to bucket h. Returns NULL if the
+ *             cache is full of live entries. Called with mutex held.
+ */
+static dns_entry_t *entry_new(char *host, unsigned int h)
+{
+	dns_entry_t *e;
+
+	if (nentries >= MAX_ENTRIES){
+		sweep();
+		if (nentries >= MAX_ENTRIES){
+			return NULL;
+		}
+	}
+	e = Malloc(sizeof(dns_entry_t));
+	strcpy(e->host, host);
+	e->naddrs = 0;
+	e->expires = 0;
+	e->resolving = 0;
+	e->waiters = 0;
+	Sem_init(&e->ready, 0, 0);
+	e->next = buckets[h];
+	buckets[h] = e;
+	nentries++;
+	return e;
+}
+
+/*
+ * copy_out - Copy at most max of n addresses to out with port filled in.
+ *            Returns the number copied.
+ */
+static int copy_out(dns_addr_t *addrs, int n, dns_addr_t *out, int max, int port)
+{
+	int i;
+
+	if (n > max){
+		n = max;
+	}
+	for (i = 0; i < n; i++){
+		out[i] = addrs[i];
+		if (out[i].family == AF_INET){
+			((struct sockaddr_in *)&out[i].addr)->sin_port = htons(port);
+		}else if (out[i].family == AF_INET6){
+			((struct sockaddr_in6 *)&out[i].addr)->sin6_port = htons(port);
+		}
+	}
+	return n;
+}
+
+/*
+ * dnscache_init - Set how many seconds addresses and failures are kept.
+ *                 Call before any thread resolves.
+ */
+void dnscache_init(int new_ttl, int new_negative_ttl)
+{
+	pthread_once(&once, init_mutex);
+	ttl = new_ttl;
+	negative_ttl = new_negative_ttl;
+}
+
+/*
+ * dnscache_resolve - Find at most max addresses of host with the numeric
+ *                    port filled in. Returns how many, or -1 if host does
+ *                    not resolve or port is not a port number.
+ */
+int dnscache_resolve(char *host, char *port, dns_addr_t *addrs, int max)
+{
+	dns_addr_t found[DNS_MAX_ADDRS];
+	char name[MAX_HOST], *end;
+	dns_entry_t *e;
+	unsigned int h = 5381;
+	long portnum;
+	int i, n;
+
+	portnum = strtol(port, &end, 10);
+	if (*port == '\0' || *end != '\0' || portnum < 0 || portnum > 65535){
+		return -1;
+	}
+	if (strlen(host) >= MAX_HOST){
+		// Too long to cache; look it up every time.
+		n = copy_out(found, lookup(host, found), addrs, max, portnum);
+		return n > 0 ? n : -1;
+	}
+	for (i = 0; host[i]; i++){
+		name[i] = tolower(host[i]);
+		h = h * 33 + (unsigned char)name[i];
+	}
+	name[i] = '\0';
+	h %= NBUCKETS;
+
+	pthread_once(&once, init_mutex);
+	P(&mutex);
+	while (1){
+		for (e = buckets[h]; e; e = e->next){
+			if (!strcmp(e->host, name)){
+				break;
+			}
+		}
+		if (e == NULL || !e->resolving){
+			break;
+		}
+		// Someone is looking it up already; wait for the answer.
+		e->waiters++;
+		V(&mutex);
+		P(&e->ready);
+		P(&mutex);
+		e->waiters--;
+	}
+	if (e != NULL && e->expires > now()){
+		hits++;
+		n = copy_out(e->addrs, e->naddrs, addrs, max, portnum);
+		V(&mutex);
+		return n > 0 ? n : -1;
+	}
+	misses++;
+	if (e == NULL){
+		e = entry_new(name, h);
+	}
+	if (e != NULL){
+		e->resolving = 1;
+	}
+	V(&mutex);
+
+	n = lookup(name, found);
+
+	P(&mutex);
+	if (e != NULL){
+		memcpy(e->addrs, found, n * sizeof(dns_addr_t));
+		e->naddrs = n;
+		e->expires = now() + (n > 0 ? ttl : negative_ttl);
+		e->resolving = 0;
+		for (i = 0; i < e->waiters; i++){
+			V(&e->ready);
+		}
+	}
+	V(&mutex);
+	n = copy_out(found, n, addrs, max, portnum);
+	return n > 0 ? n : -1;
+}
+
+/*
+ * dnscache_connect_timeout - Give up on a connect in
+ *                            dnscache_open_clientfd after ms
+ *                            milliseconds (0 for the system's own
+ *                            timeout). Call before connecting.
+ */
+void dnscache_connect_timeout(double ms)
+{
+	connect_ms = ms;
+}
+
+/*
+ * connect_timed - Connect fd to a within connect_ms. fd is back in
+ *                 blocking mode afterwards. Returns 0, or -1 with errno set.
+ */
+static int connect_timed(int fd, dns_addr_t *a)
+{
+	struct pollfd pfd = {fd, POLLOUT, 0};
+	socklen_t len = sizeof(int);
+	int flags, err = 0, rc;
+
+	if (connect_ms <= 0 || (flags = fcntl(fd, F_GETFL, 0)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0){
+		return connect(fd, (SA *)&a->addr, a->addrlen);
+	}
+	if ((rc = connect(fd, (SA *)&a->addr, a->addrlen)) < 0 && errno == EINPROGRESS){
+		while ((rc = poll(&pfd, 1, connect_ms)) < 0 && errno == EINTR)
+			;
+		if (rc == 1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0){
+			rc = 0;
+		}else{
+			if (rc == 0){
+				errno = ETIMEDOUT;
+			}else if (err != 0){
+				errno = err;
+			}
+			rc = -1;
+		}
+	}
+	fcntl(fd, F_SETFL, flags);
+	return rc;
+}
+
+/*
+ * dnscache_open_clientfd - open_clientfd with the host looked up through
+ *                          the cache. Returns a connected socket, -2 if
+ *                          the host does not resolve, and -1 with errno
+ *                          set for other errors.
+ *                          The lookup and the connect are timed (see stats.c),
+ *                          and each connect may be given a timeout.
+ */
+int dnscache_open_clientfd(char *host, char *port)
+{
+	dns_addr_t addrs[DNS_MAX_ADDRS];
+	int clientfd, i, n;
+	double start = now();
+
+	n = dnscache_resolve(host, port, addrs, DNS_MAX_ADDRS);
+	stats_time(STAGE_DNS, (now() - start) * 1000);
+	if (n < 0){
+		return -2;
+	}
+	for (i = 0, start = now(); i < n; i++){
+		if ((clientfd = socket(addrs[i].family, addrs[i].socktype, addrs[i].protocol)) < 0){
+			continue;
+		}
+		if (connect_timed(clientfd, &addrs[i]) == 0){
+			stats_time(STAGE_CONNECT, (now() - start) * 1000);
+			return clientfd;
+		}
+		close(clientfd);
+	}
+	return -1;
+}
+
+/*
+ * dnscache_stats - Number of lookups answered from the cache and not.
+ *                  Threads that waited for another's lookup count as hits.
+ */
+void dnscache_stats(unsigned long *hit_count, unsigned long *miss_count)
+{
+	*hit_count = hits;
+	*miss_count = misses;
+}
@@ -0,0 +1,26 @@
+/*
+ * dnscache.h - Cache of host name lookups
+ */
+#ifndef __DNSCACHE_H__
+#define __DNSCACHE_H__
+
+#include <sys/socket.h>
+
+#define DNS_MAX_ADDRS 4            /* addresses kept per host */
+
+/* One address of a host, ready for socket and connect */
+typedef struct {
+	int family;
+	int socktype;
+	int protocol;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+} dns_addr_t;
+
+void dnscache_init(int ttl, int negative_ttl);
+int dnscache_resolve(char *host, char *port, dns_addr_t *addrs, int max);
+int dnscache_open_clientfd(char *host, char *port);
+void dnscache_connect_timeout(double ms);
+void dnscache_stats(unsigned long *hits, unsigned long *misses);
+
+#endif /* __DNSCACHE_H__ */
@@ -0,0 +1,796 @@
+/*
+ * event.c - Event-driven proxy engine.
+ *           Each reactor thread runs its own epoll loop over non-blocking
+ *           sockets and drives every connection through a state machine:
+ *
+ *               READ_REQUEST -> CONNECT -> SEND_REQUEST -> RELAY -> done
+ *               READ_REQUEST -> SEND_CACHED -> done
+ *
+ *           No thread ever waits on a single connection, so a slow or
+ *           idle client costs its conn_t and nothing else.
+ *           All reactors watch the listening socket with EPOLLEXCLUSIVE,
+ *           and a connection stays on the reactor that accepted it.
+ *           The cache is the same one the threaded engine uses.
+ *           This engine is simpler than the threaded one: a client
+ *           connection carries one request, which goes to the server as
+ *           HTTP/1.0 with only the proxy's own headers, so the client's
+ *           headers and any body are dropped. Stale objects are fetched
+ *           again instead of revalidated, and backend pools, the disk
+ *           cache and request coalescing are not used. Host names are resolved through the DNS cache
+ *           (dnscache.c); a miss still blocks the reactor while the
+ *           lookup runs.
+ *           Every request gets the same access log line as in the
+ *           threaded engine when its connection closes, and is counted
+ *           and timed the same way (see stats.c).
+ *           Clients are admitted and timed out as in the threaded engine
+ *           (see guard.c). Each connection has a deadline for what it
+ *           waits on, and every reactor closes the ones past theirs
+ *           every SWEEP_MS, so thousands of slow clients cost memory for
+ *           a while and then nothing.
+ */
+#include "csapp.h"
+#include <sys/epoll.h>
+#include "cache.h"
+#include "proxy.h"
+#include "event.h"
+#include "dnscache.h"
+#include "log.h"
+#include "stats.h"
+#include "guard.h"
+
+#define MAXEVENTS 64     /* events taken per epoll_wait */
+#define SWEEP_MS 1000    /* how often deadlines are checked */
+#define RELAY_BURST 16   /* reads per event, so one transfer can't hog a reactor */
+
+enum conn_state {
+	READ_REQUEST,    /* reading the request line and headers */
+	CONNECT,         /* non-blocking connect to the server in progress */
+	SEND_REQUEST,    /* writing the rewritten request to the server */
+	RELAY,           /* copying the response from the server to the client */
+	SEND_CACHED      /* writing a cached object to the client */
+};
+
+typedef struct conn conn_t;
+
+/*
+ * One socket of a connection. epoll events point at these.
+ * At most one endpoint of a connection is registered at any time, so a
+ * connection gets at most one event per epoll_wait and can be freed
+ * while the rest of the batch is handled.
+ */
+typedef struct {
+	int fd;
+	unsigned int events;       /* events currently watched */
+	int added;                 /* registered with the epoll instance */
+	conn_t *conn;
+} endpoint_t;
+
+struct conn {
+	enum conn_state state;
+	endpoint_t client;
+	endpoint_t server;
+	char req[MAXLINE];         /* request from the client, then to the server */
+	size_t req_len;
+	size_t req_sent;
+	char buf[MAXBUF];          /* response bytes not yet sent to the client */
+	size_t buf_start;
+	size_t buf_end;
+	int server_eof;
+	char key[MAXLINE];         /* cache key, or "" if not cacheable */
+	char *object;              /* response collected for the cache */
+	size_t object_size;
+	size_t object_cap;
+	cache_obj_t *cached;       /* object being sent in SEND_CACHED */
+	size_t cached_sent;
+	char method[16];           /* for the access log; "" until parsed */
+	char uri[MAXLINE];
+	int status;                /* status of the response, 0 if none */
+	int local;                 /* answered by the proxy itself */
+	long long bytes;           /* bytes sent to the client */
+	double start;              /* when the request was complete */
+	double upstream_start;     /* when the lookup began, 0 if never */
+	double connect_start;      /* when the connect began */
+	double sent;               /* when the request was sent */
+	double first_byte;         /* when the response started, 0 if never */
+	double upstream_end;       /* when the server finished */
+	guard_client_t *guard;     /* what the client was admitted as */
+	double deadline;           /* closed if still waiting then; 0 for never */
+	conn_t *next;              /* list of the reactor's connections */
+	conn_t **pprev;            /* what points at this one */
+};
+
+typedef struct {
+	int epfd;
+	int listenfd;
+	conn_t *conns;             /* every open connection, for the sweep */
+	double next_sweep;
+} reactor_t;
+
+static char timeout_resp[] = "HTTP/1.1 408 Request Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static char too_large_resp[] = "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static char bad_gateway_resp[] = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static char bad_request_resp[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static char uri_too_long_resp[] = "HTTP/1.1 414 URI Too Long\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static char gateway_timeout_resp[] = "HTTP/1.1 504 Gateway Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+static void *reactor_thread(void *vargp);
+static void reactor_loop(reactor_t *r);
+static void accept_clients(reactor_t *r);
+static void handle(reactor_t *r, endpoint_t *ep, unsigned int events);
+static void read_request(reactor_t *r, conn_t *c);
+static void start_request(reactor_t *r, conn_t *c);
+static void start_connect(reactor_t *r, conn_t *c, char *host, char *port);
+static void send_request(reactor_t *r, conn_t *c);
+static void relay(reactor_t *r, conn_t *c);
+static void send_cached(reactor_t *r, conn_t *c);
+static void collect(conn_t *c, char *data, size_t n);
+static void watch(reactor_t *r, endpoint_t *ep, unsigned int events);
+static void conn_close(conn_t *c);
+static void upstream_failed(conn_t *c, int timed_out);
+static void refuse(conn_t *c, int status, char *resp);
+static void arm(conn_t *c, int timeout);
+static void sweep(reactor_t *r);
+static int parse_status(char *data, size_t n);
+static void set_nonblocking(int fd);
+
+/*
+ * event_run - Serve connections on listenfd with nreactors epoll loops.
+ *             The calling thread runs one of them. Never returns.
+ */
+void event_run(int listenfd, int nreactors)
+{
+	reactor_t *r;
+	pthread_t tid;
+	int i;
+
+	set_nonblocking(listenfd);
+	for (i = 0; i < nreactors; i++){
+		r = Malloc(sizeof(reactor_t));
+		r->listenfd = listenfd;
+		r->conns = NULL;
+		r->next_sweep = 0;
+		if ((r->epfd = epoll_create1(0)) < 0){
+			unix_error("epoll_create1 error");
+		}
+		if (i == nreactors - 1){
+			reactor_thread(r);
+		}else{
+			Pthread_create(&tid, NULL, reactor_thread, r);
+		}
+	}
+}
+
+/*
+ * reactor_thread - Thread routine of a reactor.
+ */
+static void *reactor_thread(void *vargp)
+{
+	reactor_t *r = (reactor_t *)vargp;
+	struct epoll_event ev;
+
+	// EPOLLEXCLUSIVE wakes one reactor per new connection, not all.
+	ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+	ev.data.ptr = NULL;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, r->listenfd, &ev) < 0){
+		unix_error("epoll_ctl error");
+	}
+	reactor_loop(r);
+	return NULL;
+}
+
+/*
+ * reactor_loop - Wait for events and hand each to its connection.
+ *                A NULL pointer marks the listening socket. Between
+ *                batches, connections past their deadlines are closed.
+ */
+static void reactor_loop(reactor_t *r)
+{
+	struct epoll_event events[MAXEVENTS];
+	int n, i;
+
+	while (1){
+		if (log_ms() >= r->next_sweep){
+			sweep(r);
+			r->next_sweep = log_ms() + SWEEP_MS;
+		}
+		if ((n = epoll_wait(r->epfd, events, MAXEVENTS, SWEEP_MS)) < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			unix_error("epoll_wait error");
+		}
+		for (i = 0; i < n; i++){
+			if (events[i].data.ptr == NULL){
+				accept_clients(r);
+			}else{
+				handle(r, events[i].data.ptr, events[i].events);
+			}
+		}
+	}
+}
+
+/*
+ * accept_clients - Accept every pending connection and start reading
+ *                  its request.
+ */
+static void accept_clients(reactor_t *r)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	guard_client_t *guard;
+	int connfd;
+	conn_t *c;
+
+	while ((connfd = accept(r->listenfd, (SA *)&addr, &addrlen)) >= 0){
+		addrlen = sizeof(addr);
+		if ((guard = guard_admit(&addr)) == NULL){
+			guard_refuse(connfd);
+			continue;
+		}
+		set_nonblocking(connfd);
+		c = Malloc(sizeof(conn_t));
+		c->guard = guard;
+		c->next = r->conns;
+		c->pprev = &r->conns;
+		if (r->conns != NULL){
+			r->conns->pprev = &c->next;
+		}
+		r->conns = c;
+		arm(c, TIMEOUT_IDLE);
+		c->state = READ_REQUEST;
+		c->client.fd = connfd;
+		c->client.events = 0;
+		c->client.added = 0;
+		c->client.conn = c;
+		c->server.fd = -1;
+		c->server.events = 0;
+		c->server.added = 0;
+		c->server.conn = c;
+		c->req_len = c->req_sent = 0;
+		c->buf_start = c->buf_end = 0;
+		c->server_eof = 0;
+		c->key[0] = '\0';
+		c->object = NULL;
+		c->object_size = c->object_cap = 0;
+		c->cached = NULL;
+		c->cached_sent = 0;
+		c->method[0] = '\0';
+		c->status = 0;
+		c->local = 0;
+		c->bytes = 0;
+		c->upstream_start = c->upstream_end = c->first_byte = 0;
+		stats_add(STAT_CONNECTIONS, 1);
+		stats_add(STAT_ACTIVE, 1);
+		watch(r, &c->client, EPOLLIN);
+	}
+	// The listening socket was shut down to drain the process (see
+	// drainer in proxy.c); the connections already here are still served.
+	if (errno == EINVAL){
+		epoll_ctl(r->epfd, EPOLL_CTL_DEL, r->listenfd, NULL);
+		return;
+	}
+	// EAGAIN means another reactor got there first or the queue is empty.
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR){
+		log_msg(LOG_ERROR, "accept error: %s", strerror(errno));
+	}
+}
+
+/*
+ * handle - Advance the connection that owns ep by one step.
+ */
+static void handle(reactor_t *r, endpoint_t *ep, unsigned int events)
+{
+	conn_t *c = ep->conn;
+
+	// A reset client makes every state pointless.
+	if (ep == &c->client && (events & EPOLLERR)){
+		conn_close(c);
+		return;
+	}
+	switch (c->state){
+	case READ_REQUEST:
+		read_request(r, c);
+		break;
+	case CONNECT:
+	case SEND_REQUEST:
+		send_request(r, c);
+		break;
+	case RELAY:
+		relay(r, c);
+		break;
+	case SEND_CACHED:
+		send_cached(r, c);
+		break;
+	}
+}
+
+/*
+ * read_request - Read the client's request until the blank line that
+ *                ends its headers.
+ */
+static void read_request(reactor_t *r, conn_t *c)
+{
+	size_t max = guard_max_header < sizeof(c->req) ? guard_max_header : sizeof(c->req) - 1;
+	ssize_t n;
+
+	while (1){
+		n = read(c->client.fd, c->req + c->req_len, max - c->req_len);
+		if (n < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK){
+				return;
+			}
+			if (errno == EINTR){
+				continue;
+			}
+			conn_close(c);
+			return;
+		}
+		if (n == 0){
+			conn_close(c);
+			return;
+		}
+		// The head must be complete within the header timeout of its
+		// first byte, however slowly the rest comes.
+		if (c->req_len == 0){
+			arm(c, TIMEOUT_HEADER);
+		}
+		c->req_len += n;
+		c->req[c->req_len] = '\0';
+		if (strstr(c->req, "\r\n\r\n") || strstr(c->req, "\n\n")){
+			start_request(r, c);
+			return;
+		}
+		if (c->req_len == max){
+			// Headers larger than the limit.
+			send(c->client.fd, too_large_resp, strlen(too_large_resp), MSG_DONTWAIT | MSG_NOSIGNAL);
+			conn_close(c);
+			return;
+		}
+	}
+}
+
+/*
+ * start_request - Parse the complete request. Serve it from the cache,
+ *                 or rewrite it for the server and start connecting.
+ */
+static void start_request(reactor_t *r, conn_t *c)
+{
+	char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+	char host[MAXLINE], port[MAXLINE], path[MAXLINE];
+	char line[MAXLINE], header[MAXLINE];
+	cache_obj_t *obj;
+
+	if (sscanf(c->req, "%s %s %s", method, uri, version) != 3){
+		conn_close(c);
+		return;
+	}
+	stats_add(STAT_BYTES_IN, c->req_len);
+	if (!strcmp(uri, STATS_URI)){
+		c->start = log_ms();
+		strcpy(c->method, "GET");
+		strcpy(c->uri, uri);
+		c->local = 1;
+		c->status = 200;
+		c->buf_end = stats_page(c->buf, sizeof(c->buf), 0);
+		c->server_eof = 1;
+		c->state = RELAY;
+		relay(r, c);
+		return;
+	}
+	c->start = log_ms();
+	strncpy(c->method, method, sizeof(c->method) - 1);
+	c->method[sizeof(c->method) - 1] = '\0';
+	strcpy(c->uri, uri);
+	// Bounded before anything is built from them.
+	if (strlen(uri) > MAX_URI){
+		refuse(c, 414, uri_too_long_resp);
+		return;
+	}
+	if (strlen(method) >= sizeof(c->method) || !parse_uri(uri, host, port, path) ||
+	    strlen(host) > MAX_HOST || strlen(port) > MAX_PORT){
+		refuse(c, 400, bad_request_resp);
+		return;
+	}
+	make_key(c->key, host, port, path);
+	if (strcasecmp(method, "GET")){
+		c->key[0] = '\0';
+	}else if ((obj = cache_lookup(c->key)) != NULL && !cache_fresh(obj)){
+		// Stale copies are fetched again in full; the threaded engine
+		// revalidates them instead.
+		cache_release(obj);
+	}else if (obj != NULL){
+		c->cached = obj;
+		c->status = 200;
+		c->state = SEND_CACHED;
+		send_cached(r, c);
+		return;
+	}
+	// HTTP/1.0 and our own headers only; see the top of the file.
+	http_request(line, method, path, "HTTP/1.0");
+	if (http_header(host, header, sizeof(header)) < 0 || strlen(line) + strlen(header) >= sizeof(c->req)){
+		conn_close(c);
+		return;
+	}
+	strcpy(c->req, line);
+	strcat(c->req, header);
+	c->req_len = strlen(c->req);
+	c->req_sent = 0;
+	start_connect(r, c, host, port);
+}
+
+/*
+ * start_connect - Open a non-blocking connection to host:port and wait
+ *                 for it to become writable.
+ */
+static void start_connect(reactor_t *r, conn_t *c, char *host, char *port)
+{
+	dns_addr_t addrs[DNS_MAX_ADDRS];
+	int fd = -1, i, n;
+
+	c->upstream_start = log_ms();
+	n = dnscache_resolve(host, port, addrs, DNS_MAX_ADDRS);
+	c->connect_start = log_ms();
+	stats_time(STAGE_DNS, c->connect_start - c->upstream_start);
+	if (n < 0){
+		upstream_failed(c, 0);
+		return;
+	}
+	for (i = 0; i < n; i++){
+		if ((fd = socket(addrs[i].family, addrs[i].socktype | SOCK_NONBLOCK, addrs[i].protocol)) < 0){
+			continue;
+		}
+		if (connect(fd, (SA *)&addrs[i].addr, addrs[i].addrlen) == 0 || errno == EINPROGRESS){
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	if (fd < 0){
+		upstream_failed(c, 0);
+		return;
+	}
+	c->server.fd = fd;
+	c->state = CONNECT;
+	arm(c, TIMEOUT_CONNECT);
+	// Ignore the client until the response starts.
+	watch(r, &c->client, 0);
+	watch(r, &c->server, EPOLLOUT);
+}
+
+/*
+ * send_request - Finish the connect if it is pending, then write the
+ *                request to the server.
+ */
+static void send_request(reactor_t *r, conn_t *c)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	ssize_t n;
+
+	if (c->state == CONNECT){
+		if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0){
+			upstream_failed(c, err == ETIMEDOUT);
+			return;
+		}
+		stats_time(STAGE_CONNECT, log_ms() - c->connect_start);
+		stats_add(STAT_UPSTREAM_NEW, 1);
+		c->state = SEND_REQUEST;
+	}
+	while (c->req_sent < c->req_len){
+		n = write(c->server.fd, c->req + c->req_sent, c->req_len - c->req_sent);
+		if (n < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK){
+				arm(c, TIMEOUT_WRITE);
+				return;
+			}
+			if (errno == EINTR){
+				continue;
+			}
+			upstream_failed(c, 0);
+			return;
+		}
+		c->req_sent += n;
+	}
+	c->sent = log_ms();
+	c->state = RELAY;
+	arm(c, TIMEOUT_READ);
+	watch(r, &c->server, EPOLLIN);
+}
+
+/*
+ * relay - Copy the response from the server to the client.
+ *         Only one side is watched at a time: the server while the buffer
+ *         is empty, the client while it is not. A slow client therefore
+ *         stops the reads from its server instead of growing a buffer.
+ */
+static void relay(reactor_t *r, conn_t *c)
+{
+	ssize_t n;
+	int burst = RELAY_BURST;
+
+	while (1){
+		while (c->buf_start < c->buf_end){
+			n = write(c->client.fd, c->buf + c->buf_start, c->buf_end - c->buf_start);
+			if (n < 0){
+				if (errno == EAGAIN || errno == EWOULDBLOCK){
+					arm(c, TIMEOUT_WRITE);
+					watch(r, &c->server, 0);
+					watch(r, &c->client, EPOLLOUT);
+					return;
+				}
+				if (errno == EINTR){
+					continue;
+				}
+				conn_close(c);
+				return;
+			}
+			c->buf_start += n;
+			c->bytes += n;
+		}
+		c->buf_start = c->buf_end = 0;
+		if (c->server_eof){
+			// The response is complete; cache it if it was a 200.
+			if (c->object != NULL){
+				cache_raw_response(c->key, c->object, c->object_size);
+			}
+			conn_close(c);
+			return;
+		}
+		if (burst-- == 0){
+			break;
+		}
+		n = read(c->server.fd, c->buf, MAXBUF);
+		if (n < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK){
+				break;
+			}
+			if (errno == EINTR){
+				continue;
+			}
+			upstream_failed(c, 0);
+			return;
+		}
+		if (n == 0){
+			if (c->first_byte == 0){
+				upstream_failed(c, 0);
+				return;
+			}
+			c->server_eof = 1;
+			c->upstream_end = log_ms();
+			stats_time(STAGE_TRANSFER, c->upstream_end - c->first_byte);
+		}else{
+			if (c->first_byte == 0){
+				c->first_byte = log_ms();
+				stats_time(STAGE_FIRST_BYTE, c->first_byte - c->sent);
+			}
+			if (c->status == 0){
+				c->status = parse_status(c->buf, n);
+			}
+			collect(c, c->buf, n);
+			c->buf_end = n;
+		}
+	}
+	arm(c, TIMEOUT_READ);
+	watch(r, &c->client, 0);
+	watch(r, &c->server, EPOLLIN);
+}
+
+/*
+ * send_cached - Write the cached object to the client.
+ */
+static void send_cached(reactor_t *r, conn_t *c)
+{
+	ssize_t n;
+
+	while (c->cached_sent < c->cached->size){
+		n = write(c->client.fd, c->cached->data + c->cached_sent, c->cached->size - c->cached_sent);
+		if (n < 0){
+			if (errno == EAGAIN || errno == EWOULDBLOCK){
+				arm(c, TIMEOUT_WRITE);
+				watch(r, &c->client, EPOLLOUT);
+				return;
+			}
+			if (errno == EINTR){
+				continue;
+			}
+			break;
+		}
+		c->cached_sent += n;
+		c->bytes += n;
+	}
+	conn_close(c);
+}
+
+/*
+ * collect - Append n response bytes to the object being collected for
+ *           the cache. Gives up on objects larger than MAX_OBJECT_SIZE.
+ *           The buffer grows as needed, so small responses stay small.
+ */
+static void collect(conn_t *c, char *data, size_t n)
+{
+	if (c->key[0] == '\0'){
+		return;
+	}
+	if (c->object_size + n > MAX_OBJECT_SIZE){
+		if (c->object != NULL){
+			Free(c->object);
+			c->object = NULL;
+		}
+		c->key[0] = '\0';
+		return;
+	}
+	if (c->object_size + n > c->object_cap){
+		c->object_cap = c->object_cap ? 2 * c->object_cap : MAXBUF;
+		if (c->object_cap > MAX_OBJECT_SIZE){
+			c->object_cap = MAX_OBJECT_SIZE;
+		}
+		c->object = Realloc(c->object, c->object_cap);
+	}
+	memcpy(c->object + c->object_size, data, n);
+	c->object_size += n;
+}
+
+/*
+ * watch - Make the epoll interest of ep exactly events.
+ *         No events removes ep from the epoll instance, since epoll
+ *         would still report errors and hangups on it.
+ *         Skips the system call if nothing changes.
+ */
+static void watch(reactor_t *r, endpoint_t *ep, unsigned int events)
+{
+	struct epoll_event ev;
+	int op;
+
+	if (events == 0){
+		if (ep->added && epoll_ctl(r->epfd, EPOLL_CTL_DEL, ep->fd, NULL) < 0){
+			unix_error("epoll_ctl error");
+		}
+		ep->added = 0;
+		ep->events = 0;
+		return;
+	}
+	if (ep->added && ep->events == events){
+		return;
+	}
+	op = ep->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	ev.events = events;
+	ev.data.ptr = ep;
+	if (epoll_ctl(r->epfd, op, ep->fd, &ev) < 0){
+		unix_error("epoll_ctl error");
+	}
+	ep->added = 1;
+	ep->events = events;
+}
+
+/*
+ * conn_close - Close both sockets and free the connection.
+ *              Closing a socket also removes it from the epoll instance.
+ */
+static void conn_close(conn_t *c)
+{
+	double upstream_ms = 0;
+
+	if (c->method[0] != '\0'){
+		if (c->upstream_start > 0){
+			upstream_ms = (c->upstream_end > 0 ? c->upstream_end : log_ms()) - c->upstream_start;
+		}
+		log_msg(LOG_INFO, "method=%s uri=%s status=%d bytes=%lld upstream_ms=%.2f total_ms=%.2f cache=%s",
+			c->method, c->uri, c->status, c->bytes, upstream_ms, log_ms() - c->start,
+			c->local ? "stats" : c->cached != NULL ? "hit" : "miss");
+		if (!c->local){
+			stats_add(c->cached != NULL ? STAT_HITS : STAT_MISSES, 1);
+		}
+		stats_add(STAT_REQUESTS, 1);
+		stats_add(STAT_BYTES_OUT, c->bytes);
+		if (c->status == 0 || c->status >= 500){
+			stats_add(STAT_ERRORS, 1);
+		}
+		stats_time(STAGE_TOTAL, log_ms() - c->start);
+	}
+	stats_add(STAT_ACTIVE, -1);
+	*c->pprev = c->next;
+	if (c->next != NULL){
+		c->next->pprev = c->pprev;
+	}
+	guard_leave(c->guard);
+	close(c->client.fd);
+	if (c->server.fd >= 0){
+		close(c->server.fd);
+	}
+	if (c->cached != NULL){
+		cache_release(c->cached);
+	}
+	if (c->object != NULL){
+		Free(c->object);
+	}
+	Free(c);
+}
+
+/*
+ * upstream_failed - The server of c failed before any of its response
+ *                   arrived: the client hears 502, or 504 if the server
+ *                   timed out, unless it is already getting a response.
+ *                   Then c is closed.
+ */
+static void upstream_failed(conn_t *c, int timed_out)
+{
+	char *resp = timed_out ? gateway_timeout_resp : bad_gateway_resp;
+
+	if (c->first_byte == 0 && !c->local){
+		c->status = timed_out ? 504 : 502;
+		send(c->client.fd, resp, strlen(resp), MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	conn_close(c);
+}
+
+/*
+ * refuse - Answer the request on c with the error resp, whose status is
+ *          status, and close c.
+ */
+static void refuse(conn_t *c, int status, char *resp)
+{
+	c->status = status;
+	send(c->client.fd, resp, strlen(resp), MSG_DONTWAIT | MSG_NOSIGNAL);
+	conn_close(c);
+}
+
+/*
+ * arm - Give c until the timeout from now for what it waits on next.
+ */
+static void arm(conn_t *c, int timeout)
+{
+	double ms = guard_ms(timeout);
+
+	c->deadline = ms > 0 ? log_ms() + ms : 0;
+}
+
+/*
+ * sweep - Close the connections of r that are past their deadlines. A
+ *         client whose request head is not complete gets a 408 first, and
+ *         one whose server has not started to answer a 504.
+ */
+static void sweep(reactor_t *r)
+{
+	double now = log_ms();
+	conn_t *c, *next;
+
+	for (c = r->conns; c != NULL; c = next){
+		next = c->next;
+		if (c->deadline == 0 || now < c->deadline){
+			continue;
+		}
+		if (c->state == READ_REQUEST && c->req_len > 0){
+			stats_add(STAT_HEADER_TIMEOUTS, 1);
+			send(c->client.fd, timeout_resp, strlen(timeout_resp), MSG_DONTWAIT | MSG_NOSIGNAL);
+		}else if (c->state == CONNECT || c->state == SEND_REQUEST || c->state == RELAY){
+			upstream_failed(c, 1);
+			continue;
+		}
+		conn_close(c);
+	}
+}
+
+/*
+ * parse_status - Status code of the status line that starts data, or 0.
+ */
+static int parse_status(char *data, size_t n)
+{
+	char *sp;
+
+	if (n < 12 || strncmp(data, "HTTP/", 5) || (sp = memchr(data, ' ', n - 4)) == NULL){
+		return 0;
+	}
+	return atoi(sp + 1);
+}
+
+/*
+ * set_nonblocking - Put fd in non-blocking mode.
+ */
+static void set_nonblocking(int fd)
+{
+	int flags;
+
+	if ((flags = fcntl(fd, F_GETFL, 0)) < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0){
+		unix_error("fcntl error");
+	}
+}
@@ -0,0 +1,9 @@
+/*
+ * event.h - Event-driven proxy engine built on epoll
+ */
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+void event_run(int listenfd, int nreactors);
+
+#endif /* __EVENT_H__ */
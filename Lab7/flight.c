@@ -0,0 +1,422 @@
+/*
+ * flight.c - Coalescing of concurrent fetches of the same object.
+ *            The first request for a key that is not cached becomes the
+ *            leader of a flight and fetches it. Requests for the same key
+ *            that arrive while the flight is open join it as followers:
+ *            they send the leader's response to their own clients as it
+ *            arrives, whether or not it ends up in the cache, so a burst
+ *            of requests for a cold object costs the server one fetch.
+ *
+ *            The flight keeps the response header and a window of at most
+ *            FLIGHT_BUFFER body bytes. Bytes every follower has taken are
+ *            dropped when the window fills up; once the start of the body
+ *            is gone nobody new can join. A follower so slow that the
+ *            window cannot move on is cut off and its client closed, so
+ *            one slow client never holds up the leader.
+ *
+ *            Each flight has its own mutex. Followers sleep on their own
+ *            semaphore and the leader wakes the ones that wait after each
+ *            header or body block. Lock order is table_mutex, then a
+ *            flight's mutex.
+ */
+#include "csapp.h"
+#include "bufpool.h"
+#include "flight.h"
+
+#define NBUCKETS 256
+#define FLIGHT_BUFFER (4 * 1024 * 1024)   /* most body bytes kept */
+#define FLIGHT_BLOCK 65536                /* bytes a follower takes at once */
+
+struct flight {
+	char *key;
+	char *hdr;                 /* status line and headers without framing */
+	size_t hdr_size;           /* hdr is NULL until the leader has it */
+	long long length;          /* body length, or -1 if not known */
+	char *data;                /* body bytes base .. base + len - 1 */
+	size_t len;
+	size_t cap;
+	long long base;
+	int joinable;              /* the start of the body is still here */
+	int done;
+	int complete;              /* the whole response arrived */
+	flight_reader_t *readers;
+	sem_t mutex;               /* protects everything above */
+	int refcnt;                /* leader and followers; under table_mutex */
+	int linked;                /* in the hash table; under table_mutex */
+	struct flight *next;       /* hash chain; under table_mutex */
+};
+
+static flight_t *buckets[NBUCKETS];
+static sem_t table_mutex;
+static unsigned long coalesced;    /* requests that followed a flight */
+
+/*
+ * hash - djb2 hash of a key.
+ */
+static unsigned int hash(const char *key)
+{
+	unsigned int h = 5381;
+
+	while (*key){
+		h = h * 33 + (unsigned char)*key++;
+	}
+	return h % NBUCKETS;
+}
+
+/*
+ * wake_all - Wake every waiting follower. Called with f->mutex held.
+ */
+static void wake_all(flight_t *f)
+{
+	flight_reader_t *r;
+
+	for (r = f->readers; r; r = r->next){
+		if (r->waiting){
+			r->waiting = 0;
+			V(&r->wake);
+		}
+	}
+}
+
+/*
+ * wait_for - Sleep until the leader has news for r.
+ *            Called with f->mutex held, and returns with it held.
+ */
+static void wait_for(flight_t *f, flight_reader_t *r)
+{
+	r->waiting = 1;
+	V(&f->mutex);
+	P(&r->wake);
+	P(&f->mutex);
+}
+
+/*
+ * unlink_flight - Take f out of the hash table so that requests for its
+ *                 key start a new flight. Called with table_mutex held.
+ */
+static void unlink_flight(flight_t *f)
+{
+	flight_t **pp;
+
+	if (!f->linked){
+		return;
+	}
+	for (pp = &buckets[hash(f->key)]; *pp != f; pp = &(*pp)->next)
+		;
+	*pp = f->next;
+	f->linked = 0;
+}
+
+/*
+ * trim - Make room for need more body bytes by dropping bytes every
+ *        follower has taken. Followers that have not taken the bytes
+ *        that must go are cut off. Called with f->mutex held.
+ */
+static void trim(flight_t *f, size_t need)
+{
+	flight_reader_t *r;
+	long long min = f->base + f->len;
+	size_t drop;
+
+	for (r = f->readers; r; r = r->next){
+		if (!r->cut && r->pos < f->base + (long long)need){
+			r->cut = 1;
+			if (r->waiting){
+				r->waiting = 0;
+				V(&r->wake);
+			}
+		}
+		if (!r->cut && r->pos < min){
+			min = r->pos;
+		}
+	}
+	drop = min - f->base;
+	memmove(f->data, f->data + drop, f->len - drop);
+	f->len -= drop;
+	f->base = min;
+	f->joinable = 0;
+}
+
+/*
+ * flight_init - Initialize the table of flights. Call once before any
+ *               thread uses it.
+ */
+void flight_init(void)
+{
+	Sem_init(&table_mutex, 0, 1);
+}
+
+/*
+ * flight_join - Join the open flight for key as a follower reading
+ *               through r, or open one and become its leader (*leader
+ *               is set). Every call must be matched by flight_release,
+ *               and a leader must call flight_finish before that.
+ */
+flight_t *flight_join(const char *key, flight_reader_t *r, int *leader)
+{
+	unsigned int h = hash(key);
+	flight_t *f, *next;
+	int joined;
+
+	P(&table_mutex);
+	for (f = buckets[h]; f; f = next){
+		next = f->next;
+		if (strcmp(f->key, key)){
+			continue;
+		}
+		P(&f->mutex);
+		if ((joined = f->joinable)){
+			r->pos = 0;
+			r->waiting = 0;
+			r->cut = 0;
+			Sem_init(&r->wake, 0, 0);
+			r->next = f->readers;
+			f->readers = r;
+		}
+		V(&f->mutex);
+		if (joined){
+			f->refcnt++;
+			coalesced++;
+			V(&table_mutex);
+			*leader = 0;
+			return f;
+		}
+		// Too late to join; it must not stop a new flight either.
+		unlink_flight(f);
+	}
+	f = Malloc(sizeof(flight_t));
+	f->key = Malloc(strlen(key) + 1);
+	strcpy(f->key, key);
+	f->hdr = NULL;
+	f->hdr_size = 0;
+	f->length = -1;
+	f->data = NULL;
+	f->len = f->cap = 0;
+	f->base = 0;
+	f->joinable = 1;
+	f->done = f->complete = 0;
+	f->readers = NULL;
+	Sem_init(&f->mutex, 0, 1);
+	f->refcnt = 1;
+	f->linked = 1;
+	f->next = buckets[h];
+	buckets[h] = f;
+	V(&table_mutex);
+	*leader = 1;
+	return f;
+}
+
+/*
+ * flight_header - Leader: the response has size bytes of status line and
+ *                 headers, without framing or Connection headers, and a
+ *                 body of length bytes (-1 if not known).
+ */
+void flight_header(flight_t *f, const char *hdr, size_t size, long long length)
+{
+	P(&f->mutex);
+	f->hdr = Malloc(size);
+	memcpy(f->hdr, hdr, size);
+	f->hdr_size = size;
+	f->length = length;
+	wake_all(f);
+	V(&f->mutex);
+}
+
+/*
+ * flight_body - Leader: n more body bytes arrived.
+ */
+void flight_body(flight_t *f, const char *data, size_t n)
+{
+	P(&f->mutex);
+	if (f->len + n > FLIGHT_BUFFER){
+		trim(f, f->len + n - FLIGHT_BUFFER);
+	}
+	if (f->len + n > f->cap){
+		f->cap = f->cap ? 2 * f->cap : FLIGHT_BLOCK;
+		while (f->cap < f->len + n){
+			f->cap *= 2;
+		}
+		if (f->cap > FLIGHT_BUFFER){
+			f->cap = FLIGHT_BUFFER;
+		}
+		f->data = Realloc(f->data, f->cap);
+	}
+	memcpy(f->data + f->len, data, n);
+	f->len += n;
+	wake_all(f);
+	V(&f->mutex);
+}
+
+/*
+ * flight_leave - Leader: close the flight if nobody follows it, so the
+ *                body need not pass through it. Returns 1 if it did;
+ *                the leader then only has to release it.
+ */
+int flight_leave(flight_t *f)
+{
+	int left;
+
+	P(&f->mutex);
+	if ((left = (f->readers == NULL))){
+		f->joinable = 0;
+		f->done = 1;
+	}
+	V(&f->mutex);
+	return left;
+}
+
+/*
+ * flight_finish - Leader: the fetch is over. complete tells whether the
+ *                 whole response arrived. Calls after the first one do
+ *                 nothing.
+ */
+void flight_finish(flight_t *f, int complete)
+{
+	P(&table_mutex);
+	unlink_flight(f);
+	V(&table_mutex);
+	P(&f->mutex);
+	if (!f->done){
+		f->joinable = 0;
+		f->done = 1;
+		f->complete = complete;
+		wake_all(f);
+	}
+	V(&f->mutex);
+}
+
+/*
+ * flight_follow - Follower: send the leader's response to fd as it
+ *                 arrives, framed for this client: with Content-Length
+ *                 if the length is known, chunked to HTTP/1.1 clients
+ *                 otherwise, and ended by closing the connection for the
+ *                 rest. Clears *keep_client if the connection must close.
+ *                 Sets *status to the status code.
+ *                 Returns the number of bytes sent, or -1 if the leader
+ *                 got no response and the caller must fetch it itself.
+ */
+long long flight_follow(flight_t *f, flight_reader_t *r, int fd, int http11, int *keep_client, int *status)
+{
+	char line[MAXLINE];
+	char *block;
+	long long sent = -1, length;
+	size_t n;
+	int chunked = 0, complete = 0;
+
+	P(&f->mutex);
+	while (f->hdr == NULL && !f->done){
+		wait_for(f, r);
+	}
+	length = f->length;
+	V(&f->mutex);
+	if (f->hdr == NULL){
+		return -1;
+	}
+	// The header never changes once it is set.
+	*status = 0;
+	sscanf(f->hdr, "%*s %d", status);
+	if (length >= 0){
+		sprintf(line, "Content-Length: %lld\r\n", length);
+	}else if (http11){
+		strcpy(line, "Transfer-Encoding: chunked\r\n");
+		chunked = 1;
+	}else{
+		line[0] = '\0';
+		*keep_client = 0;
+	}
+	strcat(line, *keep_client ? "X-Cache: MISS\r\nConnection: keep-alive\r\n\r\n" :
+		     "X-Cache: MISS\r\nConnection: close\r\n\r\n");
+	sent = 0;
+	if (rio_writen(fd, f->hdr, f->hdr_size) < 0 || rio_writen(fd, line, strlen(line)) < 0){
+		*keep_client = 0;
+		return sent;
+	}
+	sent = f->hdr_size + strlen(line);
+
+	block = buf_alloc(FLIGHT_BLOCK);
+	while (1){
+		P(&f->mutex);
+		while (r->pos == f->base + (long long)f->len && !f->done && !r->cut){
+			wait_for(f, r);
+		}
+		if (r->cut){
+			V(&f->mutex);
+			break;
+		}
+		if (r->pos == f->base + (long long)f->len){
+			complete = f->complete;
+			V(&f->mutex);
+			if (complete && chunked){
+				complete = rio_writen(fd, "0\r\n\r\n", 5) >= 0;
+				sent += 5;
+			}
+			break;
+		}
+		// Copy out under the lock, since trim moves the bytes.
+		n = f->base + f->len - r->pos;
+		if (n > FLIGHT_BLOCK){
+			n = FLIGHT_BLOCK;
+		}
+		memcpy(block, f->data + (r->pos - f->base), n);
+		r->pos += n;
+		V(&f->mutex);
+		if (chunked){
+			sprintf(line, "%zx\r\n", n);
+			if (rio_writen(fd, line, strlen(line)) < 0 || rio_writen(fd, block, n) < 0 ||
+			    rio_writen(fd, "\r\n", 2) < 0){
+				break;
+			}
+			sent += strlen(line) + 2;
+		}else if (rio_writen(fd, block, n) < 0){
+			break;
+		}
+		sent += n;
+	}
+	buf_free(block, FLIGHT_BLOCK);
+	if (!complete){
+		// The client cannot tell where this response ends.
+		*keep_client = 0;
+	}
+	return sent;
+}
+
+/*
+ * flight_release - Drop the reference of a follower (r) or of the
+ *                  leader (r is NULL). The last one frees the flight.
+ */
+void flight_release(flight_t *f, flight_reader_t *r)
+{
+	flight_reader_t **pp;
+	int last;
+
+	if (r != NULL){
+		P(&f->mutex);
+		for (pp = &f->readers; *pp != r; pp = &(*pp)->next)
+			;
+		*pp = r->next;
+		V(&f->mutex);
+		sem_destroy(&r->wake);
+	}
+	P(&table_mutex);
+	last = --f->refcnt == 0;
+	V(&table_mutex);
+	if (last){
+		sem_destroy(&f->mutex);
+		Free(f->key);
+		if (f->hdr != NULL){
+			Free(f->hdr);
+		}
+		if (f->data != NULL){
+			Free(f->data);
+		}
+		Free(f);
+	}
+}
+
+/*
+ * flight_coalesced - Number of requests that followed another's fetch.
+ */
+unsigned long flight_coalesced(void)
+{
+	return coalesced;
+}
@@ -0,0 +1,31 @@
+/*
+ * flight.h - Coalescing of concurrent fetches of the same object
+ */
+#ifndef __FLIGHT_H__
+#define __FLIGHT_H__
+
+#include <stddef.h>
+#include <semaphore.h>
+
+typedef struct flight flight_t;
+
+/* A request waiting on another's fetch. Lives on the follower's stack. */
+typedef struct flight_reader {
+	long long pos;             /* body bytes taken so far */
+	int waiting;               /* blocked on wake */
+	int cut;                   /* fell too far behind and was dropped */
+	sem_t wake;
+	struct flight_reader *next;
+} flight_reader_t;
+
+void flight_init(void);
+flight_t *flight_join(const char *key, flight_reader_t *r, int *leader);
+void flight_header(flight_t *f, const char *hdr, size_t size, long long length);
+void flight_body(flight_t *f, const char *data, size_t n);
+int flight_leave(flight_t *f);
+void flight_finish(flight_t *f, int complete);
+long long flight_follow(flight_t *f, flight_reader_t *r, int fd, int http11, int *keep_client, int *status);
+void flight_release(flight_t *f, flight_reader_t *r);
+unsigned long flight_coalesced(void);
+
+#endif /* __FLIGHT_H__ */
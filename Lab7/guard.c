@@ -0,0 +1,187 @@
+/*
+ * guard.c - Timeouts and connection caps.
+ *           Every wait of the proxy on a client or a server is bounded by
+ *           one of the timeouts, so a peer that stalls costs a worker a
+ *           few seconds instead of forever. A request head in particular
+ *           must arrive whole within TIMEOUT_HEADER of its first byte,
+ *           however slowly it trickles in, so a client cannot hold a
+ *           connection by sending a header byte now and then (slowloris).
+ *           Clients are admitted against a cap on all connections and on
+ *           the connections from one IP address, counted in a hash table
+ *           of the addresses with connections open. A connection over a
+ *           cap gets a 503 and is closed at once.
+ */
+#include "csapp.h"
+#include <limits.h>
+#include <sys/resource.h>
+#include "stats.h"
+#include "guard.h"
+
+#define NBUCKETS 1024
+#define RESERVED_FDS 64            /* kept for logs, the disk cache and such */
+
+struct guard_client {
+	unsigned char ip[16];      /* an IPv4 address in the first 4 bytes */
+	int conns;                 /* connections open */
+	unsigned int bucket;
+	struct guard_client *next; /* hash chain */
+};
+
+int guard_timeouts[NTIMEOUTS] = {10, 5, 30, 30, 5};
+int guard_max_header = RIO_BUFSIZE;
+
+static char *timeout_names[NTIMEOUTS] = {"header", "idle", "read", "write", "connect"};
+static guard_client_t *buckets[NBUCKETS];
+static int max_conns, max_per_ip;  /* 0 for no cap */
+static int nconns;
+static sem_t mutex;                /* protects the table and nconns */
+
+static char refusal[] = "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+/*
+ * guard_init - Admit at most max_conns connections in all and max_per_ip
+ *              from one address, 0 meaning no cap. The open file limit is
+ *              raised as far as it goes, and max_conns lowered to what
+ *              fits in it, since a client connection may come with a
+ *              server connection. Call once before admitting anyone.
+ */
+void guard_init(int conns, int per_ip)
+{
+	struct rlimit rl;
+	int fit;
+
+	Sem_init(&mutex, 0, 1);
+	max_conns = conns;
+	max_per_ip = per_ip;
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0){
+		return;
+	}
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < INT_MAX){
+		fit = ((int)rl.rlim_cur - RESERVED_FDS) / 2;
+		if (max_conns == 0 || max_conns > fit){
+			max_conns = fit > 1 ? fit : 1;
+		}
+	}
+}
+
+/*
+ * guard_timeout_parse - Set a timeout from "<name>=<seconds>", where name
+ *                       is header, idle, read, write or connect.
+ *                       Returns -1 if arg is not one.
+ */
+int guard_timeout_parse(char *arg)
+{
+	char *eq = strchr(arg, '='), *end;
+	long secs;
+	int i;
+
+	if (eq == NULL){
+		return -1;
+	}
+	for (i = 0; i < NTIMEOUTS; i++){
+		if (strlen(timeout_names[i]) == eq - arg && !strncmp(arg, timeout_names[i], eq - arg)){
+			break;
+		}
+	}
+	secs = strtol(eq + 1, &end, 10);
+	if (i == NTIMEOUTS || end == eq + 1 || *end != '\0' || secs < 0 || secs > 86400){
+		return -1;
+	}
+	guard_timeouts[i] = secs;
+	return 0;
+}
+
+/*
+ * guard_ms - A timeout in milliseconds, or 0 if it is off.
+ */
+double guard_ms(int timeout)
+{
+	return guard_timeouts[timeout] * 1000.0;
+}
+
+/*
+ * guard_socket - Bound the blocking reads on fd by the read timeout and
+ *                its writes by the write timeout.
+ */
+void guard_socket(int fd)
+{
+	struct timeval rcv = {guard_timeouts[TIMEOUT_READ], 0};
+	struct timeval snd = {guard_timeouts[TIMEOUT_WRITE], 0};
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rcv, sizeof(rcv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &snd, sizeof(snd));
+}
+
+/*
+ * guard_admit - Count a new connection from addr, unless that would go
+ *               over a cap. Returns what to pass to guard_leave when the
+ *               connection closes, or NULL if it must be refused.
+ */
+guard_client_t *guard_admit(struct sockaddr_storage *addr)
+{
+	unsigned char ip[16] = {0};
+	unsigned int h = 2166136261u;
+	guard_client_t *c;
+	int i;
+
+	if (addr->ss_family == AF_INET){
+		memcpy(ip, &((struct sockaddr_in *)addr)->sin_addr, 4);
+	}else if (addr->ss_family == AF_INET6){
+		memcpy(ip, &((struct sockaddr_in6 *)addr)->sin6_addr, 16);
+	}
+	// FNV-1a
+	for (i = 0; i < 16; i++){
+		h = (h ^ ip[i]) * 16777619u;
+	}
+	h %= NBUCKETS;
+	P(&mutex);
+	for (c = buckets[h]; c != NULL && memcmp(c->ip, ip, 16); c = c->next)
+		;
+	if ((max_conns > 0 && nconns >= max_conns) || (c != NULL && max_per_ip > 0 && c->conns >= max_per_ip)){
+		V(&mutex);
+		return NULL;
+	}
+	if (c == NULL){
+		c = Malloc(sizeof(guard_client_t));
+		memcpy(c->ip, ip, 16);
+		c->conns = 0;
+		c->bucket = h;
+		c->next = buckets[h];
+		buckets[h] = c;
+	}
+	c->conns++;
+	nconns++;
+	V(&mutex);
+	return c;
+}
+
+/*
+ * guard_leave - A connection admitted as client has closed.
+ */
+void guard_leave(guard_client_t *client)
+{
+	guard_client_t **pp;
+
+	P(&mutex);
+	nconns--;
+	if (--client->conns == 0){
+		for (pp = &buckets[client->bucket]; *pp != client; pp = &(*pp)->next)
+			;
+		*pp = client->next;
+		Free(client);
+	}
+	V(&mutex);
+}
+
+/*
+ * guard_refuse - Answer a connection guard_admit refused with a 503, if
+ *                the socket takes it right away, and close it.
+ */
+void guard_refuse(int fd)
+{
+	send(fd, refusal, strlen(refusal), MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(fd);
+	stats_add(STAT_REFUSED, 1);
+}
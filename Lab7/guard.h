@@ -0,0 +1,31 @@
+/*
+ * guard.h - Timeouts and connection caps that keep slow or greedy
+ *           clients from tying up the proxy
+ */
+#ifndef __GUARD_H__
+#define __GUARD_H__
+
+#include <sys/socket.h>
+
+/* Timeouts, in seconds; 0 turns one off */
+#define TIMEOUT_HEADER 0           /* first byte of a request head until its end */
+#define TIMEOUT_IDLE 1             /* waiting for a request to start */
+#define TIMEOUT_READ 2             /* without a byte of a request body or a response */
+#define TIMEOUT_WRITE 3            /* without a byte taken by a client or server */
+#define TIMEOUT_CONNECT 4          /* connecting to a server */
+#define NTIMEOUTS 5
+
+typedef struct guard_client guard_client_t;
+
+extern int guard_timeouts[NTIMEOUTS];
+extern int guard_max_header;       /* longest request head, in bytes */
+
+void guard_init(int max_conns, int max_per_ip);
+int guard_timeout_parse(char *arg);
+double guard_ms(int timeout);
+void guard_socket(int fd);
+guard_client_t *guard_admit(struct sockaddr_storage *addr);
+void guard_leave(guard_client_t *client);
+void guard_refuse(int fd);
+
+#endif /* __GUARD_H__ */
@@ -0,0 +1,369 @@
+/*
+ * httpparse.c - Incremental parser of HTTP/1.x request heads.
+ *               It works on the request where it sits in the caller's
+ *               read buffer and copies nothing: the method, the uri and
+ *               its parts, and every header come back as slices of that
+ *               buffer. A head split across reads is parsed as far as its
+ *               complete lines go, and the next call resumes at the first
+ *               incomplete one, so no line is scanned twice. The caller
+ *               may move the bytes between calls, to make room for another
+ *               read, and the slices found so far follow them.
+ *               Requests are checked strictly: the method and header names
+ *               must be tokens, the uri and header values must not hold
+ *               control characters, and folded header lines are refused,
+ *               so that what the proxy forwards means the same to the
+ *               server as it did to the proxy.
+ */
+#include <string.h>
+#include <strings.h>
+#include "httpparse.h"
+
+enum { REQUEST_LINE, HEADER_LINE, DONE };
+
+/* Characters that may appear in a token (RFC 7230 tchar) */
+static const char tchar[256] = {
+	['0' ... '9'] = 1, ['A' ... 'Z'] = 1, ['a' ... 'z'] = 1,
+	['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1,
+	['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1
+};
+
+/* Masks for looking at the bytes of a word at once */
+#define ONES 0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+/* Path of an absolute uri that has none */
+static char root[] = "/";
+
+/*
+ * is_ctl - Check if c is a control character other than tab.
+ */
+static int is_ctl(unsigned char c)
+{
+	return (c < 0x20 && c != '\t') || c == 0x7f;
+}
+
+/*
+ * has_ctl - Check if the bytes from p to e hold a control character other
+ *           than tab. Header values are most of a head, so they are
+ *           checked a word at a time: the high bit of a byte of
+ *           (x - 0x20) & ~x is set if the byte is below 0x20, and of
+ *           (y - 1) & ~y, with y = x ^ 0x7f, if it is 0x7f. Only words
+ *           where that finds something, usually a tab, are looked at
+ *           byte by byte.
+ */
+static int has_ctl(const char *p, const char *e)
+{
+	unsigned long long x, y;
+	int i;
+
+	for (; e - p >= 8; p += 8){
+		memcpy(&x, p, 8);
+		y = x ^ (0x7f * ONES);
+		if ((((x - 0x20 * ONES) & ~x) | ((y - ONES) & ~y)) & HIGHS){
+			for (i = 0; i < 8; i++){
+				if (is_ctl(p[i])){
+					return 1;
+				}
+			}
+		}
+	}
+	for (; p < e; p++){
+		if (is_ctl(*p)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * split_uri - Find the host, port and path of an absolute uri
+ *             (http://host[:port][/path]), or take an origin-form uri
+ *             ("/path") as the path. Other forms are left for the caller
+ *             to refuse. Returns -1 if an absolute uri has no host.
+ */
+static int split_uri(http_req_t *req)
+{
+	char *p = req->uri.p, *end = req->uri.p + req->uri.len, *slash, *colon;
+
+	if (*p == '/'){
+		req->path = req->uri;
+		return 0;
+	}
+	if (req->uri.len < 7 || strncasecmp(p, "http://", 7)){
+		return 0;
+	}
+	p += 7;
+	if ((slash = memchr(p, '/', end - p)) == NULL){
+		slash = end;
+		req->path.p = root;
+		req->path.len = 1;
+	}else{
+		req->path.p = slash;
+		req->path.len = end - slash;
+	}
+	// An IPv6 literal is in brackets, and has colons of its own.
+	colon = p;
+	if (*p == '['){
+		if ((colon = memchr(p, ']', slash - p)) == NULL){
+			return -1;
+		}
+		req->host.p = p + 1;
+		req->host.len = colon - p - 1;
+		colon++;
+	}
+	if ((colon = memchr(colon, ':', slash - colon)) != NULL){
+		req->port.p = colon + 1;
+		req->port.len = slash - colon - 1;
+	}else{
+		colon = slash;
+	}
+	if (*p != '['){
+		req->host.p = p;
+		req->host.len = colon - p;
+	}
+	return req->host.len > 0 ? 0 : -1;
+}
+
+/*
+ * request_line - Parse the request line at s, which ends at e.
+ *                Returns -1 if it is not valid.
+ */
+static int request_line(http_req_t *req, char *s, char *e)
+{
+	char *p;
+
+	for (p = s; p < e && tchar[(unsigned char)*p]; p++)
+		;
+	if (p == s || p == e || *p != ' '){
+		return -1;
+	}
+	req->method.p = s;
+	req->method.len = p - s;
+	s = ++p;
+	if ((p = memchr(s, ' ', e - s)) == NULL || has_ctl(s, p) || memchr(s, '\t', p - s) != NULL){
+		return -1;
+	}
+	if (p == s || e - p != 9 || strncmp(p, " HTTP/1.", 8) || p[8] < '0' || p[8] > '9'){
+		return -1;
+	}
+	req->uri.p = s;
+	req->uri.len = p - s;
+	req->minor = p[8] - '0';
+	// The spaces after the method and the uri become NULs, so they and
+	// the path, which ends the uri, are also strings.
+	req->method.p[req->method.len] = '\0';
+	req->uri.p[req->uri.len] = '\0';
+	return split_uri(req);
+}
+
+/*
+ * header_line - Parse the header line at s, which ends at e.
+ *               Returns 1 if it is the blank line that ends the head,
+ *               0 for a header, and HTTP_BAD or HTTP_TOO_LARGE.
+ */
+static int header_line(http_req_t *req, char *s, char *e)
+{
+	http_header_t *h;
+	char *p;
+
+	if (s == e){
+		return 1;
+	}
+	for (p = s; p < e && tchar[(unsigned char)*p]; p++)
+		;
+	// No space before the colon, and no folded continuation lines.
+	if (p == s || p == e || *p != ':'){
+		return HTTP_BAD;
+	}
+	if (req->nheaders == HTTP_MAX_HEADERS){
+		return HTTP_TOO_LARGE;
+	}
+	h = &req->headers[req->nheaders++];
+	h->name.p = s;
+	h->name.len = p - s;
+	for (p++; p < e && (*p == ' ' || *p == '\t'); p++)
+		;
+	for (; e > p && (e[-1] == ' ' || e[-1] == '\t'); e--)
+		;
+	h->value.p = p;
+	h->value.len = e - p;
+	return has_ctl(p, e) ? HTTP_BAD : 0;
+}
+
+/*
+ * http_parse_init - Get req ready to parse a new request.
+ */
+void http_parse_init(http_req_t *req)
+{
+	memset(req, 0, offsetof(http_req_t, headers));
+	req->nheaders = 0;
+	req->base = NULL;
+	req->pos = 0;
+	req->state = REQUEST_LINE;
+}
+
+/*
+ * http_parse - Parse the len bytes of buf, which hold the start of a
+ *              request and whatever of it the previous calls saw, at the
+ *              same place or moved. A head longer than max bytes is refused.
+ *              Returns the length of the head once it is complete,
+ *              HTTP_INCOMPLETE if more bytes are needed, or HTTP_BAD or
+ *              HTTP_TOO_LARGE.
+ */
+long http_parse(http_req_t *req, char *buf, size_t len, size_t max)
+{
+	char *s, *e, *nl;
+	int rc;
+
+	if (req->base != buf){
+		http_rebase(req, buf);
+	}
+	while (req->state != DONE && (nl = memchr(buf + req->pos, '\n', len - req->pos)) != NULL){
+		if (nl + 1 - buf > max){
+			return HTTP_TOO_LARGE;
+		}
+		// Lines may end with a bare LF.
+		s = buf + req->pos;
+		e = nl > s && nl[-1] == '\r' ? nl - 1 : nl;
+		req->pos = nl + 1 - buf;
+		if (req->state == REQUEST_LINE){
+			// Blank lines before the request line are skipped.
+			if (s != e){
+				if (request_line(req, s, e) < 0){
+					return HTTP_BAD;
+				}
+				req->state = HEADER_LINE;
+			}
+		}else if ((rc = header_line(req, s, e)) < 0){
+			return rc;
+		}else if (rc == 1){
+			req->state = DONE;
+		}
+	}
+	if (req->state == DONE){
+		return req->pos;
+	}
+	return len >= max ? HTTP_TOO_LARGE : HTTP_INCOMPLETE;
+}
+
+/*
+ * shift - Move slice s along with the bytes it is in, if it is in the
+ *         parsed part of the buffer at old.
+ */
+static void shift(http_slice_t *s, char *old, size_t size, char *new)
+{
+	if (s->p >= old && s->p < old + size){
+		s->p = new + (s->p - old);
+	}
+}
+
+/*
+ * http_rebase - The bytes req was parsed from now start at buf; make its
+ *               slices point there. Used to keep a parsed head after the
+ *               read buffer it was parsed in is reused.
+ */
+void http_rebase(http_req_t *req, char *buf)
+{
+	char *old = req->base;
+	int i;
+
+	if (old != NULL){
+		shift(&req->method, old, req->pos, buf);
+		shift(&req->uri, old, req->pos, buf);
+		shift(&req->host, old, req->pos, buf);
+		shift(&req->port, old, req->pos, buf);
+		shift(&req->path, old, req->pos, buf);
+		for (i = 0; i < req->nheaders; i++){
+			shift(&req->headers[i].name, old, req->pos, buf);
+			shift(&req->headers[i].value, old, req->pos, buf);
+		}
+	}
+	req->base = buf;
+}
+
+/*
+ * http_find_header - The value of the first header called name, or NULL.
+ */
+http_slice_t *http_find_header(http_req_t *req, const char *name)
+{
+	int i;
+
+	for (i = 0; i < req->nheaders; i++){
+		if (http_slice_eq(&req->headers[i].name, name)){
+			return &req->headers[i].value;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * http_slice_eq - Check if s is str, ignoring case.
+ */
+int http_slice_eq(http_slice_t *s, const char *str)
+{
+	return strlen(str) == s->len && !strncasecmp(s->p, str, s->len);
+}
+
+/*
+ * http_has_token - Check if the comma-separated list s has token,
+ *                  ignoring case and any parameters.
+ */
+int http_has_token(http_slice_t *s, const char *token)
+{
+	char *p = s->p, *end = s->p + s->len, *q;
+	size_t len = strlen(token);
+
+	while (p < end){
+		for (; p < end && (*p == ' ' || *p == '\t' || *p == ','); p++)
+			;
+		for (q = p; q < end && *q != ',' && *q != ';' && *q != ' ' && *q != '\t'; q++)
+			;
+		if (q - p == len && !strncasecmp(p, token, len)){
+			return 1;
+		}
+		for (p = q; p < end && *p != ','; p++)
+			;
+	}
+	return 0;
+}
+
+/*
+ * http_last_token - Check if the last item of the comma-separated list s
+ *                   is token, ignoring case and any parameters.
+ */
+int http_last_token(http_slice_t *s, const char *token)
+{
+	char *p = s->p + s->len, *q;
+	size_t len = strlen(token);
+
+	// Find the start of the last item that is not empty.
+	for (; p > s->p && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == ','); p--)
+		;
+	for (q = p; q > s->p && q[-1] != ','; q--)
+		;
+	for (; q < p && (*q == ' ' || *q == '\t'); q++)
+		;
+	for (p = q; p < s->p + s->len && *p != ',' && *p != ';' && *p != ' ' && *p != '\t'; p++)
+		;
+	return p - q == len && !strncasecmp(q, token, len);
+}
+
+/*
+ * http_number - The decimal number s, or -1 if s is not one.
+ */
+long long http_number(http_slice_t *s)
+{
+	long long n = 0;
+	size_t i;
+
+	if (s->len == 0 || s->len > 18){
+		return -1;
+	}
+	for (i = 0; i < s->len; i++){
+		if (s->p[i] < '0' || s->p[i] > '9'){
+			return -1;
+		}
+		n = n * 10 + s->p[i] - '0';
+	}
+	return n;
+}
@@ -0,0 +1,51 @@
+/*
+ * httpparse.h - Incremental parser of HTTP/1.x request heads
+ */
+#ifndef __HTTPPARSE_H__
+#define __HTTPPARSE_H__
+
+#include <stddef.h>
+
+#define HTTP_MAX_HEADERS 64
+
+/* Results of http_parse besides the length of a complete head */
+#define HTTP_INCOMPLETE 0          /* the head does not end in the buffer yet */
+#define HTTP_BAD -1                /* not a valid request */
+#define HTTP_TOO_LARGE -2          /* the head or a header count is over a limit */
+
+/* Bytes of the buffer being parsed; not NUL terminated */
+typedef struct {
+	char *p;
+	size_t len;
+} http_slice_t;
+
+typedef struct {
+	http_slice_t name;
+	http_slice_t value;        /* without the surrounding spaces */
+} http_header_t;
+
+/* A parsed request head. method, uri and path are also NUL terminated. */
+typedef struct {
+	http_slice_t method;
+	http_slice_t uri;
+	int minor;                 /* HTTP/1.minor */
+	http_slice_t host;         /* from an absolute uri; empty in origin form */
+	http_slice_t port;         /* from an absolute uri; empty if not given */
+	http_slice_t path;         /* "/" if an absolute uri has none */
+	http_header_t headers[HTTP_MAX_HEADERS];
+	int nheaders;
+	char *base;                /* private: the buffer being parsed */
+	size_t pos;                /* private: where the next line starts */
+	int state;                 /* private: what that line is */
+} http_req_t;
+
+void http_parse_init(http_req_t *req);
+long http_parse(http_req_t *req, char *buf, size_t len, size_t max);
+void http_rebase(http_req_t *req, char *buf);
+http_slice_t *http_find_header(http_req_t *req, const char *name);
+int http_slice_eq(http_slice_t *s, const char *str);
+int http_has_token(http_slice_t *s, const char *token);
+int http_last_token(http_slice_t *s, const char *token);
+long long http_number(http_slice_t *s);
+
+#endif /* __HTTPPARSE_H__ */
@@ -0,0 +1,191 @@
+/*
+ * log.c - Asynchronous logging.
+ *         Every thread that logs gets its own ring of fixed-size lines.
+ *         Only that thread writes to the ring and only the log thread
+ *         reads from it, so a ring needs no lock: the writer publishes a
+ *         line by advancing head and the reader frees it by advancing
+ *         tail. The log thread writes the lines out and sleeps while all
+ *         rings are empty. A full ring drops the line instead of making
+ *         the request wait; log_dropped counts them.
+ *         Lines longer than LOG_LINE are cut short.
+ */
+#include "csapp.h"
+#include "log.h"
+
+#define LOG_SLOTS 256              /* lines per ring */
+#define LOG_LINE 512               /* bytes per line */
+#define LOG_IDLE_US 10000          /* log thread sleep when there is nothing */
+
+typedef struct log_ring {
+	char lines[LOG_SLOTS][LOG_LINE];
+	unsigned int head;         /* next slot to fill; written by the owner */
+	unsigned int tail;         /* next slot to print; written by the log thread */
+	struct log_ring *next;     /* list of all rings */
+} log_ring_t;
+
+int log_level = LOG_INFO;
+static FILE *log_out;
+static log_ring_t *rings;          /* never shrinks; threads live forever */
+static sem_t rings_mutex;          /* serializes adding rings */
+static unsigned long dropped;
+static __thread log_ring_t *my_ring;
+
+static void *log_thread(void *vargp);
+
+/*
+ * log_init - Start logging messages up to level to out.
+ *            Call once before any thread logs.
+ */
+void log_init(int level, FILE *out)
+{
+	pthread_t tid;
+
+	log_level = level;
+	log_out = out;
+	Sem_init(&rings_mutex, 0, 1);
+	Pthread_create(&tid, NULL, log_thread, NULL);
+}
+
+/*
+ * log_level_parse - Map "error", "info" or "debug" to its level.
+ *                   Returns -1 for anything else.
+ */
+int log_level_parse(char *name)
+{
+	if (!strcasecmp(name, "error")){
+		return LOG_ERROR;
+	}
+	if (!strcasecmp(name, "info")){
+		return LOG_INFO;
+	}
+	if (!strcasecmp(name, "debug")){
+		return LOG_DEBUG;
+	}
+	return -1;
+}
+
+/*
+ * ring_get - Return the ring of this thread, making it on first use.
+ */
+static log_ring_t *ring_get(void)
+{
+	log_ring_t *r;
+
+	if ((r = my_ring) != NULL){
+		return r;
+	}
+	r = Malloc(sizeof(log_ring_t));
+	r->head = r->tail = 0;
+	P(&rings_mutex);
+	r->next = rings;
+	__atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+	V(&rings_mutex);
+	my_ring = r;
+	return r;
+}
+
+/*
+ * log_msg - Log a printf-style message at level, prefixed with the time
+ *           in seconds since the epoch. Never blocks.
+ */
+void log_msg(int level, const char *fmt, ...)
+{
+	log_ring_t *r;
+	unsigned int head;
+	struct timespec ts;
+	char *line;
+	va_list ap;
+	int n;
+
+	if (level > log_level){
+		return;
+	}
+	r = ring_get();
+	head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == LOG_SLOTS){
+		__sync_fetch_and_add(&dropped, 1);
+		return;
+	}
+	line = r->lines[head % LOG_SLOTS];
+	clock_gettime(CLOCK_REALTIME, &ts);
+	n = snprintf(line, LOG_LINE, "%ld.%03ld ", (long)ts.tv_sec, ts.tv_nsec / 1000000);
+	va_start(ap, fmt);
+	vsnprintf(line + n, LOG_LINE - n, fmt, ap);
+	va_end(ap);
+	// Every line ends with exactly one newline.
+	n = strlen(line);
+	while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')){
+		n--;
+	}
+	if (n > LOG_LINE - 2){
+		n = LOG_LINE - 2;
+	}
+	line[n] = '\n';
+	line[n + 1] = '\0';
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * log_dropped - Number of lines dropped because a ring was full.
+ */
+unsigned long log_dropped(void)
+{
+	return dropped;
+}
+
+/*
+ * log_flush - Wait until the log thread has written out every line logged
+ *             so far, as before the process exits.
+ */
+void log_flush(void)
+{
+	log_ring_t *r;
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next){
+		while (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) != __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)){
+			usleep(LOG_IDLE_US);
+		}
+	}
+	fflush(log_out);
+}
+
+/*
+ * log_ms - Milliseconds on the monotonic clock, for timing what gets
+ *          logged.
+ */
+double log_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/*
+ * log_thread - Print the lines of every ring, oldest first per ring.
+ */
+static void *log_thread(void *vargp)
+{
+	log_ring_t *r;
+	unsigned int head, tail;
+	int printed;
+
+	Pthread_detach(pthread_self());
+	while (1){
+		printed = 0;
+		for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next){
+			head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+			for (tail = r->tail; tail != head; tail++){
+				fputs(r->lines[tail % LOG_SLOTS], log_out);
+				printed++;
+			}
+			__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		}
+		if (printed){
+			fflush(log_out);
+		}else{
+			usleep(LOG_IDLE_US);
+		}
+	}
+	return NULL;
+}
@@ -0,0 +1,23 @@
+/*
+ * log.h - Asynchronous logging through per-thread rings
+ */
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdio.h>
+
+/* Log levels; a message is kept if its level is at most the log level */
+#define LOG_ERROR 0
+#define LOG_INFO  1        /* one access log line per request */
+#define LOG_DEBUG 2        /* request and response headers */
+
+void log_init(int level, FILE *out);
+int log_level_parse(char *name);
+void log_msg(int level, const char *fmt, ...);
+unsigned long log_dropped(void);
+void log_flush(void);
+double log_ms(void);
+
+extern int log_level;
+
+#endif /* __LOG_H__ */
@@ -0,0 +1,187 @@
+/*
+ * parsebench.c - Measure how many request heads per second the proxy can
+ *                parse.
+ *
+ * Parses a typical browser request over and over, in memory, three ways:
+ *   lines     The way the proxy used to: copy each line out of the read
+ *             buffer a byte at a time (as rio_readlineb does), sscanf the
+ *             request line into three strings, split the uri with
+ *             strchr/strcpy, and check every header with strncasecmp.
+ *   http      httpparse.c on the whole head at once.
+ *   split     httpparse.c with the head arriving in pieces of -s bytes,
+ *             as over a slow connection, parsing again after each one.
+ *
+ * usage: parsebench [-n requests] [-s piece size]
+ */
+#include "csapp.h"
+#include "httpparse.h"
+
+static char request[] =
+	"GET http://www.example.com:8080/images/logo.png?size=large&v=3 HTTP/1.1\r\n"
+	"Host: www.example.com:8080\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+	"Accept: image/avif,image/webp,image/apng,image/*,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.9,ko;q=0.8\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Referer: http://www.example.com:8080/index.html\r\n"
+	"Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; lang=en\r\n"
+	"Cache-Control: no-cache\r\n"
+	"Pragma: no-cache\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n";
+
+/*
+ * now - Seconds on the monotonic clock.
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * read_line - Copy the line at *pos of buf into line a byte at a time,
+ *             like rio_readlineb. Returns its length, 0 at the end.
+ */
+static size_t read_line(char *buf, size_t len, size_t *pos, char *line)
+{
+	size_t n = 0;
+	char c;
+
+	while (*pos < len && n < MAXLINE - 1){
+		c = buf[(*pos)++];
+		line[n++] = c;
+		if (c == '\n'){
+			break;
+		}
+	}
+	line[n] = '\0';
+	return n;
+}
+
+/*
+ * parse_lines - Parse the head in buf the old way. Returns -1 if it is
+ *               not a request.
+ */
+static int parse_lines(char *buf, size_t len)
+{
+	char line[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+	char host[MAXLINE], port[MAXLINE], path[MAXLINE], vhost[MAXLINE];
+	char *p, *q, *r;
+	size_t pos = 0;
+	long long length = -1;
+	int keep_alive = 0, chunked = 0;
+
+	if (read_line(buf, len, &pos, line) == 0 || sscanf(line, "%s %s %s", method, uri, version) != 3 ||
+	    strncasecmp(uri, "http://", 7)){
+		return -1;
+	}
+	p = uri + 7;
+	if ((q = strchr(p, '/')) == NULL){
+		q = p + strlen(p);
+		strcpy(path, "/");
+	}else{
+		strcpy(path, q);
+	}
+	if ((r = memchr(p, ':', q - p)) == NULL){
+		r = q;
+		strcpy(port, "80");
+	}else{
+		strncpy(port, r + 1, q - r - 1);
+		port[q - r - 1] = '\0';
+	}
+	strncpy(host, p, r - p);
+	host[r - p] = '\0';
+	while (read_line(buf, len, &pos, line) > 0){
+		if (!strcmp(line, "\r\n") || !strcmp(line, "\n")){
+			return keep_alive + chunked + (int)length;
+		}
+		if (!strncasecmp(line, "Connection:", 11) || !strncasecmp(line, "Proxy-Connection:", 17)){
+			keep_alive = strstr(line, "keep-alive") != NULL;
+		}else if (!strncasecmp(line, "Content-Length:", 15)){
+			length = strtoll(line + 15, NULL, 10);
+		}else if (!strncasecmp(line, "Transfer-Encoding:", 18)){
+			chunked = strstr(line + 18, "chunked") != NULL;
+		}else if (!strncasecmp(line, "Host:", 5)){
+			sscanf(line + 5, " %[^ \t\r\n]", vhost);
+		}
+	}
+	return -1;
+}
+
+/*
+ * parse_http - Parse the head in buf with httpparse.c, piece bytes at a
+ *              time if piece is not 0. Returns -1 if it is not a request.
+ */
+static int parse_http(char *buf, size_t len, size_t piece)
+{
+	http_req_t req;
+	size_t have = piece ? 0 : len;
+	long rc;
+	int i, keep_alive = 0;
+
+	http_parse_init(&req);
+	while ((rc = http_parse(&req, buf, have, RIO_BUFSIZE)) == HTTP_INCOMPLETE){
+		if (have == len){
+			return -1;
+		}
+		have = have + piece < len ? have + piece : len;
+	}
+	if (rc < 0){
+		return -1;
+	}
+	for (i = 0; i < req.nheaders; i++){
+		if (http_slice_eq(&req.headers[i].name, "Connection")){
+			keep_alive = http_has_token(&req.headers[i].value, "keep-alive");
+		}
+	}
+	return keep_alive + (int)req.host.len;
+}
+
+int main(int argc, char **argv)
+{
+	char *name[] = {"lines", "http", "split"};
+	char buf[sizeof(request)];
+	long n = 1000000, i;
+	size_t len = strlen(request), piece = 64;
+	double start, secs;
+	int c, way;
+	volatile int sink = 0;
+
+	while ((c = getopt(argc, argv, "n:s:")) != -1){
+		switch (c){
+		case 'n':
+			n = atol(optarg);
+			break;
+		case 's':
+			piece = atol(optarg);
+			break;
+		default:
+			n = 0;
+			break;
+		}
+	}
+	if (n <= 0 || piece == 0){
+		fprintf(stderr, "usage: %s [-n requests] [-s piece size]\n", argv[0]);
+		exit(1);
+	}
+	printf("%zu byte request, %ld parses\n", len, n);
+	for (way = 0; way < 3; way++){
+		start = now();
+		for (i = 0; i < n; i++){
+			// httpparse.c writes NULs into the head, so every parse gets
+			// a fresh copy, as it would get fresh bytes from the socket.
+			memcpy(buf, request, len);
+			if (way == 0){
+				sink += parse_lines(buf, len);
+			}else{
+				sink += parse_http(buf, len, way == 2 ? piece : 0);
+			}
+		}
+		secs = now() - start;
+		printf("%-6s %12.0f requests/s %8.1f ns/request\n", name[way], n / secs, secs * 1e9 / n);
+	}
+	return 0;
+}
@@ -1,146 +1,1305 @@
 #include <stdio.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include "csapp.h"
+#include "cache.h"
+#include "sbuf.h"
+#include "event.h"
+#include "connpool.h"
+#include "relay.h"
+#include "bufpool.h"
+#include "log.h"
+#include "dnscache.h"
+#include "flight.h"
+#include "diskcache.h"
+#include "balancer.h"
+#include "stats.h"
+#include "httpparse.h"
+#include "guard.h"
+#include "proxy.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
-#define MAX_LINE 8192
+/* Default size of the worker pool and depth of the connection queue */
+#define NTHREADS 16
+#define SBUFSIZE 64
 
+/* Default idle timeout (seconds) and size of the server connection pool */
+#define POOL_IDLE_TIMEOUT 4
+#define POOL_MAX_IDLE 8
+
+/* Size of the blocks bodies are read in */
+#define BODY_BLOCK 65536
+
+/* Bodies at least this large that will not be cached are spliced */
+#define SPLICE_MIN_BODY 65536
+
+/* Default space for the disk cache tier, in megabytes */
+#define DISK_CACHE_MB 256
+
+/* Seconds a response stays fresh if Cache-Control does not say */
+#define DEFAULT_MAX_AGE 60
+
+/* Seconds a draining process waits for its connections to finish, and
+ * how often it looks (microseconds) */
+#define DRAIN_TIMEOUT 30
+#define DRAIN_POLL_US 100000
+
+/* Room for the response header of the statistics page */
+#define STATS_HEADER 256
+
+/* read_request: the head did not arrive within the header timeout */
+#define HEAD_TIMEOUT -3
+
+/* How often the main thread times out the connections waiting in it (ms),
+ * and how many events it takes per epoll_wait */
+#define WAIT_SWEEP_MS 1000
+#define WAIT_EVENTS 64
+
+/* What max_age finds in Cache-Control besides a number of seconds */
+#define AGE_NO_STORE -1            /* must not be cached */
+#define AGE_UNSET -2               /* no lifetime given */
+
+static sbuf_t sbuf; /* Shared buffer of connected descriptors */
+static unsigned long nrequests; /* Requests served by the worker threads */
+static double *queued;          /* When each descriptor was queued */
+static guard_client_t **clients; /* Who each descriptor was admitted as */
+static long max_fds;            /* Size of queued, clients and waits */
+
+/* A connection the main thread holds until its request head is whole */
+typedef struct {
+	int waiting;               /* in the main thread, not with a worker */
+	int started;               /* the head has begun to arrive */
+	double deadline;           /* 0 if no timeout applies */
+} wait_t;
+
+static wait_t *waits;           /* Indexed by descriptor; main thread only */
+static int wait_top;            /* Above every descriptor that has waited */
+static int wait_epfd;           /* What the main thread waits on */
+static int park_fds[2];         /* Workers send idle connections back here */
+static sem_t drain_sem;         /* Posted by SIGTERM */
+static volatile int draining;   /* No more connections are taken */
+
+/* Request headers about one connection, not the request, and those the
+ * proxy sets itself; none of them are forwarded */
+static char *hop_headers[] = {
+	"Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate", "Proxy-Authorization",
+	"TE", "Trailer", "Transfer-Encoding", "Upgrade", "Content-Length", "Expect", "Host", "User-Agent",
+	NULL
+};
+
+static char continue_resp[] = "HTTP/1.1 100 Continue\r\n\r\n";
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 
+/* What the access log tells about a response */
+typedef struct {
+	int status;                /* 0 if the client got no response */
+	long long bytes;           /* bytes sent to the client */
+	int not_modified;          /* a stale cached copy was revalidated */
+	double first_byte;         /* when the status line arrived, 0 if never */
+} resp_info_t;
+
 /* Function prototypes. */
-void routine(int connfd, char *client_hostname);
-int parse_uri(char *uri, char *parsed_uri, char *port);
-void http_request(char *server_request, char *method, char *uri, char *version);
-void http_header(char *host_name, char *header);
-void forward_response(rio_t *server_rp, char *buf, int fd);
-void sigchld_handler(int sig);
+static void wait_heads(int listenfd);
+static void accept_client(int listenfd);
+static void wait_head(int connfd);
+static void check_head(int connfd);
+static void sweep_waits(int all);
+void *thread(void *vargp);
+int routine(int connfd);
+int serve_request(rio_t *client_rp, int connfd);
+static long read_request(rio_t *rp, http_req_t *req, double *started);
+static int request_headers(http_req_t *req, int *keep_alive, long long *length, int *chunked, char *vhost);
+static void send_error(int fd, int status, char *reason);
+static long long relay_body(rio_t *rp, int fd, long long length, int chunked);
+static int copy_bytes(rio_t *rp, int *fd, char *buf, long long n);
+static char *forward_headers(char *dst, http_req_t *req, int drop_cond);
+static size_t appendf(char *buf, size_t size, size_t len, const char *fmt, ...);
+static int connection_lists(http_req_t *req, http_slice_t *name);
+static int personal(http_req_t *req);
+int forward_response(rio_t *server_rp, int fd, char *key, int head, int http11, int *keep_client,
+		     flight_t *flight, cache_obj_t *stale, resp_info_t *info);
+static int send_bytes(int fd, char *data, size_t n, char *object, size_t *object_size, long long *sent,
+		      flight_t *flight);
+static char *body_dst(char *block, char *object, size_t object_size, size_t n);
+static ssize_t read_block(rio_t *rp, char *buf, size_t n);
+static int framing_header(char *line);
+static void cache_response(char *key, char *hdr, size_t hdr_size, char *body, size_t body_size);
+static size_t header_end(char *data, size_t size);
+static long long send_cached(int fd, cache_obj_t *obj, int keep_alive);
+static long long send_disk(int fd, disk_obj_t *dobj, int keep_alive);
+static int header_value(char *hdr, size_t size, char *name, char *value, size_t max);
+static long max_age(char *hdr, size_t size);
+static time_t expiry(char *hdr, size_t size);
+static int conditional_headers(cache_obj_t *obj, char *cond);
+static char *find_word(char *s, char *word);
+static int has_word(char *s, char *word);
+static long long send_stats(int fd, int keep_alive);
+void sigusr1_handler(int sig);
+void sigterm_handler(int sig);
+static void *drainer(void *vargp);
 
 /*
  * main - Main function of proxy server.
  *        Get listening port from stdin and create listenfd.
  *        Intermediation is made by calling routine function.
- *        Concurrency is based on multiple processes formed by Fork().
+ *        Concurrency is based on a pool of prethreaded workers that
+ *        share one cache. The main thread puts connected descriptors
+ *        into a bounded buffer and the workers take them out, but only
+ *        once a request head has arrived whole (see wait_heads), so
+ *        that slow clients cannot hold the workers.
+ *        When the buffer is full the main thread blocks and stops
+ *        accepting, so overload backs up into the listen queue
+ *        instead of creating more threads.
+ *        With -e the connections are served by epoll reactors
+ *        instead (see event.c).
+ *        Workers keep connections to servers open between requests
+ *        and share them through a pool (see connpool.c); -k sets how
+ *        long an idle one is kept, and -k 0 turns the pool off.
+ *        Messages go to an asynchronous log (see log.c): -l sets the
+ *        level (error, info or debug) and -L names a file to append
+ *        to instead of stdout.
+ *        -c picks the cache policy: tinylfu (the default) or clock.
+ *        -d names a directory where objects evicted from memory are
+ *        kept (see diskcache.c), and survive restarts; -D sets how many
+ *        megabytes it may use.
+ *        -b names a file of backend pools for virtual hosts (see
+ *        balancer.c), for running as a reverse proxy; requests for those
+ *        hosts go to a backend of their pool instead of the host itself.
+ *        Only the worker threads use the pools.
+ *        A request for STATS_URI gets the counters and the latency
+ *        percentiles of each stage of serving requests (see stats.c),
+ *        in a format scrapers understand.
+ *        -w runs that many worker processes instead of one, or one per
+ *        CPU with -w 0, each pinned to its CPU with a SO_REUSEPORT
+ *        listening socket of its own, under a supervisor process that
+ *        restarts them and replaces them all on SIGHUP (see supervise
+ *        in csapp.c). Workers share nothing, the caches included.
+ *        SIGTERM drains the process (see drainer).
+ *        Slow and greedy clients are kept in check (see guard.c): -T sets
+ *        a timeout, as in -T header=10 (also idle, read, write and
+ *        connect), -m caps the connections open at once and -p those
+ *        from one address, and -H limits the size of a request head.
  */
 int main(int argc, char **argv)
 {
-        int listenfd, connfd;
-        socklen_t clientlen;
-        struct sockaddr_storage clientaddr;
-        char client_hostname[MAX_LINE], client_port[MAXLINE];
-	
-	// Terminated child processes will be reaped by sigchld_handler.
-	Signal(SIGCHLD, sigchld_handler);
-        listenfd = Open_listenfd(argv[1]);
-	printf("listening on port %s\n", argv[1]);
-        while (1){
-                clientlen = sizeof(struct sockaddr_storage);
-                connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-                Getnameinfo((SA *)&clientaddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE, 0);
-                printf("Connected to (%s, %s)\n", client_hostname, client_port);
-		// Child process work as intermediary server.
-		if (Fork() == 0){
-			Close(listenfd);
-			routine(connfd, client_hostname);
-			Close(connfd);
-			exit(0);
-                }
-		// Parent process just listen for the next client.
-		// Close connfd to prevent memory leak.
-		Close(connfd);
-        }
+        int listenfd;
+	pthread_t tid;
+	int nthreads = NTHREADS;
+	int sbufsize = SBUFSIZE;
+	int nreactors = 0;
+	int idle_timeout = POOL_IDLE_TIMEOUT;
+	int level = LOG_INFO;
+	int policy = CACHE_TINYLFU;
+	FILE *log_out = stdout;
+	char *disk_dir = NULL;
+	char *pools = NULL;
+	long disk_mb = DISK_CACHE_MB;
+	int nworkers = -1, worker = -1;
+	int max_conns = 0, max_per_ip = 0;
+	int i, c;
+
+	while ((c = getopt(argc, argv, "t:q:e:k:l:L:c:d:D:b:w:T:m:p:H:")) != -1){
+		switch (c){
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 'q':
+			sbufsize = atoi(optarg);
+			break;
+		case 'e':
+			nreactors = atoi(optarg);
+			if (nreactors <= 0){
+				nthreads = 0;
+			}
+			break;
+		case 'k':
+			idle_timeout = atoi(optarg);
+			break;
+		case 'l':
+			if ((level = log_level_parse(optarg)) < 0){
+				nthreads = 0;
+			}
+			break;
+		case 'c':
+			if ((policy = cache_policy_parse(optarg)) < 0){
+				nthreads = 0;
+			}
+			break;
+		case 'd':
+			disk_dir = optarg;
+			break;
+		case 'b':
+			pools = optarg;
+			break;
+		case 'D':
+			if ((disk_mb = atol(optarg)) <= 0){
+				nthreads = 0;
+			}
+			break;
+		case 'w':
+			if ((nworkers = atoi(optarg)) < 0){
+				nthreads = 0;
+			}
+			break;
+		case 'T':
+			if (guard_timeout_parse(optarg) < 0){
+				nthreads = 0;
+			}
+			break;
+		case 'm':
+			if ((max_conns = atoi(optarg)) < 0){
+				nthreads = 0;
+			}
+			break;
+		case 'p':
+			if ((max_per_ip = atoi(optarg)) < 0){
+				nthreads = 0;
+			}
+			break;
+		case 'H':
+			guard_max_header = atoi(optarg);
+			if (guard_max_header < 64 || guard_max_header > RIO_BUFSIZE){
+				nthreads = 0;
+			}
+			break;
+		case 'L':
+			if ((log_out = fopen(optarg, "a")) == NULL){
+				unix_error("cannot open log file");
+			}
+			break;
+		default:
+			nthreads = 0;
+			break;
+		}
+	}
+	// Worker processes would share the disk cache directory, and a worker
+	// replaced on SIGHUP would use it while the old one drains.
+	if (optind != argc - 1 || nthreads <= 0 || sbufsize <= 0 || idle_timeout < 0 ||
+	    (nworkers >= 0 && disk_dir != NULL)){
+		fprintf(stderr, "usage: %s [-t threads] [-q queue depth] [-e reactors] [-k idle timeout]"
+			" [-l error|info|debug] [-L log file] [-c tinylfu|clock] [-d disk cache dir] [-D megabytes]"
+			" [-b backend pools] [-w worker processes] [-T header|idle|read|write|connect=seconds]"
+			" [-m max connections] [-p max connections per address] [-H max header bytes] <port>\n"
+			"       (-d and -w cannot be used together; -H is at most %d)\n", argv[0], RIO_BUFSIZE);
+		exit(1);
+	}
+	// A client that closes early must not kill the whole proxy.
+	Signal(SIGPIPE, SIG_IGN);
+	// Each worker process sets up everything below for itself, so a
+	// worker started again after a SIGHUP reads the pools anew.
+	if (nworkers >= 0){
+		worker = supervise(nworkers);
+	}
+	Sem_init(&drain_sem, 0, 0);
+	Signal(SIGUSR1, sigusr1_handler);
+	Signal(SIGTERM, sigterm_handler);
+	stats_init();
+	log_init(level, log_out);
+	guard_init(max_conns, max_per_ip);
+	dnscache_connect_timeout(guard_ms(TIMEOUT_CONNECT));
+	cache_init(MAX_CACHE_SIZE, MAX_OBJECT_SIZE, policy);
+	if (disk_dir != NULL){
+		diskcache_init(disk_dir, (size_t)disk_mb << 20);
+		cache_set_evict_hook(diskcache_put);
+	}
+	if (pools != NULL){
+		balancer_load(pools);
+	}
+	flight_init();
+	if (worker >= 0){
+		listenfd = Open_reuseport_listenfd(argv[optind]);
+		log_msg(LOG_INFO, "worker %d, pid %d", worker, (int)getpid());
+	}else{
+		listenfd = Open_listenfd(argv[optind]);
+	}
+	Pthread_create(&tid, NULL, drainer, (void *)(long)listenfd);
+	if (nreactors > 0){
+		log_msg(LOG_INFO, "listening on port %s (%d reactors)", argv[optind], nreactors);
+		event_run(listenfd, nreactors);
+		return 0;
+	}
+	log_msg(LOG_INFO, "listening on port %s (%d threads, queue %d)", argv[optind], nthreads, sbufsize);
+	connpool_init(idle_timeout, POOL_MAX_IDLE);
+	sbuf_init(&sbuf, sbufsize);
+	max_fds = sysconf(_SC_OPEN_MAX);
+	queued = Calloc(max_fds, sizeof(double));
+	clients = Calloc(max_fds, sizeof(guard_client_t *));
+	waits = Calloc(max_fds, sizeof(wait_t));
+	for (i = 0; i < nthreads; i++){
+		Pthread_create(&tid, NULL, thread, NULL);
+	}
+	wait_heads(listenfd);
         return 0;
 }
 
 /*
- * routine - Main routine of proxy server.
- *           Read and parse the request line from clients
- *           and forward it to tiny server.
- *           Get response of tiny server
- *           and forward it to client.
- *           Child processes call this function.
- */
-void routine(int connfd, char *client_hostname)
-{
-	char *server_port = (char *)(Malloc(MAXLINE));
-	char *request_line = (char *)(Malloc(MAXLINE));
-	char *method = (char *)(Malloc(MAXLINE));
-	char *uri = (char *)(Malloc(MAXLINE));
-	char *version = (char *)(Malloc(MAXLINE));
-        char *parsed_uri = (char *)(Malloc(MAXLINE));
-        char *fixed_version = (char *)(Malloc(MAXLINE));
-	char *server_request = (char *)(Malloc(MAXLINE));
-	char *server_header = (char *)(Malloc(MAXLINE));
-	char *server_response = (char *)(Malloc(MAXLINE));
-	
-	rio_t server_rp, client_rp;
-	int clientfd;
-	
-	// Read client's HTTP request.
-	Rio_readinitb(&client_rp, connfd);
-	if (!Rio_readlineb(&client_rp, request_line, MAXLINE)){
+ * wait_heads - Main thread routine: accept clients and keep each one
+ *              until its request head is in the socket whole, or the
+ *              connection ends, and only then queue it for a worker.
+ *              Workers send idle keep-alive connections back to wait for
+ *              their next request. The wait is bounded as in read_request:
+ *              by the idle timeout until a head starts, then by the
+ *              header timeout. So a slow or idle client costs a
+ *              descriptor rather than a worker (slowloris).
+ */
+static void wait_heads(int listenfd)
+{
+	struct epoll_event ev, events[WAIT_EVENTS];
+	double next_sweep = log_ms() + WAIT_SWEEP_MS;
+	int i, n, fd;
+
+	if ((wait_epfd = epoll_create1(0)) < 0){
+		unix_error("epoll_create1 error");
+	}
+	if (pipe(park_fds) < 0){
+		unix_error("pipe error");
+	}
+	// A worker never blocks on a full pipe, nor this thread on an empty one.
+	fcntl(park_fds[0], F_SETFL, O_NONBLOCK);
+	fcntl(park_fds[1], F_SETFL, O_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.fd = listenfd;
+	epoll_ctl(wait_epfd, EPOLL_CTL_ADD, listenfd, &ev);
+	ev.data.fd = park_fds[0];
+	epoll_ctl(wait_epfd, EPOLL_CTL_ADD, park_fds[0], &ev);
+	while (1){
+		if ((n = epoll_wait(wait_epfd, events, WAIT_EVENTS, WAIT_SWEEP_MS)) < 0){
+			if (errno == EINTR){
+				continue;
+			}
+			unix_error("epoll_wait error");
+		}
+		for (i = 0; i < n; i++){
+			if (events[i].data.fd == listenfd){
+				accept_client(listenfd);
+			}else if (events[i].data.fd == park_fds[0]){
+				while (read(park_fds[0], &fd, sizeof(fd)) == sizeof(fd)){
+					wait_head(fd);
+				}
+			}else{
+				check_head(events[i].data.fd);
+			}
+		}
+		if (log_ms() >= next_sweep){
+			sweep_waits(0);
+			next_sweep = log_ms() + WAIT_SWEEP_MS;
+		}
+	}
+}
+
+/*
+ * accept_client - Accept a client on listenfd and wait for its request.
+ */
+static void accept_client(int listenfd)
+{
+	socklen_t clientlen = sizeof(struct sockaddr_storage);
+	struct sockaddr_storage clientaddr;
+	char client_hostname[MAXLINE], client_port[MAXLINE];
+	guard_client_t *client;
+	int connfd;
+
+	if ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0){
+		// The drainer shut the socket down; the workers finish
+		// without this thread, and the connections still waiting
+		// for a request are closed.
+		if (draining){
+			sweep_waits(1);
+			Pthread_exit(NULL);
+		}
+		if (errno == EINTR || errno == ECONNABORTED){
+			return;
+		}
+		unix_error("Accept error");
+	}
+	// Over a cap, the connection is turned away before it takes
+	// a place in the queue.
+	if (connfd >= max_fds || (client = guard_admit(&clientaddr)) == NULL){
+		guard_refuse(connfd);
+		return;
+	}
+	clients[connfd] = client;
+	// Counted from here, so the drainer also waits for
+	// connections still waiting or in the queue.
+	stats_add(STAT_CONNECTIONS, 1);
+	stats_add(STAT_ACTIVE, 1);
+	// Name lookups would slow the accept loop, so only for debugging.
+	if (log_level >= LOG_DEBUG){
+		Getnameinfo((SA *)&clientaddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE,
+			    NI_NUMERICHOST | NI_NUMERICSERV);
+		log_msg(LOG_DEBUG, "connected to (%s, %s)", client_hostname, client_port);
+	}
+	wait_head(connfd);
+}
+
+/*
+ * wait_head - Keep connfd in the main thread until a request head
+ *             arrives on it, for at most the idle timeout.
+ */
+static void wait_head(int connfd)
+{
+	struct epoll_event ev;
+	double ms = guard_ms(TIMEOUT_IDLE);
+
+	if (connfd >= wait_top){
+		wait_top = connfd + 1;
+	}
+	waits[connfd].waiting = 1;
+	waits[connfd].started = 0;
+	waits[connfd].deadline = ms > 0 ? log_ms() + ms : 0;
+	// Edge-triggered, since the bytes are only peeked at: each new
+	// segment is one more look.
+	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+	ev.data.fd = connfd;
+	if (epoll_ctl(wait_epfd, EPOLL_CTL_ADD, connfd, &ev) < 0){
+		unix_error("epoll_ctl error");
+	}
+	// A head already there raises no edge.
+	check_head(connfd);
+}
+
+/*
+ * check_head - Queue connfd for a worker if its request head is in the
+ *              socket whole, or there is something else for a worker to
+ *              answer: a head that is not valid or too large, or the end
+ *              of the connection. The header timeout starts with the
+ *              first byte.
+ */
+static void check_head(int connfd)
+{
+	char buf[RIO_BUFSIZE];
+	http_req_t req;
+	double ms;
+	ssize_t n;
+
+	if (!waits[connfd].waiting){
+		return;
+	}
+	if ((n = recv(connfd, buf, sizeof(buf), MSG_PEEK | MSG_DONTWAIT)) < 0 &&
+	    (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)){
 		return;
 	}
-	printf("request: %s\n", request_line);
-	sscanf(request_line, "%s %s %s", method, uri, version);
-	// Parse the uri.
-	parse_uri(uri, parsed_uri, server_port);
-	if (strcmp(version, "HTTP/1.0")){
-		strcpy(fixed_version, "HTTP/1.0");
+	if (n > 0){
+		if (!waits[connfd].started){
+			waits[connfd].started = 1;
+			ms = guard_ms(TIMEOUT_HEADER);
+			waits[connfd].deadline = ms > 0 ? log_ms() + ms : 0;
+		}
+		http_parse_init(&req);
+		if (http_parse(&req, buf, n, guard_max_header) == HTTP_INCOMPLETE){
+			return;
+		}
+	}
+	waits[connfd].waiting = 0;
+	epoll_ctl(wait_epfd, EPOLL_CTL_DEL, connfd, NULL);
+	queued[connfd] = log_ms();
+	// Blocks while the queue is full.
+	sbuf_insert(&sbuf, connfd);
+}
+
+/*
+ * sweep_waits - Close the waiting connections that are past their
+ *               deadlines, or all of them. A client whose request head
+ *               is not complete gets a 408 first.
+ */
+static void sweep_waits(int all)
+{
+	static char timeout_resp[] = "HTTP/1.1 408 Request Timeout\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+	char buf[RIO_BUFSIZE];
+	double now = log_ms();
+	int fd;
+
+	for (fd = 0; fd < wait_top; fd++){
+		if (!waits[fd].waiting || (!all && (waits[fd].deadline == 0 || now < waits[fd].deadline))){
+			continue;
+		}
+		if (waits[fd].started){
+			// The head was only peeked at, and closing with unread
+			// bytes would reset the connection before the 408 is read.
+			while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+				;
+			stats_add(STAT_HEADER_TIMEOUTS, 1);
+			send(fd, timeout_resp, strlen(timeout_resp), MSG_DONTWAIT | MSG_NOSIGNAL);
+		}
+		waits[fd].waiting = 0;
+		// Closing the descriptor also takes it out of the epoll set.
+		Close(fd);
+		guard_leave(clients[fd]);
+		stats_add(STAT_ACTIVE, -1);
+	}
+}
+
+/*
+ * thread - Worker thread routine.
+ *          Take connections off the shared buffer and serve them
+ *          one at a time.
+ */
+void *thread(void *vargp)
+{
+	int connfd, one = 1;
+	guard_client_t *client;
+
+	Pthread_detach(pthread_self());
+	while (1){
+		connfd = sbuf_remove(&sbuf);
+		stats_time(STAGE_QUEUE, log_ms() - queued[connfd]);
+		// A client that stalls must not hold the worker forever.
+		// read_request keeps its own idle and header deadlines.
+		guard_socket(connfd);
+		// Headers and body go out in separate writes.
+		setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (routine(connfd)){
+			continue;
+		}
+		// The descriptor may be accepted again as soon as it is closed.
+		client = clients[connfd];
+		Close(connfd);
+		guard_leave(client);
+		stats_add(STAT_ACTIVE, -1);
+	}
+	return NULL;
+}
+
+/*
+ * routine - Serve the requests of one client connection in order until
+ *           either side wants it closed, or the process is draining.
+ *           Pipelined requests wait in the rio buffer, so their responses
+ *           go out in request order. Once none are left, the connection
+ *           goes back to the main thread to wait for the next one.
+ *           Returns 1 if it went back, 0 if the caller must close it.
+ */
+int routine(int connfd)
+{
+	rio_t client_rp;
+
+	Rio_readinitb(&client_rp, connfd);
+	while (serve_request(&client_rp, connfd) && !draining){
+		// If the pipe is full, the connection is closed as if it
+		// went idle.
+		if (client_rp.rio_cnt == 0){
+			return write(park_fds[1], &connfd, sizeof(connfd)) == sizeof(connfd);
+		}
+	}
+	return 0;
+}
+
+/*
+ * serve_request - Read and parse one request from the client.
+ *                 If a fresh copy of the object is cached in memory or on
+ *                 disk, send it without contacting the server. A stale
+ *                 copy with an ETag or Last-Modified is revalidated with
+ *                 a conditional request, and sent if the server answers
+ *                 304 Not Modified.
+ *                 If another request is fetching the same object, send the
+ *                 response of that fetch as it arrives (see flight.c).
+ *                 Otherwise forward the request to the server over a pooled
+ *                 keep-alive connection and forward its response to the
+ *                 client, caching it if it is small enough. The server is
+ *                 a backend of the host's pool if it has one. The client's
+ *                 headers go along, less the hop-by-hop ones, and its
+ *                 body, if any, streams to the server behind them.
+ *                 Logs one access line per request.
+ *                 Returns 1 if the connection stays open for another request.
+ */
+int serve_request(rio_t *client_rp, int connfd)
+{
+	char *host = (char *)(buf_alloc(MAXLINE));
+	char *server_port = (char *)(buf_alloc(MAXLINE));
+	char *method = "", *uri = "", *path, *head = NULL;
+	char *server_request = (char *)(buf_alloc(3 * MAXLINE));
+	char *server_header = (char *)(buf_alloc(MAXLINE));
+	char *key = (char *)(buf_alloc(MAXLINE));
+	char *cond = (char *)(buf_alloc(MAXLINE));
+	char *vhost = (char *)(buf_alloc(MAXLINE));
+	char *up_host = host, *up_port = server_port, *p;
+	pool_t *pool = NULL;
+	backend_t *backend = NULL;
+	double try_start;
+	http_req_t req;
+	http_slice_t *expect;
+	long head_len;
+	size_t len;
+
+	rio_t server_rp;
+	int clientfd, reused, attempt, rc = -1;
+	int idempotent, one = 1, timed_out = 0, body_cut = 0;
+	int http11, keep_alive = 0, chunked = 0;
+	int has_body, shared;
+	long long length = -1;
+	cache_obj_t *obj = NULL;
+	disk_obj_t dobj;
+	resp_info_t info = {0, 0, 0, 0};
+	double start, upstream_start, upstream_ms = 0, sent;
+	long long body_bytes = 0;
+	char *cache_state = "miss";
+	flight_t *flight = NULL;
+	flight_reader_t reader;
+	int leader;
+
+	// Read client's HTTP request, and parse it in the rio buffer.
+	if ((head_len = read_request(client_rp, &req, &start)) == 0){
+		goto done;
+	}
+	__sync_fetch_and_add(&nrequests, 1);
+	if (req.uri.p != NULL){
+		method = req.method.p;
+		uri = req.uri.p;
+	}
+	if (head_len == HEAD_TIMEOUT){
+		info.status = 408;
+		send_error(connfd, info.status, "Request Timeout");
+		goto log;
+	}
+	if (head_len < 0){
+		info.status = head_len == HTTP_TOO_LARGE ? 431 : 400;
+		send_error(connfd, info.status, head_len == HTTP_TOO_LARGE ?
+			   "Request Header Fields Too Large" : "Bad Request");
+		goto log;
+	}
+	log_msg(LOG_DEBUG, "> %s %s HTTP/1.%d", method, uri, req.minor);
+	// HTTP/1.1 connections are persistent unless the client says otherwise.
+	http11 = req.minor >= 1;
+	keep_alive = http11;
+	if ((info.status = request_headers(&req, &keep_alive, &length, &chunked, vhost)) != 0){
+		send_error(connfd, info.status, info.status == 501 ? "Not Implemented" : "Bad Request");
+		keep_alive = 0;
+		goto log;
+	}
+	// The head is used until the response is sent, but reading a body
+	// may refill the rio buffer it is in.
+	has_body = length > 0 || chunked;
+	if (has_body){
+		head = buf_alloc(RIO_BUFSIZE);
+		memcpy(head, req.base, head_len);
+		http_rebase(&req, head);
+		method = req.method.p;
+		uri = req.uri.p;
+	}
+	stats_add(STAT_BYTES_IN, head_len);
+	stats_time(STAGE_PARSE, log_ms() - start);
+	if (!strcmp(uri, STATS_URI)){
+		cache_state = "stats";
+		if (has_body && (body_bytes = relay_body(client_rp, -1, length, chunked)) < 0){
+			keep_alive = 0;
+			goto log;
+		}
+		if ((info.bytes = send_stats(connfd, keep_alive)) < 0){
+			info.bytes = 0;
+			keep_alive = 0;
+		}else{
+			info.status = 200;
+		}
+		goto log;
+	}
+	// Bounded before any header is built from them.
+	if (strlen(uri) > MAX_URI){
+		info.status = 414;
+		send_error(connfd, info.status, "URI Too Long");
+		keep_alive = 0;
+		goto log;
+	}
+	if (req.host.len > MAX_HOST || req.port.len > MAX_PORT ||
+	    (req.host.len == 0 && strlen(vhost) > MAX_HOST + 1 + MAX_PORT)){
+		info.status = 400;
+		send_error(connfd, info.status, "Bad Request");
+		keep_alive = 0;
+		goto log;
+	}
+	// A uri in origin form ("/path"), as a reverse proxy gets them, is
+	// for the Host, which must have a pool. The server gets the Host the
+	// client asked for either way.
+	path = req.path.p;
+	if (req.host.len == 0 && uri[0] == '/' && (pool = balancer_find(vhost)) != NULL){
+		if ((p = strchr(vhost, ':')) != NULL){
+			strcpy(server_port, p + 1);
+			memcpy(host, vhost, p - vhost);
+			host[p - vhost] = '\0';
+		}else{
+			strcpy(server_port, "80");
+			strcpy(host, vhost);
+		}
+		len = appendf(server_header, MAXLINE, 0, "Host: %s\r\n", vhost);
+	}else if (req.host.len > 0){
+		memcpy(host, req.host.p, req.host.len);
+		host[req.host.len] = '\0';
+		if (req.port.len > 0){
+			memcpy(server_port, req.port.p, req.port.len);
+			server_port[req.port.len] = '\0';
+		}else{
+			strcpy(server_port, "80");
+		}
+		pool = balancer_find(host);
+		len = appendf(server_header, MAXLINE, 0, strchr(host, ':') ? "Host: [%s]" : "Host: %s", host);
+		len = appendf(server_header, MAXLINE, len, req.port.len > 0 ? ":%s\r\n" : "\r\n", server_port);
 	}else{
-		strcpy(fixed_version, version);
+		log_msg(LOG_ERROR, "bad uri: %s", uri);
+		info.status = 400;
+		send_error(connfd, info.status, "Bad Request");
+		keep_alive = 0;
+		goto log;
+	}
+	if (appendf(server_header, MAXLINE, len, "%sConnection: keep-alive\r\n", user_agent_hdr) >= MAXLINE){
+		info.status = 400;
+		send_error(connfd, info.status, "Bad Request");
+		keep_alive = 0;
+		goto log;
+	}
+	make_key(key, host, server_port, path);
+	// Only responses to plain GETs are cached or shared with other
+	// requests; the client's headers may make others its own.
+	shared = !strcasecmp(method, "GET") && !has_body && !personal(&req);
+	// Serve fresh cached objects without touching the server. Objects
+	// evicted from memory may still be on disk.
+	if (!strcasecmp(method, "GET") && !has_body && (obj = cache_lookup(key)) == NULL &&
+	    diskcache_lookup(key, &dobj)){
+		if (time(NULL) < dobj.expires){
+			cache_state = "disk";
+			stats_add(STAT_DISK_HITS, 1);
+			if ((info.bytes = send_disk(connfd, &dobj, keep_alive)) < 0){
+				info.bytes = 0;
+				keep_alive = 0;
+			}else{
+				info.status = 200;
+			}
+			// It is wanted again, so it goes back to memory.
+			cache_insert(key, dobj.data, dobj.size, dobj.expires);
+			diskcache_release(&dobj);
+			goto log;
+		}
+		// Stale; it is revalidated from memory like any other.
+		cache_insert(key, dobj.data, dobj.size, dobj.expires);
+		diskcache_release(&dobj);
+		obj = cache_lookup(key);
+	}
+	if (obj != NULL && cache_fresh(obj)){
+		cache_state = "hit";
+		stats_add(STAT_HITS, 1);
+		if ((info.bytes = send_cached(connfd, obj, keep_alive)) < 0){
+			info.bytes = 0;
+			keep_alive = 0;
+		}else{
+			info.status = 200;
+		}
+		cache_release(obj);
+		obj = NULL;
+		goto log;
+	}
+	// A stale object without validators is fetched again like a miss.
+	if (obj != NULL && (!shared || !conditional_headers(obj, cond))){
+		cache_release(obj);
+		obj = NULL;
+	}
+	// Join a fetch of the same object that is already under way.
+	// Revalidations do not, since they may get no body to share.
+	if (obj == NULL && shared){
+		flight = flight_join(key, &reader, &leader);
+		if (!leader){
+			info.bytes = flight_follow(flight, &reader, connfd, http11, &keep_alive, &info.status);
+			flight_release(flight, &reader);
+			flight = NULL;
+			if (info.bytes >= 0){
+				cache_state = "coalesced";
+				stats_add(STAT_COALESCED, 1);
+				goto log;
+			}
+			// That fetch got no response; try once more ourselves.
+			info.bytes = 0;
+		}
 	}
 	// Request line from proxy to server.
-	http_request(server_request, method, parsed_uri, fixed_version);
-	http_header(client_hostname, server_header);
-	printf("request line: %s\n", server_request);
-	// Now connect to tiny server.
-	clientfd = Open_clientfd(client_hostname, server_port);
-	// Write request line to tiny server.
-	Rio_writen(clientfd, server_request, strlen(server_request));
-	Rio_writen(clientfd, server_header, strlen(server_header));
-	// Read response from tiny server and forward it to client.
-	Rio_readinitb(&server_rp, clientfd);
-	forward_response(&server_rp, server_response, connfd);
-	
-	// Free allocated spaces by Malloc.
-	Free((void *)server_port);
-	Free((void *)request_line);
-	Free((void *)method);
-	Free((void *)uri);
-	Free((void *)version);
-        Free((void *)parsed_uri);
-        Free((void *)fixed_version);
-	Free((void *)server_request);
-	Free((void *)server_response);
-	// Close clientfd.
-	Close(clientfd);
+	// HTTP/1.1 lets the connection to the server be kept alive.
+	p = server_request + sprintf(server_request, "%s %s HTTP/1.1\r\n", method, path);
+	log_msg(LOG_DEBUG, "upstream %s:%s %s", host, server_port, server_request);
+	// The client's own headers follow ours. A revalidation asks with the
+	// cached object's validators instead of any the client sent.
+	p = stpcpy(p, server_header);
+	p = forward_headers(p, &req, obj != NULL);
+	if (obj != NULL){
+		p = stpcpy(p, cond);
+	}
+	// The body is framed the way the client framed it.
+	if (chunked){
+		p = stpcpy(p, "Transfer-Encoding: chunked\r\n");
+	}else if (length >= 0){
+		p += sprintf(p, "Content-Length: %lld\r\n", length);
+	}
+	// One write: a second small one would wait on a delayed ACK
+	// (Nagle) once the connection is warm.
+	strcpy(p, "\r\n");
+	// A request whose body may be half sent is never sent again.
+	idempotent = (!strcasecmp(method, "GET") || !strcasecmp(method, "HEAD")) && !has_body;
+	upstream_start = log_ms();
+	// A pooled connection the server has closed fails before any of the
+	// response arrives. Idempotent requests are then sent once more
+	// on a new connection, or to the next backend the pool picks.
+	for (attempt = 0; attempt < 2; attempt++){
+		if (pool != NULL){
+			backend = balancer_pick(pool, key);
+			up_host = backend->host;
+			up_port = backend->port;
+			log_msg(LOG_DEBUG, "backend %s:%s for %s", up_host, up_port, host);
+		}
+		try_start = log_ms();
+		errno = 0;
+		if ((clientfd = connpool_get(up_host, up_port, &reused)) < 0){
+			timed_out = errno == ETIMEDOUT;
+			log_msg(LOG_ERROR, "cannot connect to %s:%s", up_host, up_port);
+			if (pool != NULL){
+				balancer_done(pool, backend, 0, 0);
+				if (idempotent){
+					continue;
+				}
+			}
+			break;
+		}
+		stats_add(reused ? STAT_UPSTREAM_REUSED : STAT_UPSTREAM_NEW, 1);
+		// A server that stalls is given up on like a client.
+		if (!reused){
+			guard_socket(clientfd);
+		}
+		rc = -1;
+		errno = 0;
+		if (rio_writen(clientfd, server_request, strlen(server_request)) >= 0){
+			// A client waiting for 100 Continue before it sends the
+			// body gets it from us; the server never saw the Expect.
+			if (has_body && http11 && (expect = http_find_header(&req, "Expect")) != NULL &&
+			    http_has_token(expect, "100-continue")){
+				rio_writen(connfd, continue_resp, strlen(continue_resp));
+			}
+			// The body streams through one block at a time.
+			if (has_body && (body_bytes = relay_body(client_rp, clientfd, length, chunked)) < 0){
+				log_msg(LOG_ERROR, "request body from client cut short");
+				body_cut = 1;
+				keep_alive = 0;
+				Close(clientfd);
+				if (pool != NULL){
+					balancer_done(pool, backend, 1, log_ms() - try_start);
+				}
+				break;
+			}
+			sent = log_ms();
+			// Servers that write the header and body separately would
+			// otherwise wait on our delayed ACK of the header.
+			setsockopt(clientfd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+			// Read response from the server and forward it to client.
+			// Only shared GET responses may be cached.
+			Rio_readinitb(&server_rp, clientfd);
+			errno = 0;
+			rc = forward_response(&server_rp, connfd, shared ? key : NULL,
+					      !strcasecmp(method, "HEAD"), http11, &keep_alive, flight, obj, &info);
+			// A read that ran into SO_RCVTIMEO fails with EAGAIN.
+			timed_out = errno == EAGAIN || errno == EWOULDBLOCK;
+			if (info.first_byte > 0){
+				stats_time(STAGE_FIRST_BYTE, info.first_byte - sent);
+				stats_time(STAGE_TRANSFER, log_ms() - info.first_byte);
+			}
+		}else{
+			timed_out = errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		if (rc == 1 && server_rp.rio_cnt == 0){
+			connpool_put(up_host, up_port, clientfd);
+		}else{
+			Close(clientfd);
+		}
+		if (pool != NULL){
+			balancer_done(pool, backend, rc >= 0 && info.status < 500, log_ms() - try_start);
+		}
+		if (rc >= 0 || !idempotent || (!reused && pool == NULL)){
+			break;
+		}
+	}
+	if (rc < 0 || info.bytes == 0){
+		// The client got no response at all. Unless its own body was
+		// what failed, it hears that the server did.
+		keep_alive = 0;
+		if (info.bytes == 0 && !body_cut){
+			info.status = timed_out ? 504 : 502;
+			send_error(connfd, info.status, timed_out ? "Gateway Timeout" : "Bad Gateway");
+		}
+	}
+	stats_add(STAT_BYTES_IN, body_bytes);
+	upstream_ms = log_ms() - upstream_start;
+	if (flight != NULL){
+		flight_finish(flight, 0);
+		flight_release(flight, NULL);
+	}
+	if (obj != NULL){
+		cache_release(obj);
+	}
+	if (info.not_modified){
+		cache_state = "revalidated";
+		stats_add(STAT_REVALIDATED, 1);
+	}else{
+		stats_add(STAT_MISSES, 1);
+	}
 
-	return;
+log:
+	stats_add(STAT_REQUESTS, 1);
+	stats_add(STAT_BYTES_OUT, info.bytes);
+	if (info.status == 0 || info.status >= 500){
+		stats_add(STAT_ERRORS, 1);
+	}
+	stats_time(STAGE_TOTAL, log_ms() - start);
+	log_msg(LOG_INFO, "method=%s uri=%s status=%d bytes=%lld upstream_ms=%.2f total_ms=%.2f cache=%s",
+		method, uri, info.status, info.bytes, upstream_ms, log_ms() - start, cache_state);
+done:
+	// Give the buffers back to this worker's pool.
+	buf_free((void *)host, MAXLINE);
+	buf_free((void *)server_port, MAXLINE);
+	if (head != NULL){
+		buf_free((void *)head, RIO_BUFSIZE);
+	}
+	buf_free((void *)server_request, 3 * MAXLINE);
+	buf_free((void *)server_header, MAXLINE);
+	buf_free((void *)key, MAXLINE);
+	buf_free((void *)cond, MAXLINE);
+	buf_free((void *)vhost, MAXLINE);
+	return keep_alive;
 }
-	
+
 /*
- * parse_uri - Parse the uri.
- *             Get server port number and file path.
+ * parse_uri - Parse an absolute uri (http://host[:port][/path]).
+ *             Get server host name, port number and file path.
+ *             Returns 0 if the uri is not an http uri.
  */
-int parse_uri(char *uri, char *parsed_uri, char *port)
+int parse_uri(char *uri, char *host, char *port, char *path)
 {
-	char *buf = uri;
 	char *p;
 	char *q;
 	char *r;
-	
-	if ((p = strstr(buf, "http://")) == NULL){
-		app_error("Wrong URI\n");
-	}
-	q = strstr(p + 7, "/");
-	strcpy(parsed_uri, q);
-	*q = '\0';
-	r = strstr(p + 7, ":");
-	strcpy(port, r + 1);
+
+	if (strncasecmp(uri, "http://", 7)){
+		return 0;
+	}
+	p = uri + 7;
+	// The path starts at the first '/', or is "/" if there is none.
+	if ((q = strchr(p, '/')) == NULL){
+		q = p + strlen(p);
+		strcpy(path, "/");
+	}else{
+		strcpy(path, q);
+	}
+	// The port follows an optional ':' in the authority.
+	if ((r = memchr(p, ':', q - p)) == NULL){
+		r = q;
+		strcpy(port, "80");
+	}else{
+		strncpy(port, r + 1, q - r - 1);
+		port[q - r - 1] = '\0';
+	}
+	if (r == p){
+		return 0;
+	}
+	strncpy(host, p, r - p);
+	host[r - p] = '\0';
 	return 1;
 }
 
+/*
+ * make_key - Make the normalized uri that names an object in the cache.
+ *            Host names are case-insensitive and fragments are never
+ *            sent to the server, so both are normalized away.
+ */
+void make_key(char *key, char *host, char *port, char *path)
+{
+	char *p;
+
+	sprintf(key, "%s:%s%s", host, port, path);
+	for (p = key; *p && *p != ':'; p++){
+		*p = tolower(*p);
+	}
+	if ((p = strchr(key, '#')) != NULL){
+		*p = '\0';
+	}
+}
+
+/*
+ * read_request - Read the head of the next request on the client
+ *                connection into its rio buffer and parse it there (see
+ *                httpparse.c). Bytes already in the buffer, such as a
+ *                pipelined request, are parsed first, and a head split
+ *                across reads is moved to the front of the buffer when
+ *                the rest would not fit after it. The head is taken out of
+ *                the buffer, but stays in place until the next read into
+ *                it; *started is when its first bytes were there.
+ *                The request must start within the idle timeout, and its
+ *                head, counted from there, must be complete within the
+ *                header timeout and guard_max_header bytes.
+ *                Returns the length of the head, 0 if the connection
+ *                ends or goes idle first, or HTTP_BAD, HTTP_TOO_LARGE or
+ *                HEAD_TIMEOUT.
+ */
+static long read_request(rio_t *rp, http_req_t *req, double *started)
+{
+	struct pollfd pfd = {rp->rio_fd, POLLIN, 0};
+	char *end;
+	double wait;
+	ssize_t n;
+	long rc;
+
+	http_parse_init(req);
+	if (rp->rio_cnt <= 0){
+		rp->rio_cnt = 0;
+		rp->rio_bufptr = rp->rio_buf;
+	}else{
+		*started = log_ms();
+	}
+	while ((rc = http_parse(req, rp->rio_bufptr, rp->rio_cnt, guard_max_header)) == HTTP_INCOMPLETE){
+		end = rp->rio_bufptr + rp->rio_cnt;
+		if (end == rp->rio_buf + RIO_BUFSIZE){
+			memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+			rp->rio_bufptr = rp->rio_buf;
+			end = rp->rio_buf + rp->rio_cnt;
+		}
+		// The header deadline does not move as bytes trickle in.
+		if (rp->rio_cnt == 0){
+			wait = guard_ms(TIMEOUT_IDLE);
+		}else if ((wait = guard_ms(TIMEOUT_HEADER)) > 0 && (wait += *started - log_ms()) <= 0){
+			stats_add(STAT_HEADER_TIMEOUTS, 1);
+			return HEAD_TIMEOUT;
+		}
+		if ((n = poll(&pfd, 1, wait > 0 ? (int)wait + 1 : -1)) < 0 && errno == EINTR){
+			continue;
+		}
+		// Out of time: idle, or round again to find the head late.
+		if (n < 0 || (n == 0 && rp->rio_cnt == 0)){
+			return 0;
+		}
+		if (n == 0){
+			continue;
+		}
+		if ((n = read(rp->rio_fd, end, rp->rio_buf + RIO_BUFSIZE - end)) < 0 && errno == EINTR){
+			continue;
+		}
+		if (n <= 0){
+			return 0;
+		}
+		if (rp->rio_cnt == 0){
+			*started = log_ms();
+		}
+		rp->rio_cnt += n;
+	}
+	if (rc > 0){
+		rp->rio_bufptr += rc;
+		rp->rio_cnt -= rc;
+	}
+	return rc;
+}
+
+/*
+ * request_headers - Find in the client's request headers whether it
+ *                   wants the connection kept alive, how its body is
+ *                   framed, and the Host it asks for (vhost, "" if none).
+ *                   Returns 0, or the status to refuse the request with:
+ *                   400 if the framing is not valid, as with
+ *                   Content-Length headers that disagree or that come
+ *                   with Transfer-Encoding, and 501 if the body has a
+ *                   final coding other than chunked.
+ */
+static int request_headers(http_req_t *req, int *keep_alive, long long *length, int *chunked, char *vhost)
+{
+	http_header_t *h;
+	long long n;
+	int i, encoded = 0;
+
+	vhost[0] = '\0';
+	for (i = 0; i < req->nheaders; i++){
+		h = &req->headers[i];
+		if (http_slice_eq(&h->name, "Connection") || http_slice_eq(&h->name, "Proxy-Connection")){
+			if (http_has_token(&h->value, "close")){
+				*keep_alive = 0;
+			}else if (http_has_token(&h->value, "keep-alive")){
+				*keep_alive = 1;
+			}
+		}else if (http_slice_eq(&h->name, "Content-Length")){
+			if ((n = http_number(&h->value)) < 0 || (*length >= 0 && *length != n)){
+				return 400;
+			}
+			*length = n;
+		}else if (http_slice_eq(&h->name, "Transfer-Encoding")){
+			// Only the last coding of the last header frames the body.
+			encoded = 1;
+			*chunked = http_last_token(&h->value, "chunked");
+		}else if (http_slice_eq(&h->name, "Host") && vhost[0] == '\0'){
+			memcpy(vhost, h->value.p, h->value.len);
+			vhost[h->value.len] = '\0';
+		}
+	}
+	// Both framings at once is how requests are smuggled past a proxy.
+	if (encoded && *length >= 0){
+		return 400;
+	}
+	if (encoded && !*chunked){
+		return 501;
+	}
+	return 0;
+}
+
+/*
+ * send_error - Send a response with status and no body, for a request
+ *              that cannot be served. The connection is closed after it.
+ */
+static void send_error(int fd, int status, char *reason)
+{
+	char buf[MAXLINE];
+
+	sprintf(buf, "HTTP/1.1 %d %s\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", status, reason);
+	rio_writen(fd, buf, strlen(buf));
+}
+
+/*
+ * relay_body - Copy a request body of length bytes, or a chunked one,
+ *              from the client to the server at fd, a block at a time,
+ *              so no upload is ever held in memory whole. Chunks go
+ *              through as they are, trailers included. If fd is -1, or
+ *              the server stops taking the body, the rest is read and
+ *              discarded, so that the next request on the connection
+ *              starts where it should.
+ *              Returns the number of bytes read, or -1 if the body is
+ *              cut short or its chunks are not valid.
+ */
+static long long relay_body(rio_t *rp, int fd, long long length, int chunked)
+{
+	char *buf = buf_alloc(BODY_BLOCK);
+	char *end;
+	long long chunk, total = 0;
+	ssize_t n;
+
+	if (!chunked){
+		total = copy_bytes(rp, &fd, buf, length) < 0 ? -1 : length;
+		buf_free(buf, BODY_BLOCK);
+		return total;
+	}
+	while ((n = rio_readlineb(rp, buf, MAXLINE)) > 0 && buf[n - 1] == '\n'){
+		total += n;
+		chunk = strtoll(buf, &end, 16);
+		if (end == buf || end - buf > 15 || chunk < 0 || (*end != '\r' && *end != '\n' && *end != ';' && *end != ' ')){
+			break;
+		}
+		if (fd >= 0 && rio_writen(fd, buf, n) < 0){
+			fd = -1;
+		}
+		if (chunk == 0){
+			// Last chunk; the trailers end with a blank line.
+			while ((n = rio_readlineb(rp, buf, MAXLINE)) > 0 && buf[n - 1] == '\n'){
+				total += n;
+				if (fd >= 0 && rio_writen(fd, buf, n) < 0){
+					fd = -1;
+				}
+				if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n")){
+					buf_free(buf, BODY_BLOCK);
+					return total;
+				}
+			}
+			break;
+		}
+		// Chunk data and its CRLF.
+		if (copy_bytes(rp, &fd, buf, chunk + 2) < 0){
+			break;
+		}
+		total += chunk + 2;
+	}
+	buf_free(buf, BODY_BLOCK);
+	return -1;
+}
+
+/*
+ * copy_bytes - Copy n bytes from rp to *fd through buf, which holds
+ *              BODY_BLOCK bytes. *fd becomes -1 if a write fails, and the
+ *              rest is only read. Returns -1 if rp ends first.
+ */
+static int copy_bytes(rio_t *rp, int *fd, char *buf, long long n)
+{
+	ssize_t got;
+
+	for (; n > 0; n -= got){
+		if ((got = rio_readnb(rp, buf, n < BODY_BLOCK ? n : BODY_BLOCK)) <= 0){
+			return -1;
+		}
+		if (*fd >= 0 && rio_writen(*fd, buf, got) < 0){
+			log_msg(LOG_ERROR, "server stopped taking the request body");
+			*fd = -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * forward_headers - Write the client's request headers to dst, leaving
+ *                   out the hop-by-hop ones, those the Connection header
+ *                   names, and those the proxy writes itself. drop_cond
+ *                   also leaves out the If-* headers.
+ *                   Returns the end of what was written.
+ */
+static char *forward_headers(char *dst, http_req_t *req, int drop_cond)
+{
+	http_header_t *h;
+	int i, j;
+
+	for (i = 0; i < req->nheaders; i++){
+		h = &req->headers[i];
+		for (j = 0; hop_headers[j] != NULL && !http_slice_eq(&h->name, hop_headers[j]); j++)
+			;
+		if (hop_headers[j] != NULL || connection_lists(req, &h->name) ||
+		    (drop_cond && h->name.len > 3 && !strncasecmp(h->name.p, "If-", 3))){
+			continue;
+		}
+		memcpy(dst, h->name.p, h->name.len);
+		dst += h->name.len;
+		*dst++ = ':';
+		*dst++ = ' ';
+		memcpy(dst, h->value.p, h->value.len);
+		dst += h->value.len;
+		*dst++ = '\r';
+		*dst++ = '\n';
+	}
+	*dst = '\0';
+	return dst;
+}
+
+/*
+ * connection_lists - Check if a Connection header of req names the header
+ *                    called name, making it hop-by-hop.
+ */
+static int connection_lists(http_req_t *req, http_slice_t *name)
+{
+	char token[64];
+	int i;
+
+	if (name->len >= sizeof(token)){
+		return 0;
+	}
+	memcpy(token, name->p, name->len);
+	token[name->len] = '\0';
+	for (i = 0; i < req->nheaders; i++){
+		if (http_slice_eq(&req->headers[i].name, "Connection") &&
+		    http_has_token(&req->headers[i].value, token)){
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * personal - Check if req asks for a response of its own: one for its
+ *            credentials, for a part of the object, or only under a
+ *            condition. Such responses are not cached or shared.
+ */
+static int personal(http_req_t *req)
+{
+	http_header_t *h;
+	int i;
+
+	for (i = 0; i < req->nheaders; i++){
+		h = &req->headers[i];
+		if (http_slice_eq(&h->name, "Authorization") || http_slice_eq(&h->name, "Range") ||
+		    (h->name.len > 3 && !strncasecmp(h->name.p, "If-", 3))){
+			return 1;
+		}
+	}
+	return 0;
+}
+
 /*
  * http_request - Make a single line http-request which would be sent to server
  *                using parsed uri and fixed version.
@@ -159,42 +1318,732 @@ void http_request(char *server_request, char *method, char *uri, char *version)
 }
 
 /*
- * http_header - Make request header which would be sent to server.
+ * http_header - Make request header which would be sent to server, in
+ *               header of size bytes, asking it to close the connection.
+ *               Returns -1 if it does not fit.
  */
-void http_header(char *host_name, char *header)
+int http_header(char *host_name, char *header, size_t size)
 {
-	sprintf(header, "Host: %s\r\n", host_name);
-	sprintf(header, "%s%s", header, user_agent_hdr);
-	sprintf(header, "%sConnection: close\r\n", header);
-	sprintf(header, "%sProxy-Connection: close\r\n\r\n", header);
+	size_t len;
+
+	len = appendf(header, size, 0, "Host: %s\r\n", host_name);
+	len = appendf(header, size, len, "%s", user_agent_hdr);
+	len = appendf(header, size, len, "Connection: close\r\n");
+	len = appendf(header, size, len, "Proxy-Connection: close\r\n\r\n");
+	return len < size ? 0 : -1;
 }
 
 /*
- * forward)response - Read response of server and forward it to client.
+ * appendf - Append to the string of len bytes in buf, of size bytes in
+ *           all, as snprintf would. Returns the new length, which is
+ *           size or more if the string did not fit; then nothing more
+ *           is appended.
  */
-void forward_response(rio_t *server_rp, char *buf, int fd)
+static size_t appendf(char *buf, size_t size, size_t len, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (len >= size){
+		return len;
+	}
+	va_start(ap, fmt);
+	n = vsnprintf(buf + len, size - len, fmt, ap);
+	va_end(ap);
+	return n < 0 ? size : len + n;
+}
+
+/*
+ * forward_response - Read response of server and forward it to client.
+ *                    The body is read by its framing (Content-Length,
+ *                    chunked, or up to EOF) so that the connection can
+ *                    be used again once the response ends.
+ *                    The client gets the same framing when it can use it.
+ *                    Chunked bodies go to HTTP/1.0 clients (http11 == 0)
+ *                    without chunking, and bodies that end at EOF can only
+ *                    be ended by closing the client connection, so both
+ *                    clear *keep_client. The response says whether the
+ *                    client connection stays open.
+ *                    head tells that the response has no body.
+ *                    If key is not NULL, also collect the response and
+ *                    cache it under key once it is complete, as long as
+ *                    it is a 200 response no larger than MAX_OBJECT_SIZE.
+ *                    If flight is not NULL, the response also goes to the
+ *                    requests following this fetch.
+ *                    If stale is not NULL, the request was a revalidation
+ *                    of that cached object, and a 304 response means the
+ *                    client gets it, fresh again, instead.
+ *                    The status and the bytes sent go into info.
+ *                    Returns -1 if the server sent nothing, 1 if the
+ *                    response ended and the server keeps the connection
+ *                    open, and 0 otherwise.
+ */
+int forward_response(rio_t *server_rp, int fd, char *key, int head, int http11, int *keep_client,
+		     flight_t *flight, cache_obj_t *stale, resp_info_t *info)
 {
 	ssize_t n;
-	char *buffer = Malloc(MAXLINE);
-	
-	// Read response from server line by line.
-	while ((n = Rio_readlineb(server_rp, buffer, MAXLINE)) != 0){
-		printf("%s", buffer);
-		// Contents may not be strings.
-		// Using strlen(buffer) rather than n may not work.
-		Rio_writen(fd, buffer, n);
-	}
-	Free((void *)buffer);
-	return;
+	char *buffer = buf_alloc(BODY_BLOCK);
+	char *header = buf_alloc(MAXBUF);
+	char *object = NULL, *dst, *end;
+	size_t object_size = 0, header_size;
+	char version[MAXLINE], line[MAXLINE];
+	int status = 0;
+	long long length = -1, chunk, spliced, sent;
+	long age;
+	int chunked = 0, keep_alive, complete = 0;
+	int rc = 0;
+
+	if (key != NULL){
+		object = buf_alloc(MAX_OBJECT_SIZE);
+	}
+	// Status line. Interim responses (1xx) are skipped; the proxy
+	// already told the client to go on with its body.
+	while (1){
+		if ((n = rio_readlineb(server_rp, buffer, MAXLINE)) <= 0){
+			rc = status == 0 ? -1 : 0;
+			goto out;
+		}
+		log_msg(LOG_DEBUG, "< %s", buffer);
+		if (sscanf(buffer, "%s %d", version, &status) != 2){
+			goto out;
+		}
+		if (status < 100 || status >= 200){
+			break;
+		}
+		while ((n = rio_readlineb(server_rp, buffer, MAXLINE)) > 0 &&
+		       strcmp(buffer, "\r\n") && strcmp(buffer, "\n"))
+			;
+	}
+	info->status = status;
+	info->first_byte = log_ms();
+	keep_alive = !strcmp(version, "HTTP/1.1");
+	strcpy(header, buffer);
+	// Headers. Those about the connection and the framing are the
+	// proxy's business and are replaced below.
+	while ((n = rio_readlineb(server_rp, buffer, MAXLINE)) > 0){
+		log_msg(LOG_DEBUG, "< %s", buffer);
+		if (!strcmp(buffer, "\r\n") || !strcmp(buffer, "\n")){
+			break;
+		}
+		if (framing_header(buffer)){
+			if (!strncasecmp(buffer, "Content-Length:", 15)){
+				length = strtoll(buffer + 15, NULL, 10);
+			}else if (!strncasecmp(buffer, "Transfer-Encoding:", 18)){
+				chunked = has_word(buffer + 18, "chunked");
+			}else if (!strncasecmp(buffer, "Connection:", 11)){
+				if (has_word(buffer + 11, "close")){
+					keep_alive = 0;
+				}else if (has_word(buffer + 11, "keep-alive")){
+					keep_alive = 1;
+				}
+			}
+			continue;
+		}
+		// Leave room for the framing and Connection lines.
+		if (strlen(header) + n + 128 > MAXBUF){
+			goto out;
+		}
+		strcat(header, buffer);
+	}
+	if (n <= 0){
+		goto out;
+	}
+	header_size = strlen(header);
+	if (stale != NULL && status == 304){
+		// A 304 has no body. It may renew the lifetime; if it does not
+		// say, the cached headers do.
+		rc = keep_alive;
+		if ((age = max_age(header, header_size)) == AGE_UNSET){
+			age = max_age(stale->data, header_end(stale->data, stale->size) + 2);
+		}
+		cache_refresh(stale, time(NULL) + (age >= 0 ? age : 0));
+		info->not_modified = 1;
+		if ((sent = send_cached(fd, stale, *keep_client)) >= 0){
+			info->status = 200;
+			info->bytes += sent;
+			complete = 1;
+		}
+		goto out;
+	}
+	// Framing for the client.
+	if (flight != NULL){
+		flight_header(flight, header, header_size,
+			      (head || status / 100 == 1 || status == 204 || status == 304) ? 0 :
+			      (chunked ? -1 : length));
+	}
+	if (head || status / 100 == 1 || status == 204 || status == 304){
+		if (head && length >= 0){
+			sprintf(line, "Content-Length: %lld\r\n", length);
+			strcat(header, line);
+		}
+	}else if (chunked && http11){
+		strcat(header, "Transfer-Encoding: chunked\r\n");
+	}else if (!chunked && length >= 0){
+		sprintf(line, "Content-Length: %lld\r\n", length);
+		strcat(header, line);
+	}else{
+		*keep_client = 0;
+	}
+	strcat(header, *keep_client ? "X-Cache: MISS\r\nConnection: keep-alive\r\n\r\n" :
+		       "X-Cache: MISS\r\nConnection: close\r\n\r\n");
+	if (rio_writen(fd, header, strlen(header)) < 0){
+		goto out;
+	}
+	info->bytes += strlen(header);
+	// Body.
+	if (head || status / 100 == 1 || status == 204 || status == 304){
+		complete = 1;
+	}else if (chunked){
+		while ((n = rio_readlineb(server_rp, buffer, MAXLINE)) > 0){
+			// A size line that doesn't parse ends the response as an
+			// upstream error, not as the last chunk.
+			chunk = strtoll(buffer, &end, 16);
+			if (end == buffer || end - buffer > 15 || chunk < 0 ||
+			    (*end != '\r' && *end != '\n' && *end != ';' && *end != ' ')){
+				goto out;
+			}
+			if (chunk == 0){
+				// Last chunk; skip the trailers.
+				while ((n = rio_readlineb(server_rp, buffer, MAXLINE)) > 0 &&
+				       strcmp(buffer, "\r\n") && strcmp(buffer, "\n"))
+					;
+				complete = n > 0 && (!http11 || rio_writen(fd, "0\r\n\r\n", 5) >= 0);
+				info->bytes += http11 ? 5 : 0;
+				break;
+			}
+			sprintf(line, "%llx\r\n", chunk);
+			if (http11){
+				if (rio_writen(fd, line, strlen(line)) < 0){
+					goto out;
+				}
+				// With the CRLF after the chunk data.
+				info->bytes += strlen(line) + 2;
+			}
+			while (chunk > 0){
+				n = chunk < BODY_BLOCK ? chunk : BODY_BLOCK;
+				dst = body_dst(buffer, object, object_size, n);
+				n = read_block(server_rp, dst, n);
+				if (n <= 0 || send_bytes(fd, dst, n, object, &object_size, &info->bytes, flight) < 0){
+					goto out;
+				}
+				chunk -= n;
+			}
+			// CRLF after the chunk data.
+			if (rio_readlineb(server_rp, buffer, MAXLINE) <= 0 ||
+			    (http11 && rio_writen(fd, "\r\n", 2) < 0)){
+				goto out;
+			}
+		}
+	}else if (!chunked && (length < 0 || length >= SPLICE_MIN_BODY) &&
+		  (object == NULL || length > MAX_OBJECT_SIZE) &&
+		  (flight == NULL || flight_leave(flight))){
+		// Nothing to keep and nobody following, so move the body with
+		// splice and never copy it to user space. The start of it may
+		// already be buffered.
+		flight = NULL;
+		if (length < 0){
+			keep_alive = 0;
+		}
+		n = server_rp->rio_cnt;
+		if (length >= 0 && n > length){
+			n = length;
+		}
+		if (n > 0 && rio_writen(fd, server_rp->rio_bufptr, n) < 0){
+			goto out;
+		}
+		info->bytes += n;
+		server_rp->rio_bufptr += n;
+		server_rp->rio_cnt -= n;
+		if (length > 0){
+			length -= n;
+		}
+		if ((spliced = relay_splice(server_rp->rio_fd, fd, length)) >= 0){
+			info->bytes += spliced;
+			complete = 1;
+		}
+		object_size = MAX_OBJECT_SIZE + 1;
+	}else if (length >= 0){
+		while (length > 0){
+			n = length < BODY_BLOCK ? length : BODY_BLOCK;
+			dst = body_dst(buffer, object, object_size, n);
+			n = read_block(server_rp, dst, n);
+			if (n <= 0 || send_bytes(fd, dst, n, object, &object_size, &info->bytes, flight) < 0){
+				goto out;
+			}
+			length -= n;
+		}
+		complete = 1;
+	}else{
+		// Ends when the server closes, so the connection is used up.
+		keep_alive = 0;
+		while ((n = read_block(server_rp, dst = body_dst(buffer, object, object_size, BODY_BLOCK), BODY_BLOCK)) > 0){
+			if (send_bytes(fd, dst, n, object, &object_size, &info->bytes, flight) < 0){
+				goto out;
+			}
+		}
+		complete = n == 0;
+	}
+	if (complete){
+		rc = keep_alive;
+		if (object != NULL && object_size <= MAX_OBJECT_SIZE && status == 200){
+			cache_response(key, header, header_size, object, object_size);
+		}
+	}
+out:
+	if (!complete){
+		// The client cannot tell where this response ends.
+		*keep_client = 0;
+	}
+	if (flight != NULL && rc >= 0){
+		flight_finish(flight, complete);
+	}
+	if (object != NULL){
+		buf_free(object, MAX_OBJECT_SIZE);
+	}
+	buf_free((void *)header, MAXBUF);
+	buf_free((void *)buffer, BODY_BLOCK);
+	return rc;
+}
+
+/*
+ * send_bytes - Write n body bytes to the client and append them to object,
+ *              unless object has already grown past MAX_OBJECT_SIZE.
+ *              Data that body_dst put in place is not copied again.
+ *              Also hands them to the followers of flight, if any.
+ *              Adds n to *sent. Returns -1 if the client is gone.
+ */
+static int send_bytes(int fd, char *data, size_t n, char *object, size_t *object_size, long long *sent,
+		      flight_t *flight)
+{
+	if (flight != NULL){
+		flight_body(flight, data, n);
+	}
+	if (rio_writen(fd, data, n) < 0){
+		return -1;
+	}
+	*sent += n;
+	if (object != NULL && *object_size <= MAX_OBJECT_SIZE){
+		if (*object_size + n > MAX_OBJECT_SIZE){
+			// Too big to cache; remember that it overflowed.
+			*object_size = MAX_OBJECT_SIZE + 1;
+		}else{
+			if (data != object + *object_size){
+				memcpy(object + *object_size, data, n);
+			}
+			*object_size += n;
+		}
+	}
+	return 0;
+}
+
+/*
+ * body_dst - Where to read the next n body bytes: straight to the end of
+ *            the object being collected if they fit, else into block.
+ */
+static char *body_dst(char *block, char *object, size_t object_size, size_t n)
+{
+	if (object != NULL && object_size + n <= MAX_OBJECT_SIZE){
+		return object + object_size;
+	}
+	return block;
+}
+
+/*
+ * read_block - Read up to n bytes from rp. Bytes rio has buffered come
+ *              first; after that the socket is read straight into buf,
+ *              so large blocks do not pass through the small rio buffer.
+ *              Returns the number of bytes read, 0 on EOF, -1 on error.
+ */
+static ssize_t read_block(rio_t *rp, char *buf, size_t n)
+{
+	ssize_t cnt;
+
+	if (rp->rio_cnt > 0){
+		cnt = (size_t)rp->rio_cnt < n ? (size_t)rp->rio_cnt : n;
+		memcpy(buf, rp->rio_bufptr, cnt);
+		rp->rio_bufptr += cnt;
+		rp->rio_cnt -= cnt;
+		return cnt;
+	}
+	while ((cnt = read(rp->rio_fd, buf, n)) < 0){
+		if (errno != EINTR){
+			return -1;
+		}
+	}
+	return cnt;
+}
+
+/*
+ * framing_header - Check if a header line is about the connection or the
+ *                  framing of the body. The proxy writes these itself.
+ */
+static int framing_header(char *line)
+{
+	return !strncasecmp(line, "Connection:", 11) ||
+	       !strncasecmp(line, "Proxy-Connection:", 17) ||
+	       !strncasecmp(line, "Keep-Alive:", 11) ||
+	       !strncasecmp(line, "Transfer-Encoding:", 18) ||
+	       !strncasecmp(line, "Content-Length:", 15);
+}
+
+/*
+ * cache_response - Cache a complete 200 response under key, unless
+ *                  Cache-Control forbids it. Objects are kept as the
+ *                  status line and headers without the framing ones
+ *                  (hdr, hdr_size bytes), a Content-Length, the blank
+ *                  line and the body, so that any client connection can
+ *                  be served from them.
+ */
+static void cache_response(char *key, char *hdr, size_t hdr_size, char *body, size_t body_size)
+{
+	char line[MAXLINE];
+	size_t line_size;
+	char *object;
+	time_t expires;
+
+	sprintf(line, "Content-Length: %zu\r\n\r\n", body_size);
+	line_size = strlen(line);
+	if (hdr_size + line_size + body_size > MAX_OBJECT_SIZE || (expires = expiry(hdr, hdr_size)) == 0){
+		return;
+	}
+	object = buf_alloc(MAX_OBJECT_SIZE);
+	memcpy(object, hdr, hdr_size);
+	memcpy(object + hdr_size, line, line_size);
+	memcpy(object + hdr_size + line_size, body, body_size);
+	cache_insert(key, object, hdr_size + line_size + body_size, expires);
+	buf_free(object, MAX_OBJECT_SIZE);
+}
+
+/*
+ * cache_raw_response - Cache a complete response as a server sent it.
+ *                      Only 200 responses without chunking are cached.
+ */
+void cache_raw_response(char *key, char *resp, size_t size)
+{
+	char *hdr, *p, *eol, *end = resp + size;
+	size_t hdr_size = 0;
+	int status;
+
+	if (size < 12 || size > MAX_OBJECT_SIZE || strncmp(resp, "HTTP/", 5) ||
+	    sscanf(resp, "%*s %d", &status) != 1 || status != 200){
+		return;
+	}
+	hdr = buf_alloc(MAX_OBJECT_SIZE);
+	for (p = resp; p < end; p = eol + 1){
+		if ((eol = memchr(p, '\n', end - p)) == NULL){
+			goto out;
+		}
+		if (eol - p <= 1){
+			// The blank line; the body follows.
+			cache_response(key, hdr, hdr_size, eol + 1, end - eol - 1);
+			goto out;
+		}
+		if (!strncasecmp(p, "Transfer-Encoding:", 18)){
+			goto out;
+		}
+		if (!framing_header(p)){
+			memcpy(hdr + hdr_size, p, eol + 1 - p);
+			hdr_size += eol + 1 - p;
+		}
+	}
+out:
+	buf_free(hdr, MAX_OBJECT_SIZE);
+}
+
+/*
+ * header_end - Offset of the blank line after the headers of a cached
+ *              object. Objects always hold one.
+ */
+static size_t header_end(char *data, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i + 4 <= size && memcmp(data + i, "\r\n\r\n", 4); i++)
+		;
+	return i;
+}
+
+/*
+ * send_cached - Send a cached object, adding an X-Cache header and the
+ *               Connection header that tells the client whether the
+ *               connection stays open.
+ *               Returns the number of bytes sent, or -1 if the client
+ *               is gone.
+ */
+static long long send_cached(int fd, cache_obj_t *obj, int keep_alive)
+{
+	char *conn = keep_alive ? "X-Cache: HIT\r\nConnection: keep-alive\r\n\r\n" :
+				  "X-Cache: HIT\r\nConnection: close\r\n\r\n";
+	size_t i = header_end(obj->data, obj->size);
+
+	if (rio_writen(fd, obj->data, i + 2) < 0 ||
+	    rio_writen(fd, conn, strlen(conn)) < 0 ||
+	    rio_writen(fd, obj->data + i + 4, obj->size - i - 4) < 0){
+		return -1;
+	}
+	return obj->size - 2 + strlen(conn);
+}
+
+/*
+ * send_disk - Send an object from the disk cache like send_cached, but
+ *             with the body going from the segment file to the socket
+ *             by sendfile, without passing through user space.
+ */
+static long long send_disk(int fd, disk_obj_t *dobj, int keep_alive)
+{
+	char *conn = keep_alive ? "X-Cache: HIT-DISK\r\nConnection: keep-alive\r\n\r\n" :
+				  "X-Cache: HIT-DISK\r\nConnection: close\r\n\r\n";
+	size_t i = header_end(dobj->data, dobj->size);
+	off_t off = dobj->offset + i + 4;
+	size_t left = dobj->size - i - 4;
+	ssize_t n;
+
+	if (rio_writen(fd, dobj->data, i + 2) < 0 || rio_writen(fd, conn, strlen(conn)) < 0){
+		return -1;
+	}
+	while (left > 0){
+		if ((n = sendfile(fd, dobj->fd, &off, left)) <= 0){
+			if (n < 0 && errno == EINTR){
+				continue;
+			}
+			return -1;
+		}
+		left -= n;
+	}
+	return dobj->size - 2 + strlen(conn);
+}
+
+/*
+ * stats_page - Write a complete response with the statistics of the
+ *              proxy into buf, cut short to fit in size bytes.
+ *              Returns its length.
+ */
+size_t stats_page(char *buf, size_t size, int keep_alive)
+{
+	char hdr[STATS_HEADER];
+	char *body = buf + STATS_HEADER;
+	size_t n, len, max = size - STATS_HEADER;
+	unsigned long hits, misses, disk_hits, objects;
+
+	// The body is made first, after room for the header that gives
+	// its length.
+	n = stats_render(body, max);
+	dnscache_stats(&hits, &misses);
+	diskcache_stats(&disk_hits, &objects);
+	n += snprintf(body + n, max - n,
+		      "# TYPE proxy_cache_evictions_total counter\nproxy_cache_evictions_total %lu\n"
+		      "# TYPE proxy_dns_hits_total counter\nproxy_dns_hits_total %lu\n"
+		      "# TYPE proxy_disk_objects gauge\nproxy_disk_objects %lu\n"
+		      "# TYPE proxy_log_dropped_total counter\nproxy_log_dropped_total %lu\n",
+		      cache_evictions(), hits, objects, log_dropped());
+	if (n >= max){
+		n = max - 1;
+	}
+	len = snprintf(hdr, STATS_HEADER, "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		      "Content-Length: %zu\r\nCache-Control: no-store\r\nConnection: %s\r\n\r\n",
+		      n, keep_alive ? "keep-alive" : "close");
+	memmove(buf + len, body, n);
+	memcpy(buf, hdr, len);
+	return len + n;
+}
+
+/*
+ * send_stats - Send the statistics page. Returns the bytes sent, or -1.
+ */
+static long long send_stats(int fd, int keep_alive)
+{
+	char *buf = buf_alloc(MAXBUF);
+	size_t n = stats_page(buf, MAXBUF, keep_alive);
+	int rc = rio_writen(fd, buf, n);
+
+	buf_free(buf, MAXBUF);
+	return rc < 0 ? -1 : (long long)n;
+}
+
+/*
+ * header_value - Copy the value of the first header called name among the
+ *                size bytes of header lines at hdr into value, at most
+ *                max bytes with the NUL, without the leading spaces and
+ *                the line end. Returns 0 if there is no such header.
+ */
+static int header_value(char *hdr, size_t size, char *name, char *value, size_t max)
+{
+	char *p, *eol, *end = hdr + size;
+	size_t len = strlen(name), n;
+
+	for (p = hdr; p < end && (eol = memchr(p, '\n', end - p)) != NULL; p = eol + 1){
+		if (eol - p <= (long)len || p[len] != ':' || strncasecmp(p, name, len)){
+			continue;
+		}
+		for (p += len + 1; p < eol && (*p == ' ' || *p == '\t'); p++)
+			;
+		n = eol - p;
+		if (n > 0 && p[n - 1] == '\r'){
+			n--;
+		}
+		if (n >= max){
+			n = max - 1;
+		}
+		memcpy(value, p, n);
+		value[n] = '\0';
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * max_age - Seconds a response with these headers stays fresh, as its
+ *           Cache-Control says: s-maxage, or else max-age, and 0 for
+ *           no-cache, so that every use asks the server first.
+ *           AGE_NO_STORE if it says no-store or private, and AGE_UNSET
+ *           if it says nothing about it.
+ */
+static long max_age(char *hdr, size_t size)
+{
+	char value[MAXLINE], *p;
+
+	if (!header_value(hdr, size, "Cache-Control", value, MAXLINE)){
+		return AGE_UNSET;
+	}
+	if (has_word(value, "no-store") || has_word(value, "private")){
+		return AGE_NO_STORE;
+	}
+	if (has_word(value, "no-cache")){
+		return 0;
+	}
+	if ((p = find_word(value, "s-maxage=")) != NULL){
+		return atol(p + 9);
+	}
+	if ((p = find_word(value, "max-age=")) != NULL){
+		return atol(p + 8);
+	}
+	return AGE_UNSET;
+}
+
+/*
+ * expiry - When a response with these headers, received now, stops
+ *          being fresh, or 0 if it must not be cached. Responses that
+ *          do not say stay fresh for DEFAULT_MAX_AGE seconds.
+ */
+static time_t expiry(char *hdr, size_t size)
+{
+	long age = max_age(hdr, size);
+
+	if (age == AGE_NO_STORE){
+		return 0;
+	}
+	return time(NULL) + (age == AGE_UNSET ? DEFAULT_MAX_AGE : age);
 }
 
 /*
- * sigchld_handler - Reap the terminated child processes.
+ * conditional_headers - Put the If-None-Match and If-Modified-Since
+ *                       headers that revalidate obj in cond (MAXLINE
+ *                       bytes). Returns 0 if obj has neither an ETag
+ *                       nor a Last-Modified to revalidate with.
  */
-void sigchld_handler(int sig)
+static int conditional_headers(cache_obj_t *obj, char *cond)
 {
-	while (waitpid(-1, 0, WNOHANG) > 0){
+	char value[MAXLINE / 2 - 32];
+	size_t size = header_end(obj->data, obj->size) + 2;
+
+	cond[0] = '\0';
+	if (header_value(obj->data, size, "ETag", value, sizeof(value))){
+		sprintf(cond, "If-None-Match: %s\r\n", value);
+	}
+	if (header_value(obj->data, size, "Last-Modified", value, sizeof(value))){
+		sprintf(cond + strlen(cond), "If-Modified-Since: %s\r\n", value);
+	}
+	return cond[0] != '\0';
+}
+
+/*
+ * find_word - Where word first appears in s, ignoring case, or NULL.
+ */
+static char *find_word(char *s, char *word)
+{
+	size_t n = strlen(word);
+
+	for (; *s; s++){
+		if (!strncasecmp(s, word, n)){
+			return s;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * has_word - Check if s contains word, ignoring case.
+ */
+static int has_word(char *s, char *word)
+{
+	return find_word(s, word) != NULL;
+}
+
+/*
+ * sigusr1_handler - Report how many buffers the workers had to malloc
+ *                   for the requests served so far. Once every worker
+ *                   has warmed up its pool the count stops growing.
+ *                   Also reports dropped log lines, DNS cache hits,
+ *                   requests that followed another's fetch and disk
+ *                   cache hits.
+ */
+void sigusr1_handler(int sig)
+{
+	unsigned long hits, misses, objects;
+
+	Sio_puts("requests ");
+	Sio_putl(nrequests);
+	Sio_puts(", buffer mallocs ");
+	Sio_putl(bufpool_mallocs());
+	Sio_puts(", log lines dropped ");
+	Sio_putl(log_dropped());
+	dnscache_stats(&hits, &misses);
+	Sio_puts(", dns hits ");
+	Sio_putl(hits);
+	Sio_puts(", dns misses ");
+	Sio_putl(misses);
+	Sio_puts(", coalesced ");
+	Sio_putl(flight_coalesced());
+	diskcache_stats(&hits, &objects);
+	Sio_puts(", disk hits ");
+	Sio_putl(hits);
+	Sio_puts(", disk objects ");
+	Sio_putl(objects);
+	Sio_puts("\n");
+}
+
+/*
+ * sigterm_handler - Start draining the process (see drainer).
+ */
+void sigterm_handler(int sig)
+{
+	sem_post(&drain_sem);
+}
+
+/*
+ * drainer - Thread that drains the process once SIGTERM comes: the
+ *           listening socket (vargp) is shut down, which takes it out of
+ *           its SO_REUSEPORT group so the kernel sends new connections to
+ *           the other workers, and the process exits when the connections
+ *           it has are done, or after DRAIN_TIMEOUT seconds. Persistent
+ *           connections are closed after the request they are on.
+ */
+static void *drainer(void *vargp)
+{
+	int listenfd = (int)(long)vargp;
+	double deadline;
+
+	Pthread_detach(pthread_self());
+	while (sem_wait(&drain_sem) < 0)
 		;
+	draining = 1;
+	log_msg(LOG_INFO, "draining %ld connections", stats_get(STAT_ACTIVE));
+	shutdown(listenfd, SHUT_RD);
+	deadline = log_ms() + DRAIN_TIMEOUT * 1000;
+	while (stats_get(STAT_ACTIVE) > 0 && log_ms() < deadline){
+		usleep(DRAIN_POLL_US);
 	}
-	return;
+	log_msg(LOG_INFO, "drained, %ld connections left", stats_get(STAT_ACTIVE));
+	log_flush();
+	exit(0);
 }
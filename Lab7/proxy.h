@@ -0,0 +1,30 @@
+/*
+ * proxy.h - Limits and request helpers shared by the proxy engines
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include <stddef.h>
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+#define MAX_LINE 8192
+
+/* Longest host name, port and request uri the proxy takes; longer ones
+ * get a 400 (host, port) or a 414 (uri) */
+#define MAX_HOST 255
+#define MAX_PORT 5
+#define MAX_URI 4096
+
+/* URI that returns the proxy's statistics instead of an object */
+#define STATS_URI "/__stats"
+
+int parse_uri(char *uri, char *host, char *port, char *path);
+void make_key(char *key, char *host, char *port, char *path);
+void http_request(char *server_request, char *method, char *uri, char *version);
+int http_header(char *host_name, char *header, size_t size);
+void cache_raw_response(char *key, char *resp, size_t size);
+size_t stats_page(char *buf, size_t size, int keep_alive);
+
+#endif /* __PROXY_H__ */
@@ -0,0 +1,117 @@
+/*
+ * relay.c - Move body bytes from one socket to another.
+ *           relay_splice moves them through a pipe with splice(2), so the
+ *           data never enters user space. Each thread keeps its own pipe.
+ *           relay_copy is the plain read/write loop, kept for bodies
+ *           that must also be looked at and for comparison.
+ *           This file does not include csapp.h: splice needs _GNU_SOURCE,
+ *           which clashes with the gai_error declared there.
+ */
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include "relay.h"
+
+#define PIPE_SIZE (1 << 20)   /* asked for; the kernel may give less */
+
+static __thread int relay_pipe[2] = {-1, -1};
+
+/*
+ * pipe_close - Throw away the pipe of this thread, together with any
+ *              bytes a failed relay left in it.
+ */
+static void pipe_close(void)
+{
+	close(relay_pipe[0]);
+	close(relay_pipe[1]);
+	relay_pipe[0] = relay_pipe[1] = -1;
+}
+
+/*
+ * relay_splice - Move length bytes from the socket from to the socket to,
+ *                or everything up to EOF if length is negative.
+ *                Returns the number of bytes moved, or -1 on error or
+ *                if from ends early.
+ */
+long long relay_splice(int from, int to, long long length)
+{
+	ssize_t n, m;
+	size_t want;
+	long long moved = 0;
+
+	if (relay_pipe[0] < 0){
+		if (pipe(relay_pipe) < 0){
+			return -1;
+		}
+		fcntl(relay_pipe[1], F_SETPIPE_SZ, PIPE_SIZE);
+	}
+	while (length != 0){
+		want = (length < 0 || length > PIPE_SIZE) ? PIPE_SIZE : length;
+		n = splice(from, NULL, relay_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if (n < 0 && errno == EINTR){
+			continue;
+		}
+		if (n <= 0){
+			if (n == 0 && length < 0){
+				return moved;
+			}
+			pipe_close();
+			return -1;
+		}
+		if (length > 0){
+			length -= n;
+		}
+		moved += n;
+		// Empty the pipe before filling it again.
+		while (n > 0){
+			m = splice(relay_pipe[0], NULL, to, NULL, n, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (m < 0 && errno == EINTR){
+				continue;
+			}
+			if (m <= 0){
+				pipe_close();
+				return -1;
+			}
+			n -= m;
+		}
+	}
+	return moved;
+}
+
+/*
+ * relay_copy - Same as relay_splice, copying through buf of size bytes.
+ */
+long long relay_copy(int from, int to, long long length, char *buf, size_t size)
+{
+	ssize_t n, m;
+	size_t want;
+	long long moved = 0;
+	char *p;
+
+	while (length != 0){
+		want = (length < 0 || length > size) ? size : length;
+		n = read(from, buf, want);
+		if (n < 0 && errno == EINTR){
+			continue;
+		}
+		if (n <= 0){
+			return (n == 0 && length < 0) ? moved : -1;
+		}
+		if (length > 0){
+			length -= n;
+		}
+		moved += n;
+		for (p = buf; n > 0; p += m, n -= m){
+			if ((m = write(to, p, n)) < 0){
+				if (errno == EINTR){
+					m = 0;
+					continue;
+				}
+				return -1;
+			}
+		}
+	}
+	return moved;
+}
@@ -0,0 +1,10 @@
+/*
+ * relay.h - Move body bytes between sockets
+ */
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+long long relay_splice(int from, int to, long long length);
+long long relay_copy(int from, int to, long long length, char *buf, size_t size);
+
+#endif /* __RELAY_H__ */
@@ -0,0 +1,182 @@
+/*
+ * relaybench.c - Compare ways of relaying a response body between sockets.
+ *
+ * An origin thread writes size MB over a loopback TCP connection, the
+ * main thread relays them to a second connection, and a client thread
+ * reads them. The relay is one of
+ *   line    rio_readlineb, printf and rio_writen per line (the old
+ *           forward_response)
+ *   copy    read/write through a MAXLINE buffer (relay_copy)
+ *   splice  socket -> pipe -> socket with splice(2) (relay_splice)
+ * Each mode runs several times and the best MB/s is reported.
+ *
+ * usage: relaybench [-s MB] [-r runs]
+ */
+#include "csapp.h"
+#include "relay.h"
+
+#define MB (1024 * 1024)
+
+static long long total;    /* bytes the origin sends */
+
+/*
+ * origin - Send total bytes of binary data with a newline now and then,
+ *          then close.
+ */
+static void *origin(void *vargp)
+{
+	int fd = *(int *)vargp;
+	char buf[65536];
+	long long left = total;
+	size_t i, n;
+
+	for (i = 0; i < sizeof(buf); i++){
+		buf[i] = (i % 97 == 96) ? '\n' : (char)(i * 31);
+	}
+	while (left > 0){
+		n = left < (long long)sizeof(buf) ? left : sizeof(buf);
+		if (rio_writen(fd, buf, n) < 0){
+			break;
+		}
+		left -= n;
+	}
+	Close(fd);
+	return NULL;
+}
+
+/*
+ * client - Read everything and count it.
+ */
+static void *client(void *vargp)
+{
+	int fd = *(int *)vargp;
+	char buf[65536];
+	ssize_t n;
+	long long got = 0;
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0){
+		got += n;
+	}
+	if (got != total){
+		fprintf(stderr, "relaybench: client got %lld of %lld bytes\n", got, total);
+		exit(1);
+	}
+	Close(fd);
+	return NULL;
+}
+
+/*
+ * connect_pair - Make a loopback connection. *near is the accepted end,
+ *                *far the connecting end.
+ */
+static void connect_pair(int *near, int *far)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	char port[16];
+	int listenfd;
+
+	listenfd = Open_listenfd("0");
+	if (getsockname(listenfd, (SA *)&addr, &len) < 0){
+		unix_error("getsockname error");
+	}
+	sprintf(port, "%d", ntohs(addr.sin_port));
+	*far = Open_clientfd("localhost", port);
+	*near = Accept(listenfd, NULL, NULL);
+	Close(listenfd);
+}
+
+/*
+ * relay_lines - The old forward_response loop.
+ */
+static int relay_lines(int from, int to, FILE *devnull)
+{
+	rio_t rio;
+	char buf[MAXLINE];
+	ssize_t n;
+
+	Rio_readinitb(&rio, from);
+	while ((n = rio_readlineb(&rio, buf, MAXLINE)) > 0){
+		fprintf(devnull, "%s", buf);
+		if (rio_writen(to, buf, n) < 0){
+			return -1;
+		}
+	}
+	return n;
+}
+
+/*
+ * run - Relay total bytes once in the given mode. Returns MB/s.
+ */
+static double run(char *mode, FILE *devnull)
+{
+	int from, origin_fd, to, client_fd;
+	pthread_t otid, ctid;
+	struct timeval start, end;
+	char buf[MAXLINE];
+	double secs;
+	long long rc;
+
+	connect_pair(&from, &origin_fd);
+	connect_pair(&to, &client_fd);
+	gettimeofday(&start, NULL);
+	Pthread_create(&otid, NULL, origin, &origin_fd);
+	Pthread_create(&ctid, NULL, client, &client_fd);
+	if (!strcmp(mode, "line")){
+		rc = relay_lines(from, to, devnull);
+	}else if (!strcmp(mode, "copy")){
+		rc = relay_copy(from, to, -1, buf, sizeof(buf));
+	}else{
+		rc = relay_splice(from, to, -1);
+	}
+	if (rc < 0){
+		fprintf(stderr, "relaybench: %s relay failed\n", mode);
+		exit(1);
+	}
+	Close(from);
+	Close(to);
+	Pthread_join(otid, NULL);
+	Pthread_join(ctid, NULL);
+	gettimeofday(&end, NULL);
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	return total / secs / MB;
+}
+
+int main(int argc, char **argv)
+{
+	char *modes[] = {"line", "copy", "splice"};
+	FILE *devnull;
+	double best, mbs;
+	int runs = 5;
+	int c, i, r;
+
+	total = 256LL * MB;
+	while ((c = getopt(argc, argv, "s:r:")) != -1){
+		switch (c){
+		case 's':
+			total = atoll(optarg) * MB;
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-s MB] [-r runs]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if ((devnull = fopen("/dev/null", "w")) == NULL){
+		unix_error("fopen error");
+	}
+	printf("%-8s %10s   (%lld MB, best of %d)\n", "mode", "MB/s", total / MB, runs);
+	for (i = 0; i < 3; i++){
+		best = 0;
+		for (r = 0; r < runs; r++){
+			if ((mbs = run(modes[i], devnull)) > best){
+				best = mbs;
+			}
+		}
+		printf("%-8s %10.1f\n", modes[i], best);
+	}
+	fclose(devnull);
+	return 0;
+}
@@ -0,0 +1,312 @@
+/*
+ * slowloris.c - Check that the proxy keeps serving while thousands of slow
+ *               clients hold connections to it.
+ *
+ * First nclients client threads fetch url through the proxy over and over,
+ * one HTTP/1.0 request per connection, for the given seconds; that is the
+ * baseline. Then nconns slow connections are opened from the source
+ * address (-b), each sending its request head one byte per interval and
+ * never finishing it, and reopened whenever the proxy closes them, as a
+ * slowloris attack does. The clients fetch for the same time again.
+ * Prints requests per second both times, and what became of the slow
+ * connections: how many were open at the end, how many the proxy timed
+ * out (408 or closed) and how many it refused (503).
+ *
+ * The slow connections come from another address than the clients, so the
+ * per-address cap of the proxy applies to them alone:
+ *   (cd tiny && ./tiny 15213) &
+ *   ./proxy -e 15214 &
+ *   ./slowloris -c 5000 localhost 15214 http://localhost:15213/home.html
+ *
+ * usage: slowloris [-c conns] [-i interval ms] [-b source addr] [-t seconds]
+ *                  [-n clients] <proxy host> <proxy port> <url>
+ */
+#include "csapp.h"
+#include <poll.h>
+#include <sys/resource.h>
+
+#define RAMP 3                     /* seconds given to open the slow connections */
+#define TICK_MS 50                 /* how often the slow connections are served */
+
+static char *proxy_host, *proxy_port, *url;
+static volatile int running;
+
+/* What the slow connections send: head, then filler forever */
+static char head[MAXLINE];
+static char filler[] = "X-Slow: 1\r\n";
+
+typedef struct {
+	long requests;
+	long errors;
+} result_t;
+
+typedef struct {
+	int fd;                    /* -1 if closed */
+	size_t sent;               /* bytes of the head sent */
+} slow_t;
+
+/* What became of the slow connections */
+static int nconns = 1000, interval = 1000;
+static char *source = "127.0.0.2";
+static int opened, timed_out, refused, failed;
+
+/*
+ * now - Seconds on the monotonic clock.
+ */
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * fetch - Fetch url once on a new connection and read the response to
+ *         its end. Returns 0 on success, -1 on error.
+ */
+static int fetch(void)
+{
+	char buf[MAXLINE];
+	ssize_t n;
+	int fd;
+
+	if ((fd = open_clientfd(proxy_host, proxy_port)) < 0){
+		return -1;
+	}
+	sprintf(buf, "GET %s HTTP/1.0\r\nHost: bench\r\n\r\n", url);
+	if (rio_writen(fd, buf, strlen(buf)) < 0 || (n = read(fd, buf, MAXLINE)) < 12 || strncmp(buf + 9, "200", 3)){
+		Close(fd);
+		return -1;
+	}
+	while ((n = read(fd, buf, MAXLINE)) > 0)
+		;
+	Close(fd);
+	return n < 0 ? -1 : 0;
+}
+
+/*
+ * client - Thread routine: fetch url until running is cleared.
+ */
+static void *client(void *vargp)
+{
+	result_t *res = (result_t *)vargp;
+
+	while (running){
+		if (fetch() < 0){
+			res->errors++;
+		}else{
+			res->requests++;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * measure - Run nclients clients for secs seconds. Returns requests per
+ *           second, and adds the errors to *errors.
+ */
+static double measure(int nclients, int secs, long *errors)
+{
+	pthread_t *tids = Malloc(nclients * sizeof(pthread_t));
+	result_t *res = Calloc(nclients, sizeof(result_t));
+	long requests = 0;
+	double start;
+	int i;
+
+	running = 1;
+	start = now();
+	for (i = 0; i < nclients; i++){
+		Pthread_create(&tids[i], NULL, client, &res[i]);
+	}
+	sleep(secs);
+	running = 0;
+	for (i = 0; i < nclients; i++){
+		Pthread_join(tids[i], NULL);
+		requests += res[i].requests;
+		*errors += res[i].errors;
+	}
+	Free(tids);
+	Free(res);
+	return requests / (now() - start);
+}
+
+/*
+ * slow_open - Start connecting s to the proxy from the source address.
+ */
+static void slow_open(slow_t *s, struct addrinfo *proxy, struct sockaddr_in *from)
+{
+	s->sent = 0;
+	if ((s->fd = socket(proxy->ai_family, SOCK_STREAM, 0)) < 0){
+		failed++;
+		return;
+	}
+	fcntl(s->fd, F_SETFL, fcntl(s->fd, F_GETFL) | O_NONBLOCK);
+	if (bind(s->fd, (SA *)from, sizeof(*from)) < 0 ||
+	    (connect(s->fd, proxy->ai_addr, proxy->ai_addrlen) < 0 && errno != EINPROGRESS)){
+		close(s->fd);
+		s->fd = -1;
+		failed++;
+		return;
+	}
+	opened++;
+}
+
+/*
+ * slow_close - The proxy answered or closed s; count what it did.
+ */
+static void slow_close(slow_t *s)
+{
+	char buf[MAXLINE];
+	ssize_t n;
+
+	n = recv(s->fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+	if (n >= 12 && !strncmp(buf + 9, "503", 3)){
+		refused++;
+	}else{
+		timed_out++;
+	}
+	close(s->fd);
+	s->fd = -1;
+}
+
+/*
+ * slow_send - Send s's next byte of head, or of filler once the head is
+ *             out, so its request never ends.
+ */
+static void slow_send(slow_t *s)
+{
+	size_t len = strlen(head);
+	char c;
+
+	c = s->sent < len ? head[s->sent] : filler[(s->sent - len) % strlen(filler)];
+	if (send(s->fd, &c, 1, MSG_NOSIGNAL) == 1){
+		s->sent++;
+	}else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTCONN){
+		slow_close(s);
+	}
+}
+
+/*
+ * attack - Thread routine: keep nconns slow connections open until the
+ *          int vargp points to is cleared. The connections are spread over the
+ *          interval, and a closed one is reopened in its next turn.
+ */
+static void *attack(void *vargp)
+{
+	struct addrinfo hints, *proxy;
+	struct sockaddr_in from;
+	struct pollfd *fds = Malloc(nconns * sizeof(struct pollfd));
+	slow_t *slow = Malloc(nconns * sizeof(slow_t));
+	double tick = now();
+	int i, turn = 0, per_tick;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	Getaddrinfo(proxy_host, proxy_port, &hints, &proxy);
+	memset(&from, 0, sizeof(from));
+	from.sin_family = AF_INET;
+	if (inet_pton(AF_INET, source, &from.sin_addr) != 1){
+		app_error("bad source address");
+	}
+	for (i = 0; i < nconns; i++){
+		slow[i].fd = -1;
+	}
+	// Each tick takes its share of the connections, so every one has a
+	// turn per interval.
+	per_tick = (long)nconns * TICK_MS / interval + 1;
+	while (*(volatile int *)vargp){
+		for (i = 0; i < per_tick; i++, turn = (turn + 1) % nconns){
+			if (slow[turn].fd < 0){
+				slow_open(&slow[turn], proxy, &from);
+			}else{
+				slow_send(&slow[turn]);
+			}
+		}
+		for (i = 0; i < nconns; i++){
+			fds[i].fd = slow[i].fd;
+			fds[i].events = POLLIN;
+		}
+		tick += TICK_MS / 1e3;
+		if (poll(fds, nconns, tick > now() ? (int)((tick - now()) * 1000) : 0) > 0){
+			for (i = 0; i < nconns; i++){
+				if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)){
+					slow_close(&slow[i]);
+				}
+			}
+		}
+	}
+	for (i = 0; i < nconns; i++){
+		if (slow[i].fd >= 0){
+			close(slow[i].fd);
+		}
+	}
+	Freeaddrinfo(proxy);
+	Free(fds);
+	Free(slow);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	int nclients = 4, secs = 10, attacking = 1;
+	long base_errors = 0, errors = 0;
+	double base, during;
+	struct rlimit rl;
+	pthread_t tid;
+	int c, still_open;
+
+	while ((c = getopt(argc, argv, "c:i:b:t:n:")) != -1){
+		switch (c){
+		case 'c':
+			nconns = atoi(optarg);
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		case 'b':
+			source = optarg;
+			break;
+		case 't':
+			secs = atoi(optarg);
+			break;
+		case 'n':
+			nclients = atoi(optarg);
+			break;
+		default:
+			nclients = 0;
+			break;
+		}
+	}
+	if (argc - optind != 3 || nconns <= 0 || interval <= 0 || secs <= 0 || nclients <= 0){
+		fprintf(stderr, "usage: %s [-c conns] [-i interval ms] [-b source addr] [-t seconds] "
+			"[-n clients] <proxy host> <proxy port> <url>\n", argv[0]);
+		exit(1);
+	}
+	proxy_host = argv[optind];
+	proxy_port = argv[optind + 1];
+	url = argv[optind + 2];
+	snprintf(head, sizeof(head), "GET %s HTTP/1.1\r\nHost: slow\r\n", url);
+	Signal(SIGPIPE, SIG_IGN);
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0){
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	base = measure(nclients, secs, &base_errors);
+	printf("baseline      %8.0f requests/s  %ld errors\n", base, base_errors);
+
+	Pthread_create(&tid, NULL, attack, &attacking);
+	sleep(RAMP);
+	during = measure(nclients, secs, &errors);
+	// Count the connections still open before the attack is called off.
+	still_open = opened - timed_out - refused;
+	attacking = 0;
+	Pthread_join(tid, NULL);
+	printf("%d slow conns %8.0f requests/s  %ld errors  (%.0f%% of baseline)\n",
+		nconns, during, errors, base > 0 ? 100 * during / base : 0.0);
+	printf("slow connections: %d open at the end, %d opened, %d timed out, %d refused, %d failed\n",
+		still_open, opened, timed_out, refused, failed);
+	return 0;
+}
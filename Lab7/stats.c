@@ -0,0 +1,194 @@
+/*
+ * stats.c - Counters and latency histograms of the proxy.
+ *           Every thread that records gets its own set, like the log
+ *           rings (see log.c). Only the owner writes to a set, with
+ *           plain relaxed stores, so recording takes no lock and no
+ *           atomic read-modify-write; readers add up all the sets and
+ *           may see a recording a little late.
+ *           A histogram has HIST_SUB buckets per power of two of
+ *           microseconds, so a percentile read from it is within 25%
+ *           of the true value at any scale.
+ *           stats_render writes everything out in the Prometheus text
+ *           format: counters as <name>_total, and each stage as a
+ *           summary with a few quantiles in seconds.
+ */
+#include "csapp.h"
+#include "stats.h"
+
+#define HIST_SUB 4                 /* buckets per power of two */
+#define HIST_BUCKETS 144           /* up to 2^36 us, about 19 hours */
+
+typedef struct stats_set {
+	long counters[NSTATS];
+	unsigned long hist[NSTAGES][HIST_BUCKETS];
+	unsigned long long sum_us[NSTAGES];
+	struct stats_set *next;    /* list of all sets */
+} stats_set_t;
+
+static stats_set_t *sets;          /* never shrinks; threads live forever */
+static sem_t sets_mutex;           /* serializes adding sets */
+static __thread stats_set_t *my_set;
+
+static char *stage_names[NSTAGES] = {
+	"queue", "parse", "dns", "connect", "first_byte", "transfer", "total"
+};
+static char *stat_names[NSTATS] = {
+	"connections", "active_connections", "requests", "errors", "cache_hits",
+	"cache_disk_hits", "cache_misses", "cache_revalidated", "cache_coalesced",
+	"bytes_in", "bytes_out", "upstream_connects", "upstream_reused", "connections_refused",
+	"header_timeouts"
+};
+static double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+/*
+ * stats_init - Call once before any thread records.
+ */
+void stats_init(void)
+{
+	Sem_init(&sets_mutex, 0, 1);
+}
+
+/*
+ * set_get - Return the set of this thread, making it on first use.
+ */
+static stats_set_t *set_get(void)
+{
+	stats_set_t *s;
+
+	if ((s = my_set) != NULL){
+		return s;
+	}
+	s = Calloc(1, sizeof(stats_set_t));
+	P(&sets_mutex);
+	s->next = sets;
+	__atomic_store_n(&sets, s, __ATOMIC_RELEASE);
+	V(&sets_mutex);
+	my_set = s;
+	return s;
+}
+
+/*
+ * bucket - Histogram bucket of us microseconds.
+ */
+static int bucket(unsigned long long us)
+{
+	int bits, b;
+
+	if (us < HIST_SUB){
+		return us;
+	}
+	// The top three bits pick the bucket: the leading one gives the
+	// power of two and the next two the quarter of it.
+	bits = 64 - __builtin_clzll(us);
+	b = (bits - 2) * HIST_SUB + ((us >> (bits - 3)) & (HIST_SUB - 1));
+	return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+/*
+ * bucket_top - Largest number of microseconds in bucket b.
+ */
+static double bucket_top(int b)
+{
+	int shift;
+
+	if (b < HIST_SUB){
+		return b;
+	}
+	shift = b / HIST_SUB - 1;
+	return (double)((unsigned long long)(HIST_SUB + b % HIST_SUB + 1) << shift) - 1;
+}
+
+/*
+ * stats_add - Add n to a counter.
+ */
+void stats_add(int stat, long n)
+{
+	stats_set_t *s = set_get();
+
+	__atomic_store_n(&s->counters[stat], s->counters[stat] + n, __ATOMIC_RELAXED);
+}
+
+/*
+ * stats_get - Total of a counter over all threads.
+ */
+long stats_get(int stat)
+{
+	stats_set_t *s;
+	long total = 0;
+
+	for (s = __atomic_load_n(&sets, __ATOMIC_ACQUIRE); s != NULL; s = s->next){
+		total += __atomic_load_n(&s->counters[stat], __ATOMIC_RELAXED);
+	}
+	return total;
+}
+
+/*
+ * stats_time - Record that a stage took ms milliseconds.
+ */
+void stats_time(int stage, double ms)
+{
+	stats_set_t *s = set_get();
+	unsigned long long us = ms > 0 ? (unsigned long long)(ms * 1000) : 0;
+	int b = bucket(us);
+
+	__atomic_store_n(&s->hist[stage][b], s->hist[stage][b] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->sum_us[stage], s->sum_us[stage] + us, __ATOMIC_RELAXED);
+}
+
+/*
+ * stats_render - Write the counters and the stage summaries of all
+ *                threads into buf as Prometheus text. Returns the length,
+ *                which is cut short to fit in size bytes.
+ */
+size_t stats_render(char *buf, size_t size)
+{
+	unsigned long hist[HIST_BUCKETS];
+	stats_set_t *s;
+	long total;
+	unsigned long count, seen;
+	unsigned long long sum;
+	size_t n = 0;
+	int i, b, q;
+
+	for (i = 0; i < NSTATS && n < size; i++){
+		total = stats_get(i);
+		if (i == STAT_ACTIVE){
+			n += snprintf(buf + n, size - n, "# TYPE proxy_%s gauge\nproxy_%s %ld\n",
+				      stat_names[i], stat_names[i], total);
+		}else{
+			n += snprintf(buf + n, size - n, "# TYPE proxy_%s_total counter\nproxy_%s_total %ld\n",
+				      stat_names[i], stat_names[i], total);
+		}
+	}
+	if (n < size){
+		n += snprintf(buf + n, size - n, "# TYPE proxy_stage_seconds summary\n");
+	}
+	for (i = 0; i < NSTAGES && n < size; i++){
+		memset(hist, 0, sizeof(hist));
+		count = 0;
+		sum = 0;
+		for (s = __atomic_load_n(&sets, __ATOMIC_ACQUIRE); s != NULL; s = s->next){
+			for (b = 0; b < HIST_BUCKETS; b++){
+				hist[b] += __atomic_load_n(&s->hist[i][b], __ATOMIC_RELAXED);
+			}
+			sum += __atomic_load_n(&s->sum_us[i], __ATOMIC_RELAXED);
+		}
+		for (b = 0; b < HIST_BUCKETS; b++){
+			count += hist[b];
+		}
+		// The quantile is the top of the bucket it falls in.
+		for (q = 0, b = 0, seen = 0; q < sizeof(quantiles) / sizeof(quantiles[0]) && n < size; q++){
+			for (; b < HIST_BUCKETS && (seen == 0 || seen < quantiles[q] * count); b++){
+				seen += hist[b];
+			}
+			n += snprintf(buf + n, size - n, "proxy_stage_seconds{stage=\"%s\",quantile=\"%g\"} %.6f\n",
+				      stage_names[i], quantiles[q], count ? bucket_top(b - 1) / 1e6 : 0.0);
+		}
+		if (n < size){
+			n += snprintf(buf + n, size - n, "proxy_stage_seconds_sum{stage=\"%s\"} %.6f\n"
+				      "proxy_stage_seconds_count{stage=\"%s\"} %lu\n",
+				      stage_names[i], sum / 1e6, stage_names[i], count);
+		}
+	}
+	return n < size ? n : size - 1;
+}
@@ -0,0 +1,43 @@
+/*
+ * stats.h - Per-thread counters and latency histograms
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stddef.h>
+
+/* Stages of serving a request that are timed */
+#define STAGE_QUEUE 0              /* accepted until a worker takes it */
+#define STAGE_PARSE 1              /* request line until the end of the headers */
+#define STAGE_DNS 2                /* looking up the server */
+#define STAGE_CONNECT 3            /* connecting to the server */
+#define STAGE_FIRST_BYTE 4         /* request sent until the status line */
+#define STAGE_TRANSFER 5           /* status line until the response ends */
+#define STAGE_TOTAL 6              /* request line until the response ends */
+#define NSTAGES 7
+
+/* Counters */
+#define STAT_CONNECTIONS 0         /* client connections accepted */
+#define STAT_ACTIVE 1              /* client connections open; a gauge */
+#define STAT_REQUESTS 2
+#define STAT_ERRORS 3              /* requests answered with nothing or a 5xx */
+#define STAT_HITS 4                /* served from memory */
+#define STAT_DISK_HITS 5           /* served from the disk tier */
+#define STAT_MISSES 6              /* fetched from the server */
+#define STAT_REVALIDATED 7         /* stale copies the server said are current */
+#define STAT_COALESCED 8           /* served from another request's fetch */
+#define STAT_BYTES_IN 9            /* request bytes from clients */
+#define STAT_BYTES_OUT 10          /* response bytes to clients */
+#define STAT_UPSTREAM_NEW 11       /* connections opened to servers */
+#define STAT_UPSTREAM_REUSED 12    /* pooled connections used again */
+#define STAT_REFUSED 13            /* client connections over a cap (see guard.c) */
+#define STAT_HEADER_TIMEOUTS 14    /* request heads that did not arrive in time */
+#define NSTATS 15
+
+void stats_init(void);
+void stats_add(int stat, long n);
+long stats_get(int stat);
+void stats_time(int stage, double ms);
+size_t stats_render(char *buf, size_t size);
+
+#endif /* __STATS_H__ */
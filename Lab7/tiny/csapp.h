@@ -194,6 +194,11 @@ int open_listenfd(char *port);
 int Open_clientfd(char *hostname, char *port);
 int Open_listenfd(char *port);
 
+/* Multi-process servers: one SO_REUSEPORT listener per worker */
+int open_reuseport_listenfd(char *port);
+int Open_reuseport_listenfd(char *port);
+int supervise(int nworkers);
+
 
 #endif /* __CSAPP_H__ */
 /* $end csapp.h */
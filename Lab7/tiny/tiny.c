@@ -2,35 +2,57 @@
 /*
  * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
  *     GET method to serve static and dynamic content.
+ *
+ *     "tiny -w n <port>" runs n copies of it (one per CPU for -w 0),
+ *     each with a SO_REUSEPORT socket of its own, under a supervisor
+ *     that restarts them and replaces them on SIGHUP (see supervise in
+ *     csapp.c). SIGTERM makes tiny finish its connection and exit.
  */
 #include "csapp.h"
 
 void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+void read_requesthdrs(rio_t *rp, char *etag, char *since);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+void serve_static(int fd, char *filename, struct stat *sbuf, char *etag, char *since);
 void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg);
+void sigterm_handler(int sig);
+
+static int listenfd;
+static volatile sig_atomic_t draining;
 
 int main(int argc, char **argv) 
 {
-    int listenfd, connfd;
+    int connfd, nworkers = -1, c;
     char hostname[MAXLINE], port[MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    while ((c = getopt(argc, argv, "w:")) != -1)
+        if (c != 'w' || (nworkers = atoi(optarg)) < 0)
+            argc = 0;
+    if (optind != argc - 1) {
+	fprintf(stderr, "usage: %s [-w workers] <port>\n", argv[0]);
 	exit(1);
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    if (nworkers >= 0) {
+        supervise(nworkers);
+        listenfd = Open_reuseport_listenfd(argv[optind]);
+    } else
+        listenfd = Open_listenfd(argv[optind]);
+    Signal(SIGTERM, sigterm_handler);
     while (1) {
 	clientlen = sizeof(clientaddr);
-	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
+	connfd = accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
+        if (connfd < 0) {
+            if (draining)
+                exit(0);
+            unix_error("Accept error");
+        }
         Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
                     port, MAXLINE, 0);
         printf("Accepted connection from (%s, %s)\n", hostname, port);
@@ -50,6 +72,7 @@ void doit(int fd)
     struct stat sbuf;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
+    char etag[MAXLINE], since[MAXLINE];
     rio_t rio;
 
     /* Read request line and headers */
@@ -63,7 +86,7 @@ void doit(int fd)
                     "Tiny does not implement this method");
         return;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
+    read_requesthdrs(&rio, etag, since);                 //line:netp:doit:readrequesthdrs
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
@@ -79,7 +102,7 @@ void doit(int fd)
 			"Tiny couldn't read the file");
 	    return;
 	}
-	serve_static(fd, filename, sbuf.st_size);        //line:netp:doit:servestatic
+	serve_static(fd, filename, &sbuf, etag, since);  //line:netp:doit:servestatic
     }
     else { /* Serve dynamic content */
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
@@ -93,16 +116,22 @@ void doit(int fd)
 /* $end doit */
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_requesthdrs - read HTTP request headers, keeping the values of
+ *     If-None-Match in etag and If-Modified-Since in since ("" if absent)
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+void read_requesthdrs(rio_t *rp, char *etag, char *since) 
 {
     char buf[MAXLINE];
 
+    etag[0] = since[0] = '\0';
     Rio_readlineb(rp, buf, MAXLINE);
     printf("%s", buf);
     while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
+	if (!strncasecmp(buf, "If-None-Match:", 14))
+	    sscanf(buf + 14, " %[^\r\n]", etag);
+	else if (!strncasecmp(buf, "If-Modified-Since:", 18))
+	    sscanf(buf + 18, " %[^\r\n]", since);
 	Rio_readlineb(rp, buf, MAXLINE);
 	printf("%s", buf);
     }
@@ -143,21 +172,41 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - copy a file back to the client, or just tell it that
+ *     its copy is still good (304) if the client's validators match the
+ *     file's ETag (size and modification time) or Last-Modified
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize) 
+void serve_static(int fd, char *filename, struct stat *sbuf, char *etag, char *since) 
 {
-    int srcfd;
+    int srcfd, filesize = sbuf->st_size, len;
     char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    char tag[MAXLINE], modified[MAXLINE];
+
+    /* Validators of the file */
+    sprintf(tag, "\"%lx-%lx\"", (long)sbuf->st_size, (long)sbuf->st_mtime);
+    strftime(modified, MAXLINE, "%a, %d %b %Y %H:%M:%S GMT", gmtime(&sbuf->st_mtime));
+    if (etag[0] ? strstr(etag, tag) != NULL : !strcmp(since, modified)) {
+	len = snprintf(buf, sizeof(buf), "HTTP/1.0 304 Not Modified\r\n");
+	len += snprintf(buf + len, sizeof(buf) - len, "Server: Tiny Web Server\r\n");
+	len += snprintf(buf + len, sizeof(buf) - len, "Connection: close\r\n");
+	len += snprintf(buf + len, sizeof(buf) - len, "ETag: %s\r\n", tag);
+	snprintf(buf + len, sizeof(buf) - len, "Last-Modified: %s\r\n\r\n", modified);
+	Rio_writen(fd, buf, strlen(buf));
+	printf("Response headers:\n");
+	printf("%s", buf);
+	return;
+    }
  
     /* Send response headers to client */
     get_filetype(filename, filetype);       //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");    //line:netp:servestatic:beginserve
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
+    len = snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\n");    //line:netp:servestatic:beginserve
+    len += snprintf(buf + len, sizeof(buf) - len, "Server: Tiny Web Server\r\n");
+    len += snprintf(buf + len, sizeof(buf) - len, "Connection: close\r\n");
+    len += snprintf(buf + len, sizeof(buf) - len, "ETag: %s\r\n", tag);
+    len += snprintf(buf + len, sizeof(buf) - len, "Last-Modified: %s\r\n", modified);
+    len += snprintf(buf + len, sizeof(buf) - len, "Content-length: %d\r\n", filesize);
+    snprintf(buf + len, sizeof(buf) - len, "Content-type: %s\r\n\r\n", filetype);
     Rio_writen(fd, buf, strlen(buf));       //line:netp:servestatic:endserve
     printf("Response headers:\n");
     printf("%s", buf);
@@ -220,13 +269,14 @@ void clienterror(int fd, char *cause, char *errnum,
 		 char *shortmsg, char *longmsg) 
 {
     char buf[MAXLINE], body[MAXBUF];
+    int len;
 
     /* Build the HTTP response body */
-    sprintf(body, "<html><title>Tiny Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The Tiny Web server</em>\r\n", body);
+    len = snprintf(body, sizeof(body), "<html><title>Tiny Error</title>");
+    len += snprintf(body + len, sizeof(body) - len, "<body bgcolor=""ffffff"">\r\n");
+    len += snprintf(body + len, sizeof(body) - len, "%s: %s\r\n", errnum, shortmsg);
+    len += snprintf(body + len, sizeof(body) - len, "<p>%s: %s\r\n", longmsg, cause);
+    snprintf(body + len, sizeof(body) - len, "<hr><em>The Tiny Web server</em>\r\n");
 
     /* Print the HTTP response */
     sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
@@ -238,3 +288,13 @@ void clienterror(int fd, char *cause, char *errnum,
     Rio_writen(fd, body, strlen(body));
 }
 /* $end clienterror */
+
+/*
+ * sigterm_handler - Stop taking connections; the one being served, if
+ *     any, is finished first, and then accept fails and tiny exits.
+ */
+void sigterm_handler(int sig) 
+{
+    draining = 1;
+    shutdown(listenfd, SHUT_RD);
+}